@@ -137,8 +137,13 @@ project "dumprwtree"
 	includedirs { "." }
 	libdirs { Libdir }
 	links { "librw" }
+	filter { "platforms:linux*" }
+		links { "pthread" }
+	filter {}
 
 function findlibs()
+	filter { "platforms:linux*" }
+		links { "pthread" }
 	filter { "platforms:linux*gl3" }
 		links { "GL" }
 		if _OPTIONS["gfxlib"] == "glfw" then
@@ -272,6 +277,16 @@ project "ska2anm"
 	findlibs()
 	removeplatforms { "*gl3", "*d3d9", "*ps2" }
 
+project "mathbench"
+	kind "ConsoleApp"
+	targetdir (Bindir)
+	files { path.join("tools/mathbench", "*.cpp") }
+	includedirs { "." }
+	libdirs { Libdir }
+	links { "librw" }
+	findlibs()
+	removeplatforms { "*gl3", "*d3d9", "*ps2" }
+
 project "ps2test"
 	kind "ConsoleApp"
 	targetdir (Bindir)
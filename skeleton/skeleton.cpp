@@ -170,6 +170,8 @@ EventHandler(Event e, void *param)
 	if (e == INITIALIZE) {
 		ImGui::CreateContext();
 	}
+	if(e == IDLE)
+		rw::memoryProfileFrame(*(float*)param);
 
 	s = AppEventHandler(e, param);
 	if(e == QUIT){
@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "rwbase.h"
+#include "rwerror.h"
+#include "rwplg.h"
+#include "rwpipeline.h"
+#include "rwobjects.h"
+#include "rwengine.h"
+
+#ifndef RW_PS2
+#define RW_THREADS
+#include <mutex>
+#endif
+
+#define PLUGIN_ID 0
+
+namespace rw {
+
+/*
+ * Bump allocators for short lived memory.
+ * MEMDUR_FUNCTION memory is taken from the function arena while a
+ * function scope is open, MEMDUR_FRAME memory from the frame arena
+ * which is reset once per frame when a raster is shown. Freeing arena
+ * memory does nothing unless it was the last allocation, so LIFO use
+ * gives the space back right away.
+ * Arenas are per thread, so loader threads don't get in each other's way.
+ * Memory of another thread's arena is recognized by its range and
+ * freeing it does nothing at all.
+ * Whatever doesn't fit (or has another hint) goes to malloc.
+ */
+
+uint32 functionArenaSize = 256*1024;
+uint32 frameArenaSize = 256*1024;
+
+#define MEMDUR(hint) ((hint) & 0xF0000)
+#define ALIGN16(x) (((x) + 0xF) & ~0xF)
+
+struct MemoryArena
+{
+	uint8 *base;
+	uint32 size;
+	uint32 top;
+	uint32 peak;
+	uint8 *last;
+
+	bool32 contains(void *p) { return (uint8*)p >= this->base && (uint8*)p < this->base+this->size; }
+};
+
+#ifdef RW_THREADS
+// Arenas of all threads. Slots are taken under the lock
+// but looked up without it, base is set last.
+#define MAXARENAS 128
+
+static struct
+{
+	std::atomic<uint8*> base[MAXARENAS];
+	uint32 size[MAXARENAS];
+	AtomicInt32 numSlots;	// highest slot ever used + 1
+	std::mutex mutex;
+} allArenas;
+
+static void
+registerArena(MemoryArena *a)
+{
+	std::lock_guard<std::mutex> lock(allArenas.mutex);
+	for(int32 i = 0; i < MAXARENAS; i++)
+		if(allArenas.base[i] == nil){
+			allArenas.size[i] = a->size;
+			allArenas.base[i] = a->base;
+			if(i >= allArenas.numSlots)
+				allArenas.numSlots = i+1;
+			return;
+		}
+	// too many threads, others will see this memory as malloc'd
+}
+
+static void
+unregisterArena(MemoryArena *a)
+{
+	std::lock_guard<std::mutex> lock(allArenas.mutex);
+	for(int32 i = 0; i < allArenas.numSlots; i++)
+		if(allArenas.base[i] == a->base)
+			allArenas.base[i] = nil;
+}
+
+// Returns how many bytes of another thread's arena are behind p
+static uint32
+findForeignArena(void *p)
+{
+	int32 n = allArenas.numSlots;
+	for(int32 i = 0; i < n; i++){
+		uint8 *base = allArenas.base[i];
+		if(base && (uint8*)p >= base && (uint8*)p < base+allArenas.size[i])
+			return base+allArenas.size[i] - (uint8*)p;
+	}
+	return 0;
+}
+#else
+static void registerArena(MemoryArena*) {}
+static void unregisterArena(MemoryArena*) {}
+static uint32 findForeignArena(void*) { return 0; }
+#endif
+
+struct ThreadArenas
+{
+	MemoryArena function;
+	MemoryArena frame;
+	int32 depth;
+
+	~ThreadArenas(void){
+		if(this->function.base)
+			unregisterArena(&this->function);
+		if(this->frame.base)
+			unregisterArena(&this->frame);
+		free(this->function.base);
+		free(this->frame.base);
+	}
+};
+
+static THREADLOCAL ThreadArenas arenas;
+
+static void*
+arenaAlloc(MemoryArena *a, size_t sz, uint32 size)
+{
+	uint32 top;
+	if(a->base == nil){
+		a->size = ALIGN16(size);
+		a->base = (uint8*)malloc(a->size);
+		if(a->base == nil){
+			a->size = 0;
+			return nil;
+		}
+		registerArena(a);
+	}
+	top = ALIGN16(a->top);
+	if(top > a->size || sz > a->size - top)
+		return nil;
+	a->last = a->base + top;
+	a->top = top + (uint32)sz;
+	if(a->top > a->peak)
+		a->peak = a->top;
+	return a->last;
+}
+
+static MemoryArena*
+findArena(void *p)
+{
+	if(arenas.function.contains(p))
+		return &arenas.function;
+	if(arenas.frame.contains(p))
+		return &arenas.frame;
+	return nil;
+}
+
+static void*
+malloc_arena(size_t sz, uint32 hint)
+{
+	void *p;
+	if(sz == 0)
+		return nil;
+	p = nil;
+	if(MEMDUR(hint) == MEMDUR_FUNCTION && arenas.depth > 0)
+		p = arenaAlloc(&arenas.function, sz, functionArenaSize);
+	else if(MEMDUR(hint) == MEMDUR_FRAME)
+		p = arenaAlloc(&arenas.frame, sz, frameArenaSize);
+	return p ? p : malloc(sz);
+}
+
+static void
+free_arena(void *p)
+{
+	MemoryArena *a = findArena(p);
+	if(a == nil){
+		if(findForeignArena(p) == 0)
+			free(p);
+		return;
+	}
+	if(p == a->last){
+		a->top = (uint8*)p - a->base;
+		a->last = nil;
+	}
+}
+
+static void*
+realloc_arena(void *p, size_t sz, uint32 hint)
+{
+	MemoryArena *a;
+	uint32 oldsz;
+	void *q;
+
+	if(p == nil)
+		return malloc_arena(sz, hint);
+	a = findArena(p);
+	if(a == nil){
+		oldsz = findForeignArena(p);
+		if(oldsz == 0)
+			return realloc(p, sz);
+		// can't touch the other arena, copy what might belong to p
+		q = sz ? malloc_arena(sz, hint) : nil;
+		if(q)
+			memcpy(q, p, sz < oldsz ? sz : oldsz);
+		return q;
+	}
+	if(sz == 0){
+		free_arena(p);
+		return nil;
+	}
+	// the last allocation can simply grow
+	if(p == a->last && sz <= a->size - (uint32)((uint8*)p - a->base) &&
+	   (a == &arenas.frame ? MEMDUR(hint) == MEMDUR_FRAME :
+	                         MEMDUR(hint) == MEMDUR_FUNCTION)){
+		a->top = (uint8*)p - a->base + (uint32)sz;
+		if(a->top > a->peak)
+			a->peak = a->top;
+		return p;
+	}
+	// we don't know the old size, but nothing after it in the arena
+	// is more than what was allocated after it
+	oldsz = a->base + a->top - (uint8*)p;
+	q = malloc_arena(sz, hint);
+	if(q)
+		memcpy(q, p, sz < oldsz ? sz : oldsz);
+	return q;
+}
+
+MemoryFunctions arenaMemfuncs = {
+	malloc_arena,
+	realloc_arena,
+	free_arena,
+	nil,
+	nil
+};
+
+uint32
+beginFunctionArena(void)
+{
+	arenas.depth++;
+	return arenas.function.top;
+}
+
+// Everything allocated with MEMDUR_FUNCTION since the
+// matching beginFunctionArena is gone after this.
+void
+endFunctionArena(uint32 mark)
+{
+	assert(arenas.depth > 0);
+	arenas.depth--;
+	arenas.function.top = mark;
+	arenas.function.last = nil;
+}
+
+void
+resetFrameArena(void)
+{
+	arenas.frame.top = 0;
+	arenas.frame.last = nil;
+}
+
+void
+getArenaPeaks(uint32 *function, uint32 *frame)
+{
+	if(function)
+		*function = arenas.function.peak;
+	if(frame)
+		*frame = arenas.frame.peak;
+}
+
+}
@@ -0,0 +1,350 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "rwbase.h"
+#include "rwerror.h"
+#include "rwplg.h"
+#include "rwpipeline.h"
+#include "rwobjects.h"
+#include "rwengine.h"
+
+#ifndef RW_PS2
+#define RW_THREADS
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#endif
+
+#define PLUGIN_ID ID_ASYNCLOADMODULE
+
+namespace rw {
+
+typedef AsyncLoader::Request Request;
+
+#define MAXLOADERTHREADS 8
+
+// a function a worker wants to have run on the main thread
+struct MainCall
+{
+	void *(*func)(void *data);
+	void *data;
+	void *result;
+	bool32 done;
+	MainCall *next;
+};
+
+struct RequestQueue
+{
+	Request *head;
+	Request *tail;
+
+	void add(Request *req){
+		req->next = nil;
+		if(this->tail)
+			this->tail->next = req;
+		else
+			this->head = req;
+		this->tail = req;
+	}
+	Request *pop(void){
+		Request *req = this->head;
+		if(req){
+			this->head = req->next;
+			if(this->head == nil)
+				this->tail = nil;
+			req->next = nil;
+		}
+		return req;
+	}
+};
+
+static struct
+{
+	RequestQueue queued;	// waiting for a worker
+	RequestQueue finished;	// waiting for poll()
+	int32 numPending;
+#ifdef RW_THREADS
+	MainCall *calls;
+	int32 numThreads;
+	int32 numRunning;
+	bool32 quit;
+	std::mutex mutex;
+	std::condition_variable workAvailable;	// wakes workers
+	std::condition_variable mainWake;	// wakes main thread in stop()
+	std::condition_variable callDone;	// wakes workers waiting for a MainCall
+	std::thread threads[MAXLOADERTHREADS];
+#endif
+} loader;
+
+#ifdef RW_THREADS
+static thread_local bool32 isLoaderThread;
+#endif
+
+bool32
+AsyncLoader::onLoaderThread(void)
+{
+#ifdef RW_THREADS
+	return isLoaderThread;
+#else
+	return 0;
+#endif
+}
+
+void*
+AsyncLoader::callMainThread(void *(*func)(void *data), void *data)
+{
+#ifdef RW_THREADS
+	if(isLoaderThread){
+		MainCall call;
+		call.func = func;
+		call.data = data;
+		call.result = nil;
+		call.done = 0;
+		std::unique_lock<std::mutex> lock(loader.mutex);
+		call.next = loader.calls;
+		loader.calls = &call;
+		loader.mainWake.notify_one();
+		while(!call.done)
+			loader.callDone.wait(lock);
+		return call.result;
+	}
+#endif
+	return func(data);
+}
+
+// Run everything workers have queued up so far.
+// Calls queued while we're at it wait for the next poll,
+// that way a big dictionary is spread out over a few frames.
+static void
+runMainCalls(void)
+{
+#ifdef RW_THREADS
+	MainCall *call, *next;
+	{
+		std::lock_guard<std::mutex> lock(loader.mutex);
+		call = loader.calls;
+		loader.calls = nil;
+	}
+	if(call == nil)
+		return;
+	for(; call; call = next){
+		// call lives on the worker's stack and is gone once done is set
+		next = call->next;
+		call->result = call->func(call->data);
+		std::lock_guard<std::mutex> lock(loader.mutex);
+		call->done = 1;
+	}
+	loader.callDone.notify_all();
+#endif
+}
+
+static void
+loadRequest(Request *req)
+{
+	StreamMapped stream;
+	if(stream.open(req->path) == nil){
+		req->state = AsyncLoader::FAILED;
+		return;
+	}
+	// Workers parse in parallel. Reader state is per thread and
+	// shared state is only touched through callMainThread()
+	switch(req->type){
+	case AsyncLoader::CLUMP:
+		if(findChunk(&stream, ID_CLUMP, nil, nil))
+			req->clump = Clump::streamRead(&stream);
+		break;
+	case AsyncLoader::TEXDICTIONARY:
+		if(findChunk(&stream, ID_TEXDICTIONARY, nil, nil))
+			req->texDict = TexDictionary::streamRead(&stream);
+		break;
+	}
+	stream.close();
+	req->state = req->clump || req->texDict ? AsyncLoader::DONE : AsyncLoader::FAILED;
+}
+
+static void
+dirtyRecurse(Frame *f)
+{
+	f->updateObjects();
+	for(Frame *child = f->child; child; child = child->next)
+		dirtyRecurse(child);
+}
+
+// Put a hierarchy loaded by a worker into the dirty list
+static void
+dirtyHierarchy(Frame *f)
+{
+	if(f == nil || f->root->object.privateFlags & Frame::HIERARCHYSYNC)
+		return;
+	dirtyRecurse(f->root);
+}
+
+// Last bits of a request that have to happen on the main thread
+static void
+finishRequest(Request *req)
+{
+	Clump *clump = req->clump;
+	if(clump){
+		dirtyHierarchy(clump->getFrame());
+		FORLIST(lnk, clump->atomics)
+			dirtyHierarchy(Atomic::fromClump(lnk)->getFrame());
+		FORLIST(lnk, clump->lights)
+			dirtyHierarchy(Light::fromClump(lnk)->getFrame());
+		FORLIST(lnk, clump->cameras)
+			dirtyHierarchy(Camera::fromClump(lnk)->getFrame());
+	}
+	loader.numPending--;
+}
+
+#ifdef RW_THREADS
+static void
+workerThread(void)
+{
+	Request *req;
+
+	isLoaderThread = 1;
+	for(;;){
+		{
+			std::unique_lock<std::mutex> lock(loader.mutex);
+			while(loader.queued.head == nil && !loader.quit)
+				loader.workAvailable.wait(lock);
+			if(loader.quit){
+				loader.numRunning--;
+				loader.mainWake.notify_one();
+				return;
+			}
+			req = loader.queued.pop();
+			req->state = AsyncLoader::LOADING;
+		}
+		loadRequest(req);
+		{
+			std::lock_guard<std::mutex> lock(loader.mutex);
+			loader.finished.add(req);
+		}
+	}
+}
+#endif
+
+bool32
+AsyncLoader::start(int32 numThreads)
+{
+#ifdef RW_THREADS
+	if(loader.numThreads)
+		return 0;
+	if(numThreads > MAXLOADERTHREADS)
+		numThreads = MAXLOADERTHREADS;
+	loader.quit = 0;
+	loader.numRunning = numThreads;
+	loader.numThreads = numThreads;
+	for(int32 i = 0; i < numThreads; i++)
+		loader.threads[i] = std::thread(workerThread);
+	return 1;
+#else
+	(void)numThreads;
+	return 0;
+#endif
+}
+
+// Requests that haven't been picked up yet stay queued
+// and are loaded synchronously by poll()
+void
+AsyncLoader::stop(void)
+{
+#ifdef RW_THREADS
+	if(loader.numThreads == 0)
+		return;
+	{
+		std::unique_lock<std::mutex> lock(loader.mutex);
+		loader.quit = 1;
+		loader.workAvailable.notify_all();
+		// workers may still need us to finish what they're doing
+		while(loader.numRunning > 0){
+			if(loader.calls){
+				lock.unlock();
+				runMainCalls();
+				lock.lock();
+			}else
+				loader.mainWake.wait(lock);
+		}
+	}
+	for(int32 i = 0; i < loader.numThreads; i++)
+		loader.threads[i].join();
+	loader.numThreads = 0;
+#endif
+}
+
+static Request*
+request(int32 type, const char *path, void *userData)
+{
+	Request *req = rwNewT(Request, 1, MEMDUR_EVENT | ID_ASYNCLOADMODULE);
+	req->type = type;
+	req->state = AsyncLoader::QUEUED;
+	req->path = rwStrdup(path, MEMDUR_EVENT | ID_ASYNCLOADMODULE);
+	req->clump = nil;
+	req->texDict = nil;
+	req->userData = userData;
+	req->next = nil;
+	loader.numPending++;
+#ifdef RW_THREADS
+	std::lock_guard<std::mutex> lock(loader.mutex);
+	loader.queued.add(req);
+	loader.workAvailable.notify_one();
+#else
+	loader.queued.add(req);
+#endif
+	return req;
+}
+
+Request*
+AsyncLoader::requestClump(const char *path, void *userData)
+{
+	return request(CLUMP, path, userData);
+}
+
+Request*
+AsyncLoader::requestTexDictionary(const char *path, void *userData)
+{
+	return request(TEXDICTIONARY, path, userData);
+}
+
+Request*
+AsyncLoader::poll(void)
+{
+	Request *req;
+
+	runMainCalls();
+	{
+#ifdef RW_THREADS
+		std::lock_guard<std::mutex> lock(loader.mutex);
+		req = loader.finished.pop();
+		if(req == nil && loader.numThreads == 0)
+			req = loader.queued.pop();
+#else
+		req = loader.queued.pop();
+#endif
+	}
+	if(req == nil)
+		return nil;
+	// no worker has seen this one, do it ourselves
+	if(req->state == QUEUED)
+		loadRequest(req);
+	finishRequest(req);
+	return req;
+}
+
+int32
+AsyncLoader::numPending(void)
+{
+	return loader.numPending;
+}
+
+void
+AsyncLoader::Request::destroy(void)
+{
+	rwFree(this->path);
+	rwFree(this);
+}
+
+}
@@ -11,6 +11,13 @@
 #include <sys/types.h>
 #include <dirent.h>
 #endif
+#if defined(__unix__) || defined(__APPLE__)
+#define RW_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #include "rwbase.h"
 #include "rwerror.h"
@@ -155,8 +162,10 @@ cross(const V3d &a, const V3d &b)
 	               a.x*b.y - a.y*b.x);
 }
 
+// Plain C versions, simd.cpp has the ones that are actually used
+
 void
-V3d::transformPoints(V3d *out, const V3d *in, int32 n, const Matrix *m)
+V3d::transformPointsRef(V3d *out, const V3d *in, int32 n, const Matrix *m)
 {
 	int32 i;
 	V3d tmp;
@@ -169,7 +178,7 @@ V3d::transformPoints(V3d *out, const V3d *in, int32 n, const Matrix *m)
 }
 
 void
-V3d::transformVectors(V3d *out, const V3d *in, int32 n, const Matrix *m)
+V3d::transformVectorsRef(V3d *out, const V3d *in, int32 n, const Matrix *m)
 {
 	int32 i;
 	V3d tmp;
@@ -493,7 +502,7 @@ Matrix::lookAt(const V3d &dir, const V3d &up)
  * i.e. a vector is first xformed by src1, then by src2
  */
 void
-Matrix::mult_(Matrix *dst, const Matrix *src1, const Matrix *src2)
+Matrix::multRef_(Matrix *dst, const Matrix *src1, const Matrix *src2)
 {
 	dst->right.x = src1->right.x*src2->right.x + src1->right.y*src2->up.x + src1->right.z*src2->at.x;
 	dst->right.y = src1->right.x*src2->right.y + src1->right.y*src2->up.y + src1->right.z*src2->at.y;
@@ -910,9 +919,35 @@ Stream::readF32(void)
 
 
 
-void
+bool32
 StreamMemory::close(void)
 {
+	if(this->growable && this->data){
+		rwFree(this->data);
+		this->data = nil;
+		this->length = 0;
+		this->capacity = 0;
+		this->position = 0;
+	}
+	return 1;
+}
+
+// Make room for at least size bytes
+static bool32
+growMemory(StreamMemory *s, uint32 size)
+{
+	uint32 cap;
+	if(!s->growable)
+		return 0;
+	cap = s->capacity < 256 ? 256 : s->capacity;
+	while(cap < size){
+		if(cap >= 0x80000000)
+			return 0;
+		cap *= 2;
+	}
+	s->data = rwResizeT(uint8, s->data, cap, MEMDUR_EVENT);
+	s->capacity = cap;
+	return 1;
 }
 
 uint32
@@ -920,6 +955,8 @@ StreamMemory::write8(const void *data, uint32 len)
 {
 	if(this->eof())
 		return 0;
+	if(this->position+len > this->capacity)
+		growMemory(this, this->position+len);
 	uint32 l = len;
 	if(this->position+l > this->length){
 		if(this->position+l > this->capacity)
@@ -959,7 +996,8 @@ StreamMemory::seek(int32 offset, int32 whence)
 		this->position = this->length-offset;
 	if(this->position > this->length){
 		// TODO: ideally this would depend on the mode
-		if(this->position > this->capacity)
+		if(this->position > this->capacity &&
+		   !growMemory(this, this->position))
 			this->position = S_EOF;
 		else
 			this->length = this->position;
@@ -987,9 +1025,50 @@ StreamMemory::open(uint8 *data, uint32 length, uint32 capacity)
 	if(this->capacity < this->length)
 		this->capacity = this->length;
 	this->position = 0;
+	this->growable = 0;
+	return this;
+}
+
+// Open an empty stream for writing that allocates its own memory
+StreamMemory*
+StreamMemory::openGrowable(uint32 capacity)
+{
+	this->data = nil;
+	this->length = 0;
+	this->capacity = 0;
+	this->position = 0;
+	this->growable = 1;
+	if(capacity)
+		growMemory(this, capacity);
 	return this;
 }
 
+// Take ownership of the written data, free it with rwFree.
+// The stream is empty afterwards.
+uint8*
+StreamMemory::detach(uint32 *length)
+{
+	uint8 *data = this->data;
+	if(length)
+		*length = this->length;
+	this->data = nil;
+	this->length = 0;
+	this->capacity = 0;
+	this->position = 0;
+	return data;
+}
+
+const uint8*
+StreamMemory::borrow(uint32 len)
+{
+	const uint8 *p;
+	if(this->eof() || this->position+len > this->length)
+		return nil;
+	p = &this->data[this->position];
+	this->position += len;
+	return p;
+}
+
 uint32
 StreamMemory::getLength(void)
 {
@@ -997,8 +1076,82 @@ StreamMemory::getLength(void)
 }
 
 
+StreamMapped*
+StreamMapped::open(const char *path)
+{
+	assert(this->mapping == nil);
+#ifdef RW_MMAP
+	struct stat st;
+	int fd = ::open(path, O_RDONLY);
+	if(fd < 0){
+		RWERROR((ERR_FILE, path));
+		return nil;
+	}
+	if(fstat(fd, &st) < 0){
+		::close(fd);
+		RWERROR((ERR_FILE, path));
+		return nil;
+	}
+	this->mappedSize = (uint32)st.st_size;
+	this->mapping = nil;
+	if(this->mappedSize > 0){
+		this->mapping = mmap(nil, this->mappedSize, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(this->mapping == MAP_FAILED)
+			this->mapping = nil;
+	}
+	::close(fd);
+	if(this->mapping){
+		// we'll mostly read front to back
+		madvise(this->mapping, this->mappedSize, MADV_SEQUENTIAL);
+		this->isMapped = 1;
+		StreamMemory::open((uint8*)this->mapping, this->mappedSize);
+		return this;
+	}
+#endif
+	// No mmap, just read the whole file
+	this->mapping = getFileContents(path, &this->mappedSize);
+	if(this->mapping == nil){
+		RWERROR((ERR_FILE, path));
+		return nil;
+	}
+	this->isMapped = 0;
+	StreamMemory::open((uint8*)this->mapping, this->mappedSize);
+	return this;
+}
+
+bool32
+StreamMapped::close(void)
+{
+	assert(this->mapping);
+#ifdef RW_MMAP
+	if(this->isMapped)
+		munmap(this->mapping, this->mappedSize);
+	else
+#endif
+		rwFree(this->mapping);
+	this->mapping = nil;
+	this->data = nil;
+	this->length = 0;
+	this->capacity = 0;
+	this->position = 0;
+	return 1;
+}
+
+uint32
+StreamMapped::write8(const void *, uint32)
+{
+	// read only
+	return 0;
+}
+
+
+uint32 StreamFile::defaultBufferSize = 64*1024;
+uint32 StreamFile::numFileReads;
+uint32 StreamFile::numFileWrites;
+uint32 StreamFile::numFileSeeks;
+
 StreamFile*
-StreamFile::open(const char *path, const char *mode)
+StreamFile::open(const char *path, const char *mode, uint32 bufferSize)
 {
 	assert(this->file == nil);
 	this->file = engine->filefuncs.rwfopen(path, mode);
@@ -1006,45 +1159,211 @@ StreamFile::open(const char *path, const char *mode)
 		RWERROR((ERR_FILE, path));
 		return nil;
 	}
+	// we can't keep track of the position when appending
+	this->appending = mode[0] != 'r' && mode[0] != 'w';
+	if(this->appending)
+		bufferSize = 0;
+	this->buffer = nil;
+	this->bufferSize = bufferSize;
+	if(bufferSize)
+		this->buffer = rwNewT(uint8, bufferSize, MEMDUR_EVENT);
+	this->bufStart = 0;
+	this->bufLength = 0;
+	this->bufPos = 0;
+	this->filePos = 0;
+	this->dirty = 0;
+	this->hitEof = 0;
+	this->writeFailed = 0;
 	return this;
 }
 
-void
+bool32
 StreamFile::close(void)
 {
+	bool32 ok;
 	assert(this->file);
-	engine->filefuncs.rwfclose(this->file);
+	ok = this->flush();
+	rwFree(this->buffer);
+	this->buffer = nil;
+	if(engine->filefuncs.rwfclose(this->file) != 0)
+		ok = 0;
 	this->file = nil;
+	return ok && !this->writeFailed;
+}
+
+// Move the file pointer, but only if it isn't there already
+void
+StreamFile::syncFilePos(uint32 pos)
+{
+	if(this->filePos != pos){
+		engine->filefuncs.rwfseek(this->file, pos, 0);
+		numFileSeeks++;
+		this->filePos = pos;
+	}
+}
+
+// Write out dirty data and empty the buffer.
+// Returns 0 if not all of it made it to the file.
+bool32
+StreamFile::flush(void)
+{
+	uint32 n;
+	if(this->buffer == nil)
+		return 1;
+	if(this->dirty){
+		this->syncFilePos(this->bufStart);
+		n = (uint32)engine->filefuncs.rwfwrite(this->buffer, 1, this->bufLength, this->file);
+		numFileWrites++;
+		this->filePos += n;
+		this->dirty = 0;
+		if(n < this->bufLength)
+			this->writeFailed = 1;
+	}
+	this->bufStart += this->bufPos;
+	this->bufLength = 0;
+	this->bufPos = 0;
+	return !this->writeFailed;
+}
+
+// Read the next window of the file into an empty buffer
+uint32
+StreamFile::fill(void)
+{
+	assert(!this->dirty && this->bufPos == this->bufLength);
+	this->bufStart += this->bufPos;
+	this->bufPos = 0;
+	this->syncFilePos(this->bufStart);
+	this->bufLength = (uint32)engine->filefuncs.rwfread(this->buffer, 1, this->bufferSize, this->file);
+	numFileReads++;
+	this->filePos += this->bufLength;
+	return this->bufLength;
 }
 
 uint32
 StreamFile::write8(const void *data, uint32 length)
 {
-	return (uint32)engine->filefuncs.rwfwrite(data, 1, length, this->file);
+	uint32 n;
+	if(this->buffer == nil){
+		numFileWrites++;
+		return (uint32)engine->filefuncs.rwfwrite(data, 1, length, this->file);
+	}
+	// buffered data may be gone already, don't pretend this worked
+	if(this->writeFailed)
+		return 0;
+	// drop read-ahead, the buffer now collects writes
+	if(!this->dirty)
+		this->flush();
+	if(this->bufPos + length > this->bufferSize){
+		if(!this->flush())
+			return 0;
+		if(length >= this->bufferSize){
+			this->syncFilePos(this->bufStart);
+			n = (uint32)engine->filefuncs.rwfwrite(data, 1, length, this->file);
+			numFileWrites++;
+			this->filePos += n;
+			this->bufStart = this->filePos;
+			if(n < length)
+				this->writeFailed = 1;
+			return n;
+		}
+	}
+	memcpy(this->buffer+this->bufPos, data, length);
+	this->bufPos += length;
+	if(this->bufPos > this->bufLength)
+		this->bufLength = this->bufPos;
+	this->dirty = 1;
+	return length;
 }
 
 uint32
 StreamFile::read8(void *data, uint32 length)
 {
-	return (uint32)engine->filefuncs.rwfread(data, 1, length, this->file);
+	uint8 *dst = (uint8*)data;
+	uint32 n, total;
+	if(this->buffer == nil){
+		numFileReads++;
+		return (uint32)engine->filefuncs.rwfread(data, 1, length, this->file);
+	}
+	if(this->dirty)
+		this->flush();
+	total = 0;
+	while(length > 0){
+		n = this->bufLength - this->bufPos;
+		if(n == 0){
+			// big reads go straight into the destination
+			if(length >= this->bufferSize){
+				this->bufStart += this->bufPos;
+				this->bufLength = 0;
+				this->bufPos = 0;
+				this->syncFilePos(this->bufStart);
+				n = (uint32)engine->filefuncs.rwfread(dst, 1, length, this->file);
+				numFileReads++;
+				this->filePos += n;
+				this->bufStart = this->filePos;
+				if(n < length)
+					this->hitEof = 1;
+				return total + n;
+			}
+			if(this->fill() == 0)
+				break;
+			n = this->bufLength;
+		}
+		if(n > length)
+			n = length;
+		memcpy(dst, this->buffer+this->bufPos, n);
+		this->bufPos += n;
+		dst += n;
+		total += n;
+		length -= n;
+	}
+	// like stdio, eof is only set by a short read
+	if(length > 0)
+		this->hitEof = 1;
+	return total;
 }
 
 void
 StreamFile::seek(int32 offset, int32 whence)
 {
-	engine->filefuncs.rwfseek(this->file, offset, whence);
+	uint32 pos;
+	if(this->buffer == nil){
+		engine->filefuncs.rwfseek(this->file, offset, whence);
+		numFileSeeks++;
+		return;
+	}
+	this->hitEof = 0;
+	if(whence == 2){
+		this->flush();
+		engine->filefuncs.rwfseek(this->file, offset, whence);
+		numFileSeeks++;
+		this->filePos = engine->filefuncs.rwftell(this->file);
+		this->bufStart = this->filePos;
+		return;
+	}
+	pos = whence == 0 ? offset : this->bufStart + this->bufPos + offset;
+	if(pos >= this->bufStart && pos <= this->bufStart + this->bufLength){
+		this->bufPos = pos - this->bufStart;
+		return;
+	}
+	// outside the buffer, the file pointer is moved on the next access
+	this->flush();
+	this->bufStart = pos;
 }
 
 uint32
 StreamFile::tell(void)
 {
-	return engine->filefuncs.rwftell(this->file);
+	if(this->buffer == nil)
+		return engine->filefuncs.rwftell(this->file);
+	return this->bufStart + this->bufPos;
 }
 
 bool
 StreamFile::eof(void)
 {
-	return engine->filefuncs.rwfeof(this->file) != 0;
+	if(this->buffer == nil)
+		return engine->filefuncs.rwfeof(this->file) != 0;
+	return !!this->hitEof;
 }
 
 bool
@@ -1058,6 +1377,30 @@ writeChunkHeader(Stream *s, int32 type, int32 size)
 	return true;
 }
 
+// Start a chunk whose size is filled in by endChunk once it's written.
+// On streams that can't seek back nothing is written and -1 returned,
+// the caller has to write the header with the right size itself then.
+int32
+beginChunk(Stream *s, int32 type)
+{
+	if(!s->seekable())
+		return -1;
+	int32 chunk = s->tell();
+	writeChunkHeader(s, type, 0);
+	return chunk;
+}
+
+void
+endChunk(Stream *s, int32 chunk)
+{
+	if(chunk < 0 || s->eof())
+		return;
+	uint32 end = s->tell();
+	s->seek(chunk+4, 0);
+	s->writeI32(end - chunk - 12);
+	s->seek(end, 0);
+}
+
 bool
 readChunkHeaderInfo(Stream *s, ChunkHeaderInfo *header)
 {
@@ -13,7 +13,7 @@
 
 namespace rw {
 
-int32 Camera::numAllocated;
+AtomicInt32 Camera::numAllocated;
 
 PluginList Camera::s_plglist(sizeof(Camera));
 
@@ -439,6 +439,53 @@ Camera::frustumTestSphere(const Sphere *s) const
 	return res;
 }
 
+// Like frustumTestSphere on each, for spheres stored as separate arrays.
+// Writes the indices of those not outside to visible, returns their number.
+int32
+Camera::frustumTestSpheresRef(const float32 *x, const float32 *y, const float32 *z,
+                              const float32 *r, int32 n, int32 *visible) const
+{
+	int32 i, j, numVisible;
+	float32 dist;
+	const FrustumPlane *p;
+	numVisible = 0;
+	for(i = 0; i < n; i++){
+		p = this->frustumPlanes;
+		for(j = 0; j < 6; j++, p++){
+			dist = p->plane.normal.x*x[i] + p->plane.normal.y*y[i] +
+				p->plane.normal.z*z[i] - p->plane.distance;
+			if(dist > r[i])
+				break;
+		}
+		if(j == 6)
+			visible[numVisible++] = i;
+	}
+	return numVisible;
+}
+
+int32
+Camera::frustumTestBBox(const BBox *box) const
+{
+	int32 res = BOXINSIDE;
+	V3d inner, outer;
+	const FrustumPlane *p = this->frustumPlanes;
+	for(int32 i = 0; i < 6; i++){
+		// corners farthest and nearest along the normal
+		outer.x = p->closestX ? box->sup.x : box->inf.x;
+		outer.y = p->closestY ? box->sup.y : box->inf.y;
+		outer.z = p->closestZ ? box->sup.z : box->inf.z;
+		inner.x = p->closestX ? box->inf.x : box->sup.x;
+		inner.y = p->closestY ? box->inf.y : box->sup.y;
+		inner.z = p->closestZ ? box->inf.z : box->sup.z;
+		if(dot(p->plane.normal, inner) > p->plane.distance)
+			return BOXOUTSIDE;
+		if(dot(p->plane.normal, outer) > p->plane.distance)
+			res = BOXBOUNDARY;
+		p++;
+	}
+	return res;
+}
+
 struct CameraChunkData
 {
 	V2d viewWindow;
@@ -474,7 +521,9 @@ bool
 Camera::streamWrite(Stream *stream)
 {
 	CameraChunkData buf;
-	writeChunkHeader(stream, ID_CAMERA, this->streamGetSize());
+	int32 chunk = beginChunk(stream, ID_CAMERA);
+	if(chunk < 0)
+		writeChunkHeader(stream, ID_CAMERA, this->streamGetSize());
 	writeChunkHeader(stream, ID_STRUCT, sizeof(CameraChunkData));
 	buf.viewWindow = this->viewWindow;
 	buf.viewOffset = this->viewOffset;
@@ -484,6 +533,7 @@ Camera::streamWrite(Stream *stream)
 	buf.projection = this->projection;
 	stream->write32(&buf, sizeof(CameraChunkData));
 	s_plglist.streamWrite(stream, this);
+	endChunk(stream, chunk);
 	return true;
 }
 
@@ -14,11 +14,16 @@
 
 namespace rw {
 
-int32 Clump::numAllocated;
-int32 Atomic::numAllocated;
+AtomicInt32 Clump::numAllocated;
+AtomicInt32 Atomic::numAllocated;
 
 PluginList Clump::s_plglist(sizeof(Clump));
 PluginList Atomic::s_plglist(sizeof(Atomic));
+FreeList *Atomic::s_freeList;
+
+static Atomic *initAtomic(Atomic *atomic);
+static Atomic *copyAtomic(Atomic *atomic, Atomic *src);
+static void deinitAtomic(Atomic *atomic);
 
 //
 // Clump
@@ -52,12 +57,24 @@ Clump::clone(void)
 	Clump *clump = Clump::create();
 	Frame *root = this->getFrame()->cloneAndLink();
 	clump->setFrame(root);
+
+	// Take all atomics from the free list in one go,
+	// fall back to single allocations if that fails
+	int32 i = 0, numMem = 0;
+	int32 numAtomics = this->countAtomics();
+	void **mem = rwNewT(void*, numAtomics, MEMDUR_FUNCTION | ID_CLUMP);
+	if(mem)
+		numMem = Atomic::s_freeList->allocBatch(mem, numAtomics);
 	FORLIST(lnk, this->atomics){
 		Atomic *a = Atomic::fromClump(lnk);
-		Atomic *atomic = a->clone();
+		Atomic *atomic = i < numMem ?
+			copyAtomic(initAtomic((Atomic*)mem[i++]), a) :
+			a->clone();
 		atomic->setFrame(a->getFrame()->root);
 		clump->addAtomic(atomic);
 	}
+	if(mem)
+		rwFree(mem);
 	this->getFrame()->purgeClone();
 
 	// World extension
@@ -73,10 +90,23 @@ Clump::destroy(void)
 {
 	Frame *f;
 	s_plglist.destruct(this);
+
+	// Return all atomics to the free list in one go
+	int32 numMem = 0;
+	int32 numAtomics = this->countAtomics();
+	void **mem = rwNewT(void*, numAtomics, MEMDUR_FUNCTION | ID_CLUMP);
 	FORLIST(lnk, this->atomics){
 		Atomic *a = Atomic::fromClump(lnk);
 		this->removeAtomic(a);
-		a->destroy();
+		if(mem){
+			deinitAtomic(a);
+			mem[numMem++] = a;
+		}else
+			a->destroy();
+	}
+	if(mem){
+		Atomic::s_freeList->freeBatch(mem, numMem);
+		rwFree(mem);
 	}
 	FORLIST(lnk, this->lights){
 		Light *l = Light::fromClump(lnk);
@@ -152,6 +182,7 @@ Clump::streamRead(Stream *stream)
 	Clump *clump;
 	int32 numGeometries;
 	Geometry **geometryList;
+	uint32 arena;
 
 	if(!findChunk(stream, ID_STRUCT, &length, &version)){
 		RWERROR((ERR_CHUNK, "STRUCT"));
@@ -168,6 +199,7 @@ Clump::streamRead(Stream *stream)
 	clump = Clump::create();
 	if(clump == nil)
 		return nil;
+	arena = beginFunctionArena();
 
 	// Frame list
 	FrameList_ frmlst;
@@ -270,8 +302,10 @@ Clump::streamRead(Stream *stream)
 			geometryList[i]->destroy();
 	rwFree(geometryList);
 	rwFree(frmlst.frames);
-	if(s_plglist.streamRead(stream, clump))
+	if(s_plglist.streamRead(stream, clump)){
+		endFunctionArena(arena);
 		return clump;
+	}
 
 failgeo:
 	for(int32 i = 0; i < numGeometries; i++)
@@ -280,6 +314,7 @@ failgeo:
 	rwFree(geometryList);
 fail:
 	rwFree(frmlst.frames);
+	endFunctionArena(arena);
 	clump->destroy();
 	return nil;
 }
@@ -287,8 +322,10 @@ fail:
 bool
 Clump::streamWrite(Stream *stream)
 {
-	int size = this->streamGetSize();
-	writeChunkHeader(stream, ID_CLUMP, size);
+	int size;
+	int32 chunk = beginChunk(stream, ID_CLUMP);
+	if(chunk < 0)
+		writeChunkHeader(stream, ID_CLUMP, this->streamGetSize());
 	int32 numAtomics = this->countAtomics();
 	int32 numLights = this->countLights();
 	int32 numCameras = this->countCameras();
@@ -304,14 +341,18 @@ Clump::streamWrite(Stream *stream)
 	frmlst.streamWrite(stream);
 
 	if(rw::version >= 0x30400){
-		size = 12+4;
-		FORLIST(lnk, this->atomics)
-			size += 12 + Atomic::fromClump(lnk)->geometry->streamGetSize();
-		writeChunkHeader(stream, ID_GEOMETRYLIST, size);
+		int32 geochunk = beginChunk(stream, ID_GEOMETRYLIST);
+		if(geochunk < 0){
+			size = 12+4;
+			FORLIST(lnk, this->atomics)
+				size += 12 + Atomic::fromClump(lnk)->geometry->streamGetSize();
+			writeChunkHeader(stream, ID_GEOMETRYLIST, size);
+		}
 		writeChunkHeader(stream, ID_STRUCT, 4);
 		stream->writeI32(numAtomics);	// same as numGeometries
 		FORLIST(lnk, this->atomics)
 			Atomic::fromClump(lnk)->geometry->streamWrite(stream);
+		endChunk(stream, geochunk);
 	}
 
 	FORLIST(lnk, this->atomics)
@@ -340,6 +381,7 @@ Clump::streamWrite(Stream *stream)
 	rwFree(frmlst.frames);
 
 	s_plglist.streamWrite(stream, this);
+	endChunk(stream, chunk);
 	return true;
 }
 
@@ -406,17 +448,26 @@ worldAtomicSync(ObjectWithFrame *obj)
 {
 	Atomic *atomic = (Atomic*)obj;
 	atomic->originalSync(obj);
+	if(atomic->world)
+		atomic->world->updateSector(atomic);
 }
 
 Atomic*
 Atomic::create(void)
 {
-	Atomic *atomic = (Atomic*)rwMalloc(s_plglist.size, MEMDUR_EVENT | ID_ATOMIC);
+	Atomic *atomic = (Atomic*)s_freeList->alloc();
 	if(atomic == nil){
 		RWERROR((ERR_ALLOC, s_plglist.size));
 		return nil;
 	}
-	numAllocated++;
+	return initAtomic(atomic);
+}
+
+// Initialize an atomic in memory taken from the free list
+static Atomic*
+initAtomic(Atomic *atomic)
+{
+	Atomic::numAllocated++;
 	atomic->object.object.init(Atomic::ID, 0);
 	atomic->object.syncCB = atomicSync;
 	atomic->geometry = nil;
@@ -425,7 +476,7 @@ Atomic::create(void)
 	atomic->worldBoundingSphere.center.set(0.0f, 0.0f, 0.0f);
 	atomic->worldBoundingSphere.radius = 0.0f;
 	atomic->setFrame(nil);
-	atomic->object.object.privateFlags |= WORLDBOUNDDIRTY;
+	atomic->object.object.privateFlags |= Atomic::WORLDBOUNDDIRTY;
 	atomic->clump = nil;
 	atomic->inClump.init();
 	atomic->pipeline = nil;
@@ -435,10 +486,11 @@ Atomic::create(void)
 
 	// World extension
 	atomic->world = nil;
+	atomic->sector = nil;
 	atomic->originalSync = atomic->object.syncCB;
 	atomic->object.syncCB = worldAtomicSync;
 
-	s_plglist.construct(atomic);
+	Atomic::s_plglist.construct(atomic);
 	return atomic;
 }
 
@@ -448,30 +500,43 @@ Atomic::clone()
 	Atomic *atomic = Atomic::create();
 	if(atomic == nil)
 		return nil;
-	atomic->object.object.copy(&this->object.object);
-	atomic->object.object.privateFlags |= WORLDBOUNDDIRTY;
-	if(this->geometry)
-		atomic->setGeometry(this->geometry, 0);
-	atomic->renderCB = this->renderCB;
-	atomic->pipeline = this->pipeline;
+	return copyAtomic(atomic, this);
+}
+
+static Atomic*
+copyAtomic(Atomic *atomic, Atomic *src)
+{
+	atomic->object.object.copy(&src->object.object);
+	atomic->object.object.privateFlags |= Atomic::WORLDBOUNDDIRTY;
+	if(src->geometry)
+		atomic->setGeometry(src->geometry, 0);
+	atomic->renderCB = src->renderCB;
+	atomic->pipeline = src->pipeline;
 
 	// World extension doesn't add to world
 
-	s_plglist.copy(atomic, this);
+	Atomic::s_plglist.copy(atomic, src);
 	return atomic;
 }
 
 void
 Atomic::destroy(void)
 {
-	s_plglist.destruct(this);
-	if(this->geometry)
-		this->geometry->destroy();
-	assert(this->clump == nil);
-	assert(this->world == nil);
-	this->setFrame(nil);
-	rwFree(this);
-	numAllocated--;
+	deinitAtomic(this);
+	s_freeList->free(this);
+}
+
+// Tear down an atomic but leave its memory to the caller
+static void
+deinitAtomic(Atomic *atomic)
+{
+	Atomic::s_plglist.destruct(atomic);
+	if(atomic->geometry)
+		atomic->geometry->destroy();
+	assert(atomic->clump == nil);
+	assert(atomic->world == nil);
+	atomic->setFrame(nil);
+	Atomic::numAllocated--;
 }
 
 void
@@ -507,7 +572,7 @@ Atomic::getWorldBoundingSphere(void)
 	return s;
 }
 
-static uint32 atomicRights[2];
+static THREADLOCAL uint32 atomicRights[2];
 
 Atomic*
 Atomic::streamReadClump(Stream *stream,
@@ -558,7 +623,9 @@ Atomic::streamWriteClump(Stream *stream, FrameList_ *frmlst)
 	Clump *c = this->clump;
 	if(c == nil)
 		return false;
-	writeChunkHeader(stream, ID_ATOMIC, this->streamGetSize());
+	int32 chunk = beginChunk(stream, ID_ATOMIC);
+	if(chunk < 0)
+		writeChunkHeader(stream, ID_ATOMIC, this->streamGetSize());
 	writeChunkHeader(stream, ID_STRUCT, rw::version < 0x30400 ? 12 : 16);
 	buf[0] = findPointer(this->getFrame(), (void**)frmlst->frames, frmlst->numFrames);
 
@@ -580,6 +647,7 @@ Atomic::streamWriteClump(Stream *stream, FrameList_ *frmlst)
 	}
 
 	s_plglist.streamWrite(stream, this);
+	endChunk(stream, chunk);
 	return true;
 }
 
@@ -602,20 +670,42 @@ Atomic::getPipeline(void)
 		engine->driver[platform]->defaultPipeline;
 }
 
+// Only GL3 can draw 32 bit indices, elsewhere such
+// geometry is instanced and rendered in 16 bit pieces.
+static bool32
+usePieces(Geometry *geo)
+{
+	return geo->meshHeader && geo->meshHeader->index32 &&
+	       platform != PLATFORM_GL3 && platform != PLATFORM_NULL &&
+	       geo->splitIndex16() > 0;
+}
+
 void
 Atomic::instance(void)
 {
-	if(this->geometry->flags & Geometry::NATIVE)
+	Geometry *geo = this->geometry;
+	if(geo->flags & Geometry::NATIVE)
 		return;
+	// the geometry itself keeps its data and isn't NATIVE
+	if(usePieces(geo)){
+		for(int32 i = 0; i < geo->numPieces; i++){
+			this->geometry = geo->pieces[i];
+			this->instance();
+		}
+		this->geometry = geo;
+		return;
+	}
 	this->getPipeline()->instance(this);
-	this->geometry->flags |= Geometry::NATIVE;
+	geo->flags |= Geometry::NATIVE;
 }
 
 void
 Atomic::uninstance(void)
 {
-	if(!(this->geometry->flags & Geometry::NATIVE))
+	if(!(this->geometry->flags & Geometry::NATIVE)){
+		this->geometry->destroyPieces();
 		return;
+	}
 	this->getPipeline()->uninstance(this);
 	// this should be done by the CB already, just make sure
 	this->geometry->flags &= ~Geometry::NATIVE;
@@ -624,6 +714,15 @@ Atomic::uninstance(void)
 void
 Atomic::defaultRenderCB(Atomic *atomic)
 {
+	Geometry *geo = atomic->geometry;
+	if(usePieces(geo)){
+		for(int32 i = 0; i < geo->numPieces; i++){
+			atomic->geometry = geo->pieces[i];
+			atomic->getPipeline()->render(atomic);
+		}
+		atomic->geometry = geo;
+		return;
+	}
 	atomic->getPipeline()->render(atomic);
 }
 
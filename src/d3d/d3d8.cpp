@@ -257,6 +257,8 @@ instance(rw::ObjPipeline *rwpipe, Atomic *atomic)
 	// TODO: allow for REINSTANCE
 	if(geo->instData)
 		return;
+	if(!checkIndex16(geo))
+		return;
 	InstanceDataHeader *header = rwNewT(InstanceDataHeader, 1, MEMDUR_EVENT | ID_GEOMETRY);
 	MeshHeader *meshh = geo->meshHeader;
 	geo->instData = header;
@@ -338,7 +340,8 @@ render(rw::ObjPipeline *rwpipe, Atomic *atomic)
 	// TODO: allow for REINSTANCE
 	if(geo->instData == nil)
 		pipe->instance(atomic);
-	assert(geo->instData != nil);
+	if(geo->instData == nil)
+		return;
 	assert(geo->instData->platform == PLATFORM_D3D8);
 	if(pipe->renderCB)
 		pipe->renderCB(atomic, (InstanceDataHeader*)geo->instData);
@@ -410,6 +410,8 @@ instance(rw::ObjPipeline *rwpipe, Atomic *atomic)
 
 	// no instance or complete reinstance
 	if(geo->instData == nil){
+		if(!checkIndex16(geo))
+			return;
 		geo->instData = instanceMesh(rwpipe, geo);
 		pipe->instanceCB(geo, (InstanceDataHeader*)geo->instData, 0);
 	}else if(geo->lockedSinceInst)
@@ -458,7 +460,8 @@ render(rw::ObjPipeline *rwpipe, Atomic *atomic)
 	ObjPipeline *pipe = (ObjPipeline*)rwpipe;
 	Geometry *geo = atomic->geometry;
 	pipe->instance(atomic);
-	assert(geo->instData != nil);
+	if(geo->instData == nil)
+		return;
 	assert(geo->instData->platform == PLATFORM_D3D9);
 	if(pipe->renderCB)
 		pipe->renderCB(atomic, (InstanceDataHeader*)geo->instData);
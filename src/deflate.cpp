@@ -0,0 +1,281 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "rwbase.h"
+#include "rwerror.h"
+#include "rwplg.h"
+#include "rwpipeline.h"
+#include "rwobjects.h"
+#include "rwengine.h"
+
+#include "lodepng/lodepng.h"
+
+#define PLUGIN_ID 0
+
+namespace rw {
+
+/*
+ * The compressed stream starts with a magic number, followed by blocks of
+ *	uint32 length	uncompressed size
+ *	uint32 zlength	compressed size
+ *	zlib data
+ * and ends with a block of length 0.
+ * Because every block can be inflated on its own we only have to keep
+ * one in memory, and blocks we seek over don't have to be inflated at all.
+ */
+
+StreamDeflate*
+StreamDeflate::open(Stream *base, bool32 write, uint32 blockSize)
+{
+	assert(this->base == nil);
+	this->base = base;
+	this->writing = write;
+	this->hitEof = 0;
+	this->noMoreBlocks = 0;
+	this->writeFailed = 0;
+	this->blockSize = blockSize;
+	this->windowLength = 0;
+	this->windowPos = 0;
+	this->windowStart = 0;
+	this->zbuf = nil;
+	this->zbufSize = 0;
+	if(write){
+		this->windowSize = blockSize;
+		this->window = rwNewT(uint8, blockSize, MEMDUR_EVENT);
+		base->writeU32(MAGIC);
+	}else{
+		this->windowSize = 0;
+		this->window = nil;
+		if(base->readU32() != MAGIC){
+			RWERROR((ERR_GENERAL, "not a compressed stream"));
+			this->base = nil;
+			return nil;
+		}
+	}
+	return this;
+}
+
+bool32
+StreamDeflate::close(void)
+{
+	if(this->base == nil)
+		return 1;
+	if(this->writing && !this->writeFailed){
+		if(this->windowLength)
+			this->deflateBlock();
+		// no end marker after a failure, readers will stop with an error
+		if(!this->writeFailed &&
+		   (this->base->writeU32(0) != 4 || this->base->writeU32(0) != 4))
+			this->writeFailed = 1;
+	}
+	rwFree(this->window);
+	rwFree(this->zbuf);
+	this->window = nil;
+	this->zbuf = nil;
+	this->base = nil;
+	return !this->writeFailed;
+}
+
+// Compress the window into a block on the base stream.
+// On failure the block is lost and the stream refuses further writes.
+bool32
+StreamDeflate::deflateBlock(void)
+{
+	LodePNGCompressSettings settings;
+	uint8 *out = nil;
+	size_t outsize = 0;
+	uint32 error;
+
+	lodepng_compress_settings_init(&settings);
+	settings.windowsize = 32768;
+	error = lodepng_zlib_compress(&out, &outsize, this->window, this->windowLength, &settings);
+	if(error){
+		RWERROR((ERR_GENERAL, lodepng_error_text(error)));
+		free(out);
+		this->writeFailed = 1;
+		return 0;
+	}
+	if(this->base->writeU32(this->windowLength) != 4 ||
+	   this->base->writeU32((uint32)outsize) != 4 ||
+	   this->base->write8(out, (uint32)outsize) != outsize)
+		this->writeFailed = 1;
+	free(out);
+	this->windowStart += this->windowLength;
+	this->windowLength = 0;
+	this->windowPos = 0;
+	return !this->writeFailed;
+}
+
+uint32
+StreamDeflate::write8(const void *data, uint32 length)
+{
+	const uint8 *src = (const uint8*)data;
+	uint32 n, total;
+	if(!this->writing || this->writeFailed)
+		return 0;
+	total = 0;
+	while(length > 0){
+		n = this->blockSize - this->windowPos;
+		if(n > length)
+			n = length;
+		memcpy(this->window+this->windowPos, src, n);
+		this->windowPos += n;
+		if(this->windowPos > this->windowLength)
+			this->windowLength = this->windowPos;
+		// what went into a lost block doesn't count as written
+		if(this->windowPos == this->blockSize && !this->deflateBlock())
+			return total;
+		src += n;
+		total += n;
+		length -= n;
+	}
+	return total;
+}
+
+bool32
+StreamDeflate::readBlockHeader(uint32 *length, uint32 *zlength)
+{
+	uint32 buf[2];
+	if(this->noMoreBlocks)
+		return 0;
+	if(this->base->read32(buf, 8) != 8 || buf[0] == 0){
+		this->noMoreBlocks = 1;
+		return 0;
+	}
+	*length = buf[0];
+	*zlength = buf[1];
+	return 1;
+}
+
+// Inflate the next block behind what's in the window
+bool32
+StreamDeflate::inflateBlock(uint32 length, uint32 zlength)
+{
+	const uint8 *in;
+	uint8 *out = nil;
+	size_t outsize = 0;
+	uint32 error;
+
+	in = this->base->borrow(zlength);
+	if(in == nil){
+		if(zlength > this->zbufSize){
+			this->zbufSize = zlength;
+			this->zbuf = rwResizeT(uint8, this->zbuf, zlength, MEMDUR_EVENT);
+		}
+		if(this->base->read8(this->zbuf, zlength) != zlength){
+			this->noMoreBlocks = 1;
+			return 0;
+		}
+		in = this->zbuf;
+	}
+	error = lodepng_zlib_decompress(&out, &outsize, in, zlength, &lodepng_default_decompress_settings);
+	if(error || outsize != length){
+		RWERROR((ERR_GENERAL, error ? lodepng_error_text(error) : "bad block length"));
+		free(out);
+		this->noMoreBlocks = 1;
+		return 0;
+	}
+	if(this->windowLength + length > this->windowSize){
+		this->windowSize = this->windowLength + length;
+		this->window = rwResizeT(uint8, this->window, this->windowSize, MEMDUR_EVENT);
+	}
+	memcpy(this->window+this->windowLength, out, length);
+	this->windowLength += length;
+	free(out);
+	return 1;
+}
+
+// Replace the window by the next block but keep a bit of history
+bool32
+StreamDeflate::nextBlock(void)
+{
+	uint32 length, zlength, keep;
+	keep = this->windowLength < (uint32)HISTORY ? this->windowLength : (uint32)HISTORY;
+	if(keep)
+		memmove(this->window, this->window+this->windowLength-keep, keep);
+	this->windowStart += this->windowLength-keep;
+	this->windowPos -= this->windowLength-keep;
+	this->windowLength = keep;
+	if(!this->readBlockHeader(&length, &zlength))
+		return 0;
+	return this->inflateBlock(length, zlength);
+}
+
+uint32
+StreamDeflate::read8(void *data, uint32 length)
+{
+	uint8 *dst = (uint8*)data;
+	uint32 n, total;
+	if(this->writing)
+		return 0;
+	total = 0;
+	while(length > 0){
+		n = this->windowLength - this->windowPos;
+		if(n == 0){
+			if(!this->nextBlock())
+				break;
+			continue;
+		}
+		if(n > length)
+			n = length;
+		memcpy(dst, this->window+this->windowPos, n);
+		this->windowPos += n;
+		dst += n;
+		total += n;
+		length -= n;
+	}
+	// like stdio, eof is only set by a short read
+	if(length > 0)
+		this->hitEof = 1;
+	return total;
+}
+
+void
+StreamDeflate::seek(int32 offset, int32 whence)
+{
+	uint32 pos, length, zlength;
+	assert(whence != 2 && "can't seek from end of compressed stream");
+	this->hitEof = 0;
+	pos = whence == 0 ? offset : this->windowStart + this->windowPos + offset;
+	if(pos >= this->windowStart && pos <= this->windowStart + this->windowLength){
+		this->windowPos = pos - this->windowStart;
+		return;
+	}
+	if(pos < this->windowStart || this->writing){
+		RWERROR((ERR_GENERAL, "can't seek in compressed stream"));
+		this->hitEof = 1;
+		return;
+	}
+	// skip whole blocks without inflating them
+	this->windowStart += this->windowLength;
+	this->windowLength = 0;
+	this->windowPos = 0;
+	while(this->readBlockHeader(&length, &zlength)){
+		if(pos >= this->windowStart + length){
+			this->base->seek(zlength);
+			this->windowStart += length;
+			continue;
+		}
+		if(this->inflateBlock(length, zlength))
+			this->windowPos = pos - this->windowStart;
+		return;
+	}
+	// past the end
+	this->hitEof = 1;
+}
+
+uint32
+StreamDeflate::tell(void)
+{
+	return this->windowStart + this->windowPos;
+}
+
+bool
+StreamDeflate::eof(void)
+{
+	return !!this->hitEof;
+}
+
+}
@@ -18,6 +18,11 @@
 #include "gl/rwgl3.h"
 #include "gl/rwwdgl.h"
 
+#ifndef RW_PS2
+#define RW_THREADS
+#include <mutex>
+#endif
+
 #define PLUGIN_ID 0
 
 // on windows
@@ -36,7 +41,7 @@ Engine::State Engine::state = Dead;
 MemoryFunctions Engine::memfuncs;
 PluginList Driver::s_plglist[NUM_PLATFORMS];
 
-const char *allocLocation;
+THREADLOCAL const char *allocLocation;
 
 void *malloc_h(size_t sz, uint32 hint) { if(sz == 0) return nil; return malloc(sz); }
 void *realloc_h(void *p, size_t sz, uint32 hint) { return realloc(p, sz); }
@@ -47,11 +52,182 @@ struct MemoryBlock
 	uint32 hint;
 	void *origPtr;
 	const char *codeline;
+	int32 idStat;
+	int32 siteStat;
 	LLLink inAllocList;
 };
 LinkList allocations;
 size_t totalMemoryAllocated;
 
+#ifdef RW_THREADS
+// workers of the AsyncLoader allocate too
+static std::mutex managedMutex;
+#define MANAGEDLOCK() std::lock_guard<std::mutex> lock(managedMutex)
+#else
+#define MANAGEDLOCK()
+#endif
+
+/*
+ * Profiling data for managed memory.
+ * Stats are kept per duration, per plugin ID and per call site.
+ * The tables use plain malloc so they don't show up in themselves.
+ */
+
+#define NUMDURATIONS 5
+#define MEMDURINDEX(hint) (((hint)>>16 & 0xF) < NUMDURATIONS ? (hint)>>16 & 0xF : 0)
+#define MEMID(hint) ((hint) & 0xFFFF)
+
+struct MemoryStatTable
+{
+	MemoryStat *stats;
+	uintptr *keys;
+	int32 numStats;
+	int32 space;
+	int32 *hash;	// index+1, 0 is empty
+	int32 hashSize;
+};
+
+static MemoryStat durationStats[NUMDURATIONS];
+static MemoryStatTable idStats;
+static MemoryStatTable siteStats;
+static MemoryStat totalStats;
+static uint32 lastNumAllocs;
+static size_t lastBytesAllocated;
+static size_t bytesAllocated;	// ever
+static MemoryRates memoryRates;
+
+static void
+clearStatTable(MemoryStatTable *t)
+{
+	free(t->stats);
+	free(t->keys);
+	free(t->hash);
+	memset(t, 0, sizeof(*t));
+}
+
+static uint32
+hashKey(uintptr key)
+{
+	uint64 k = (uint64)key;
+	k ^= k >> 33;
+	k *= 0xFF51AFD7ED558CCDULL;
+	k ^= k >> 33;
+	return (uint32)k;
+}
+
+static void
+rehashStatTable(MemoryStatTable *t, int32 size)
+{
+	int32 i, h;
+	free(t->hash);
+	t->hashSize = size;
+	t->hash = (int32*)calloc(size, sizeof(int32));
+	for(i = 0; i < t->numStats; i++){
+		for(h = hashKey(t->keys[i]) & (size-1); t->hash[h]; h = (h+1) & (size-1));
+		t->hash[h] = i+1;
+	}
+}
+
+// Find the stat for a key or make a new one, returns -1 if out of memory
+static int32
+findStat(MemoryStatTable *t, uintptr key)
+{
+	int32 h, i;
+	if(t->hashSize){
+		for(h = hashKey(key) & (t->hashSize-1); t->hash[h]; h = (h+1) & (t->hashSize-1))
+			if(t->keys[t->hash[h]-1] == key)
+				return t->hash[h]-1;
+	}
+	if(t->numStats >= t->space){
+		int32 space = t->space ? t->space*2 : 64;
+		MemoryStat *stats = (MemoryStat*)realloc(t->stats, space*sizeof(MemoryStat));
+		if(stats == nil)
+			return -1;
+		t->stats = stats;
+		uintptr *keys = (uintptr*)realloc(t->keys, space*sizeof(uintptr));
+		if(keys == nil)
+			return -1;
+		t->keys = keys;
+		t->space = space;
+	}
+	i = t->numStats++;
+	t->keys[i] = key;
+	memset(&t->stats[i], 0, sizeof(MemoryStat));
+	// keep the load factor below one half
+	if(t->numStats*2 > t->hashSize)
+		rehashStatTable(t, t->hashSize ? t->hashSize*2 : 128);
+	else{
+		for(h = hashKey(key) & (t->hashSize-1); t->hash[h]; h = (h+1) & (t->hashSize-1));
+		t->hash[h] = i+1;
+	}
+	return i;
+}
+
+static void
+statAdd(MemoryStat *s, size_t sz)
+{
+	s->current += sz;
+	if(s->current > s->peak)
+		s->peak = s->current;
+	s->numBlocks++;
+	s->numAllocs++;
+}
+
+static void
+statRemove(MemoryStat *s, size_t sz)
+{
+	s->current -= sz;
+	s->numBlocks--;
+}
+
+static void
+addBlockStats(MemoryBlock *mem)
+{
+	totalMemoryAllocated += mem->sz;
+	bytesAllocated += mem->sz;
+	statAdd(&totalStats, mem->sz);
+	statAdd(&durationStats[MEMDURINDEX(mem->hint)], mem->sz);
+	mem->idStat = findStat(&idStats, MEMID(mem->hint));
+	if(mem->idStat >= 0){
+		idStats.stats[mem->idStat].hint = MEMID(mem->hint);
+		statAdd(&idStats.stats[mem->idStat], mem->sz);
+	}
+	mem->siteStat = findStat(&siteStats, (uintptr)mem->codeline);
+	if(mem->siteStat >= 0){
+		siteStats.stats[mem->siteStat].site = mem->codeline;
+		statAdd(&siteStats.stats[mem->siteStat], mem->sz);
+	}
+}
+
+static void
+removeBlockStats(MemoryBlock *mem)
+{
+	totalMemoryAllocated -= mem->sz;
+	statRemove(&totalStats, mem->sz);
+	statRemove(&durationStats[MEMDURINDEX(mem->hint)], mem->sz);
+	if(mem->idStat >= 0)
+		statRemove(&idStats.stats[mem->idStat], mem->sz);
+	if(mem->siteStat >= 0)
+		statRemove(&siteStats.stats[mem->siteStat], mem->sz);
+}
+
+static void
+resetMemoryStats(void)
+{
+	int32 i;
+	clearStatTable(&idStats);
+	clearStatTable(&siteStats);
+	memset(&totalStats, 0, sizeof(totalStats));
+	memset(&memoryRates, 0, sizeof(memoryRates));
+	for(i = 0; i < NUMDURATIONS; i++){
+		memset(&durationStats[i], 0, sizeof(MemoryStat));
+		durationStats[i].hint = i<<16;
+	}
+	lastNumAllocs = 0;
+	lastBytesAllocated = 0;
+	bytesAllocated = 0;
+}
+
 // We align managed memory blocks on a 16 byte boundary
 
 #define ALIGN16(x) ((x) + 0xF & ~0xF)
@@ -66,7 +242,6 @@ malloc_managed(size_t sz, uint32 hint)
 	origPtr = malloc(sz + sizeof(MemoryBlock) + 15);
 	if(origPtr == nil)
 		return nil;
-	totalMemoryAllocated += sz;
 	data = (uint8*)origPtr;
 	data += sizeof(MemoryBlock);
 	data = (uint8*)ALIGN16((uintptr)data);
@@ -76,6 +251,8 @@ malloc_managed(size_t sz, uint32 hint)
 	mem->hint = hint;
 	mem->origPtr = origPtr;
 	mem->codeline = allocLocation;
+	MANAGEDLOCK();
+	addBlockStats(mem);
 	allocations.add(&mem->inAllocList);
 
 	return data;
@@ -94,6 +271,7 @@ realloc_managed(void *p, size_t sz, uint32 hint)
 	mem = (MemoryBlock*)((uint8*)p-sizeof(MemoryBlock));
 	offset = (uint8*)p - (uint8*)mem->origPtr;
 
+	MANAGEDLOCK();
 	mem->inAllocList.remove();
 
 	origPtr = realloc(mem->origPtr, sz + sizeof(MemoryBlock) + 15);
@@ -103,13 +281,13 @@ realloc_managed(void *p, size_t sz, uint32 hint)
 	}
 	p = (uint8*)origPtr + offset;
 	mem = (MemoryBlock*)((uint8*)p-sizeof(MemoryBlock));
-	totalMemoryAllocated -= mem->sz;
+	removeBlockStats(mem);
 	mem->sz = sz;
 	mem->hint = hint;
 	mem->origPtr = origPtr;
 	mem->codeline = allocLocation;
 	allocations.add(&mem->inAllocList);
-	totalMemoryAllocated += mem->sz;
+	addBlockStats(mem);
 
 	return p;
 }
@@ -121,8 +299,11 @@ free_managed(void *p)
 	if(p == nil)
 		return;
 	mem = (MemoryBlock*)((uint8*)p-sizeof(MemoryBlock));
-	mem->inAllocList.remove();
-	totalMemoryAllocated -= mem->sz;
+	{
+		MANAGEDLOCK();
+		mem->inAllocList.remove();
+		removeBlockStats(mem);
+	}
 	free(mem->origPtr);
 }
 
@@ -135,6 +316,165 @@ printleaks(void)
 	}
 }
 
+// Copy out the stats of one kind, returns how many there are in total
+int32
+getMemoryStats(int32 kind, MemoryStat *stats, int32 maxStats)
+{
+	MemoryStat *src;
+	int32 n;
+
+	MANAGEDLOCK();
+	switch(kind){
+	case MEMSTAT_TOTAL:
+		src = &totalStats;
+		n = 1;
+		break;
+	case MEMSTAT_DURATION:
+		src = durationStats;
+		n = NUMDURATIONS;
+		break;
+	case MEMSTAT_ID:
+		src = idStats.stats;
+		n = idStats.numStats;
+		break;
+	case MEMSTAT_SITE:
+		src = siteStats.stats;
+		n = siteStats.numStats;
+		break;
+	default:
+		return 0;
+	}
+	if(stats)
+		memcpy(stats, src, (n < maxStats ? n : maxStats)*sizeof(MemoryStat));
+	return n;
+}
+
+// Call once per frame with the time it took
+void
+memoryProfileFrame(float timeStep)
+{
+	MANAGEDLOCK();
+	memoryRates.allocsPerFrame = totalStats.numAllocs - lastNumAllocs;
+	memoryRates.bytesPerFrame = bytesAllocated - lastBytesAllocated;
+	if(timeStep > 0.0f){
+		memoryRates.allocsPerSecond = memoryRates.allocsPerFrame/timeStep;
+		memoryRates.bytesPerSecond = memoryRates.bytesPerFrame/timeStep;
+	}
+	lastNumAllocs = totalStats.numAllocs;
+	lastBytesAllocated = bytesAllocated;
+}
+
+MemoryRates*
+getMemoryRates(MemoryRates *rates)
+{
+	MANAGEDLOCK();
+	*rates = memoryRates;
+	return rates;
+}
+
+static void
+dumpString(Stream *stream, const char *str)
+{
+	char c;
+	stream->write8("\"", 1);
+	for(; *str; str++){
+		c = *str;
+		if(c == '"' || c == '\\')
+			stream->write8("\\", 1);
+		if((uint8)c < 0x20)
+			c = ' ';
+		stream->write8(&c, 1);
+	}
+	stream->write8("\"", 1);
+}
+
+static void
+dumpStat(Stream *stream, MemoryStat *s, bool32 last)
+{
+	char line[256];
+	int n;
+	n = snprintf(line, sizeof(line),
+		"\"current\": %zu, \"peak\": %zu, \"blocks\": %d, \"allocs\": %u }%s\n",
+		s->current, s->peak, s->numBlocks, s->numAllocs, last ? "" : ",");
+	stream->write8(line, n);
+}
+
+static void
+dumpStatList(Stream *stream, const char *name, MemoryStat *stats, int32 n, bool32 sites)
+{
+	char line[64];
+	int32 i;
+	snprintf(line, sizeof(line), "\"%s\": [\n", name);
+	stream->write8(line, strlen(line));
+	for(i = 0; i < n; i++){
+		if(sites){
+			stream->write8("\t{ \"site\": ", 11);
+			dumpString(stream, stats[i].site ? stats[i].site : "unknown");
+			stream->write8(", ", 2);
+		}else{
+			snprintf(line, sizeof(line), "\t{ \"hint\": %u, ", stats[i].hint);
+			stream->write8(line, strlen(line));
+		}
+		dumpStat(stream, &stats[i], i == n-1);
+	}
+}
+
+// Copy of a variable number of stats. Allocating needs the
+// lock as well, so it happens between the copies.
+static MemoryStat*
+copyStats(int32 kind, int32 *n)
+{
+	MemoryStat *stats = nil;
+	int32 space = 0;
+	for(;;){
+		*n = getMemoryStats(kind, stats, space);
+		if(*n <= space)
+			return stats;
+		// our own allocation may have added a stat
+		rwFree(stats);
+		space = *n + 16;
+		stats = rwNewT(MemoryStat, space, MEMDUR_FUNCTION);
+		if(stats == nil){
+			*n = 0;
+			return nil;
+		}
+	}
+}
+
+// Write all stats as JSON.
+// The stream may allocate, so nothing is written while we hold the lock.
+void
+dumpMemoryStats(Stream *stream)
+{
+	char line[256];
+	MemoryStat total, durations[NUMDURATIONS];
+	MemoryStat *ids, *sites;
+	MemoryRates rates;
+	int32 numIds, numSites;
+
+	getMemoryStats(MEMSTAT_TOTAL, &total, 1);
+	getMemoryStats(MEMSTAT_DURATION, durations, NUMDURATIONS);
+	getMemoryRates(&rates);
+	ids = copyStats(MEMSTAT_ID, &numIds);
+	sites = copyStats(MEMSTAT_SITE, &numSites);
+
+	stream->write8("{\n\"total\": { ", 13);
+	dumpStat(stream, &total, 0);
+	snprintf(line, sizeof(line), "\"rates\": { \"allocsPerFrame\": %u, \"bytesPerFrame\": %zu, "
+		"\"allocsPerSecond\": %.1f, \"bytesPerSecond\": %.1f },\n",
+		rates.allocsPerFrame, rates.bytesPerFrame,
+		(double)rates.allocsPerSecond, (double)rates.bytesPerSecond);
+	stream->write8(line, strlen(line));
+	dumpStatList(stream, "durations", durations, NUMDURATIONS, 0);
+	stream->write8("],\n", 3);
+	dumpStatList(stream, "ids", ids, numIds, 0);
+	stream->write8("],\n", 3);
+	dumpStatList(stream, "sites", sites, numSites, 1);
+	stream->write8("]\n}\n", 4);
+	rwFree(ids);
+	rwFree(sites);
+}
+
 // TODO: make the debug out configurable
 void *mustmalloc_h(size_t sz, uint32 hint)
 {
@@ -193,6 +533,7 @@ Engine::init(MemoryFunctions *memfuncs)
 
 	totalMemoryAllocated = 0;
 	allocations.init();
+	resetMemoryStats();
 
 	if(memfuncs)
 		Engine::memfuncs = *memfuncs;
@@ -214,6 +555,7 @@ Engine::init(MemoryFunctions *memfuncs)
 	Image::registerModule();
 	Raster::registerModule();
 	Texture::registerModule();
+	RenderQueue::registerModule();
 
 	// TODO: reset all allocation counts here. or maybe do that in modules?
 	Frame::numAllocated = 0;
@@ -294,6 +636,30 @@ Engine::open(EngineOpenParams *p)
 		engine->driver[i]->rasterToImage = null::rasterToImage;
 	}
 
+	// All plugins should be registered by now,
+	// flatten the lists before anything is created or streamed
+	Engine::s_plglist.compile();
+	for(uint i = 0; i < NUM_PLATFORMS; i++)
+		Driver::s_plglist[i].compile();
+	Frame::s_plglist.compile();
+	Raster::s_plglist.compile();
+	Texture::s_plglist.compile();
+	TexDictionary::s_plglist.compile();
+	Geometry::s_plglist.compile();
+	Material::s_plglist.compile();
+	Atomic::s_plglist.compile();
+	Light::s_plglist.compile();
+	Camera::s_plglist.compile();
+	Clump::s_plglist.compile();
+	World::s_plglist.compile();
+
+	// Object sizes are final too, so these can be pooled
+	Frame::s_freeList = FreeList::create(Frame::s_plglist.size, 256, 64, MEMDUR_EVENT | ID_FRAMELIST);
+	Atomic::s_freeList = FreeList::create(Atomic::s_plglist.size, 256, 64, MEMDUR_EVENT | ID_ATOMIC);
+	Material::s_freeList = FreeList::create(Material::s_plglist.size, 128, 64, MEMDUR_EVENT | ID_MATERIAL);
+	Texture::s_freeList = FreeList::create(Texture::s_plglist.size, 128, 64, MEMDUR_EVENT | ID_TEXTURE);
+	Light::s_freeList = FreeList::create(Light::s_plglist.size, 32, 64, MEMDUR_EVENT | ID_LIGHT);
+
 	Engine::state = Opened;
 	return 1;
 }
@@ -342,6 +708,17 @@ Engine::term(void)
 	Engine::state = Dead;
 }
 
+// Pooled objects don't show up in printleaks, so say here
+// which ones are still alive before their memory goes away.
+static void
+destroyPool(FreeList **fl, const char *name)
+{
+	if((*fl)->numUsed > 0)
+		printf("%d %s still allocated\n", (*fl)->numUsed, name);
+	(*fl)->destroy();
+	*fl = nil;
+}
+
 void
 Engine::close(void)
 {
@@ -351,6 +728,11 @@ Engine::close(void)
 	}
 
 	engine->device.system(DEVICECLOSE, nil, 0);
+	destroyPool(&Frame::s_freeList, "frames");
+	destroyPool(&Atomic::s_freeList, "atomics");
+	destroyPool(&Material::s_freeList, "materials");
+	destroyPool(&Texture::s_freeList, "textures");
+	destroyPool(&Light::s_freeList, "lights");
 	for(uint i = 0; i < NUM_PLATFORMS; i++)
 		rwFree(rw::engine->driver[i]);
 	engine->dummyDefaultPipeline->destroy();
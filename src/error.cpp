@@ -6,7 +6,8 @@
 
 namespace rw {
 
-static Error error;
+// per thread so loader threads don't clobber each other's errors
+static THREADLOCAL Error error;
 
 void
 setError(Error *e)
@@ -36,7 +37,7 @@ char*
 dbgsprint(uint32 code, ...)
 {
 	va_list ap;
-	static char strbuf[512];
+	static THREADLOCAL char strbuf[512];
 
 	if(code & 0x80000000)
 		code &= ~0x80000000;
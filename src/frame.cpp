@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #include "rwbase.h"
@@ -13,9 +14,10 @@
 
 namespace rw {
 
-int32 Frame::numAllocated;
+AtomicInt32 Frame::numAllocated;
 
 PluginList Frame::s_plglist(sizeof(Frame));
+FreeList *Frame::s_freeList;
 static void *frameOpen(void *object, int32 offset, int32 size) { engine->frameDirtyList.init(); return object; }
 static void *frameClose(void *object, int32 offset, int32 size) { return object; }
 
@@ -25,23 +27,49 @@ Frame::registerModule(void)
 	Engine::registerPlugin(0, ID_FRAMEMODULE, frameOpen, frameClose);
 }
 
+// Frames taken from or returned to the free list in one batch
+struct FrameBatch
+{
+	void **mem;
+	int32 num;
+	int32 next;
+};
+
+static void
+beginBatch(FrameBatch *batch, int32 n)
+{
+	batch->mem = rwNewT(void*, n, MEMDUR_FUNCTION | ID_FRAMELIST);
+	batch->num = 0;
+	batch->next = 0;
+}
+
+static Frame *initFrame(Frame *f);
+
 Frame*
 Frame::create(void)
 {
-	Frame *f = (Frame*)rwMalloc(s_plglist.size, MEMDUR_EVENT | ID_FRAMELIST);
+	Frame *f = (Frame*)s_freeList->alloc();
 	if(f == nil){
 		RWERROR((ERR_ALLOC, s_plglist.size));
 		return nil;
 	}
-	numAllocated++;
+	return initFrame(f);
+}
+
+static Frame*
+initFrame(Frame *f)
+{
+	Frame::numAllocated++;
 	f->object.init(Frame::ID, 0);
 	f->objectList.init();
 	f->child = nil;
 	f->next = nil;
 	f->root = f;
+	f->hierarchy = nil;
+	f->hierarchyIndex = 0;
 	f->matrix.setIdentity();
 	f->ltm.setIdentity();
-	s_plglist.construct(f);
+	Frame::s_plglist.construct(f);
 	return f;
 }
 
@@ -55,6 +83,8 @@ Frame::cloneHierarchy(void)
 void
 Frame::destroy(void)
 {
+	if(this->hierarchy)
+		this->unpack();
 	FORLIST(lnk, this->objectList)
 		ObjectWithFrame::fromFrame(lnk)->setFrame(nil);
 	s_plglist.destruct(this);
@@ -64,29 +94,51 @@ Frame::destroy(void)
 		this->inDirtyList.remove();
 	for(Frame *f = this->child; f; f = f->next)
 		f->object.parent = nil;
-	rwFree(this);
+	s_freeList->free(this);
 	numAllocated--;
 }
 
-void
-Frame::destroyHierarchy(void)
+static void
+destroyRecurse(Frame *f, FrameBatch *batch)
 {
 	Frame *next;
-	for(Frame *child = this->child; child; child = next){
+	if(f->hierarchy)
+		f->unpack();
+	for(Frame *child = f->child; child; child = next){
 		next = child->next;
-		child->destroyHierarchy();
+		destroyRecurse(child, batch);
+	}
+	assert(f->objectList.isEmpty());
+	Frame::s_plglist.destruct(f);
+	if(f->object.privateFlags & Frame::HIERARCHYSYNC)
+		f->inDirtyList.remove();
+	if(batch->mem)
+		batch->mem[batch->num++] = f;
+	else
+		Frame::s_freeList->free(f);
+	Frame::numAllocated--;
+}
+
+void
+Frame::destroyHierarchy(void)
+{
+	FrameBatch batch;
+	beginBatch(&batch, this->count());
+	destroyRecurse(this, &batch);
+	if(batch.mem){
+		s_freeList->freeBatch(batch.mem, batch.num);
+		rwFree(batch.mem);
 	}
-	assert(this->objectList.isEmpty());
-	s_plglist.destruct(this);
-	if(this->object.privateFlags & Frame::HIERARCHYSYNC)
-		this->inDirtyList.remove();
-	rwFree(this);
 }
 
 Frame*
 Frame::addChild(Frame *child, bool32 append)
 {
 	Frame *c;
+	if(this->hierarchy)
+		this->unpack();
+	if(child->hierarchy)
+		child->unpack();
 	if(child->getParent())
 		child->removeChild();
 	if(append){
@@ -110,6 +162,7 @@ Frame::addChild(Frame *child, bool32 append)
 		child->inDirtyList.remove();
 		child->object.privateFlags &= ~Frame::HIERARCHYSYNC;
 	}
+	child->object.privateFlags &= ~Frame::STATIC;
 	this->updateObjects();
 	return this;
 }
@@ -117,6 +170,8 @@ Frame::addChild(Frame *child, bool32 append)
 Frame*
 Frame::removeChild(void)
 {
+	if(this->hierarchy)
+		this->unpack();
 	Frame *parent = this->getParent();
 	Frame *child = parent->child;
 	if(child == this)
@@ -219,10 +274,208 @@ syncRecurse(Frame *frame, uint8 hierarchyFlags)
 	}
 }
 
+/* Packed hierarchies: parents come before their children,
+ * so dirtiness can be passed down in the same loop that does the LTMs. */
+static void
+syncPackedLTM(FrameHierarchy *h)
+{
+	int32 i, p;
+	uint8 *flags = h->flags;
+	if(flags[0] & Frame::SUBTREESYNCLTM)
+		h->ltms[0] = h->matrices[0];
+	for(i = 1; i < h->numFrames; i++){
+		p = h->parents[i];
+		flags[i] |= flags[p];
+		if(flags[i] & Frame::SUBTREESYNCLTM)
+			Matrix::mult(&h->ltms[i], &h->matrices[i], &h->ltms[p]);
+	}
+	memset(flags, 0, h->numFrames);
+}
+
+static void
+syncPackedObjects(FrameHierarchy *h)
+{
+	int32 i;
+	Frame *frame;
+	for(i = 0; i < h->numFrames; i++){
+		frame = h->frames[i];
+		FORLIST(lnk, frame->objectList)
+			ObjectWithFrame::fromFrame(lnk)->sync();
+		frame->object.privateFlags &= ~Frame::SUBTREESYNC;
+	}
+}
+
+static void
+packFrame(FrameHierarchy *h, Frame *frame, int32 parent)
+{
+	int32 i = h->numFrames++;
+	h->frames[i] = frame;
+	h->parents[i] = parent;
+	h->matrices[i] = frame->matrix;
+	h->ltms[i] = frame->ltm;
+	h->flags[i] = frame->object.privateFlags & Frame::SUBTREESYNCLTM;
+	frame->hierarchy = h;
+	frame->hierarchyIndex = i;
+	for(Frame *child = frame->child; child; child = child->next)
+		packFrame(h, child, i);
+}
+
+/* Pack the whole hierarchy 'this' belongs to */
+FrameHierarchy*
+Frame::pack(void)
+{
+	Frame *root = this->root;
+	FrameHierarchy *h;
+	int32 n;
+	uint8 *data;
+
+	if(root->hierarchy)
+		return root->hierarchy;
+	n = root->count();
+	// matrices first for alignment
+	data = (uint8*)rwMalloc(sizeof(FrameHierarchy) + n*(2*sizeof(Matrix) +
+		sizeof(Frame*) + sizeof(int32) + 1), MEMDUR_EVENT | ID_FRAMELIST);
+	if(data == nil){
+		RWERROR((ERR_ALLOC, n));
+		return nil;
+	}
+	h = (FrameHierarchy*)data;
+	data += sizeof(FrameHierarchy);
+	h->matrices = (Matrix*)data;
+	data += n*sizeof(Matrix);
+	h->ltms = (Matrix*)data;
+	data += n*sizeof(Matrix);
+	h->frames = (Frame**)data;
+	data += n*sizeof(Frame*);
+	h->parents = (int32*)data;
+	data += n*sizeof(int32);
+	h->flags = data;
+	h->numFrames = 0;
+	packFrame(h, root, -1);
+	return h;
+}
+
+/* Give the LTMs back to the frames */
+void
+Frame::unpack(void)
+{
+	FrameHierarchy *h = this->hierarchy;
+	Frame *frame;
+	int32 i;
+
+	if(h == nil)
+		return;
+	if(h->frames[0]->object.privateFlags & HIERARCHYSYNCLTM)
+		h->frames[0]->syncHierarchyLTM();
+	for(i = 0; i < h->numFrames; i++){
+		frame = h->frames[i];
+		frame->ltm = h->ltms[i];
+		frame->object.privateFlags &= ~SUBTREESYNCLTM;
+		frame->hierarchy = nil;
+		frame->hierarchyIndex = 0;
+	}
+	rwFree(h);
+}
+
+/*
+ * Frozen hierarchies. Atomics get their world bounds computed when
+ * they are synched so nobody has to look at their frames again.
+ */
+static void
+freezeObjects(Frame *frame)
+{
+	ObjectWithFrame *obj;
+	FORLIST(lnk, frame->objectList){
+		obj = ObjectWithFrame::fromFrame(lnk);
+		obj->sync();
+		if(obj->object.type == Atomic::ID)
+			((Atomic*)obj)->getWorldBoundingSphere();
+	}
+	frame->object.privateFlags &= ~Frame::SUBTREESYNC;
+}
+
+static void
+freezeRecurse(Frame *frame)
+{
+	for(; frame; frame = frame->next){
+		freezeObjects(frame);
+		freezeRecurse(frame->child);
+	}
+}
+
+/* Like syncPackedLTM but syncs the objects of the frames it updates */
+static void
+freezePacked(FrameHierarchy *h)
+{
+	int32 i, p;
+	uint8 *flags = h->flags;
+	for(i = 0; i < h->numFrames; i++){
+		p = h->parents[i];
+		if(p >= 0)
+			flags[i] |= flags[p];
+		if(flags[i] & Frame::SUBTREESYNCLTM){
+			if(p >= 0)
+				Matrix::mult(&h->ltms[i], &h->matrices[i], &h->ltms[p]);
+			else
+				h->ltms[i] = h->matrices[i];
+			freezeObjects(h->frames[i]);
+		}
+	}
+	memset(flags, 0, h->numFrames);
+}
+
+/* Sync 'frame' and its subtree in a frozen hierarchy */
+static void
+syncFrozen(Frame *frame)
+{
+	Frame *parent;
+	if(frame->hierarchy){
+		frame->hierarchy->matrices[frame->hierarchyIndex] = frame->matrix;
+		frame->hierarchy->flags[frame->hierarchyIndex] |= Frame::SUBTREESYNCLTM;
+		freezePacked(frame->hierarchy);
+		return;
+	}
+	parent = frame->getParent();
+	if(parent)
+		Matrix::mult(&frame->ltm, &frame->matrix, &parent->ltm);
+	else
+		frame->ltm = frame->matrix;
+	syncLTMRecurse(frame->child, Frame::SUBTREESYNCLTM);
+	freezeObjects(frame);
+	freezeRecurse(frame->child);
+}
+
+void
+Frame::freeze(void)
+{
+	Frame *root = this->root;
+	if(root->object.privateFlags & STATIC)
+		return;
+	if(root->object.privateFlags & HIERARCHYSYNCLTM)
+		root->syncHierarchyLTM();
+	if(root->object.privateFlags & HIERARCHYSYNC)
+		root->inDirtyList.remove();
+	root->object.privateFlags &= ~(SYNCLTM | SYNCOBJ);
+	root->object.privateFlags |= STATIC;
+	freezeObjects(root);
+	freezeRecurse(root->child);
+}
+
+void
+Frame::unfreeze(void)
+{
+	this->root->object.privateFlags &= ~STATIC;
+}
+
 /* Sync the LTMs of the hierarchy of which 'this' is the root */
 void
 Frame::syncHierarchyLTM(void)
 {
+	if(this->hierarchy){
+		syncPackedLTM(this->hierarchy);
+		this->object.privateFlags &= ~Frame::SYNCLTM;
+		return;
+	}
 	// Sync root's LTM
 	if(this->object.privateFlags & Frame::SUBTREESYNCLTM)
 		this->ltm = this->matrix;
@@ -237,33 +490,167 @@ Frame::getLTM(void)
 {
 	if(this->root->object.privateFlags & Frame::HIERARCHYSYNCLTM)
 		this->root->syncHierarchyLTM();
+	if(this->hierarchy)
+		return &this->hierarchy->ltms[this->hierarchyIndex];
 	return &this->ltm;
 }
 
-/* Synch all dirty frames; LTMs and objects */
+/*
+ * Parallel sync. Jobs are the dirty roots, idle threads get the rest of
+ * a sibling chain or a range of a packed hierarchy split off.
+ * A frame's LTM and those of its parents are always done before its
+ * objects are synched, so sync callbacks can call getLTM on their frame.
+ * They run concurrently with those of other frames and must only
+ * touch their own object.
+ */
+#define PACKEDCHUNK 64
+
+static void syncChainJob(JobSystem::Job *job);
+static void syncPackedRangeJob(JobSystem::Job *job);
+
+static void
+syncChain(Frame *frame, uint8 hierarchyFlags)
+{
+	JobSystem::Job job;
+	uint8 flags;
+	bool32 split;
+	for(; frame; frame = frame->next){
+		split = frame->next && JobSystem::wanted();
+		if(split){
+			job.func = syncChainJob;
+			job.data = frame->next;
+			job.begin = hierarchyFlags;
+			job.end = 0;
+			JobSystem::spawn(&job);
+		}
+		flags = hierarchyFlags | frame->object.privateFlags;
+		if(flags & Frame::SUBTREESYNCLTM)
+			Matrix::mult(&frame->ltm, &frame->matrix,
+			             &frame->getParent()->ltm);
+		FORLIST(lnk, frame->objectList)
+			ObjectWithFrame::fromFrame(lnk)->sync();
+		frame->object.privateFlags &= ~Frame::SUBTREESYNC;
+		syncChain(frame->child, flags);
+		if(split)
+			break;
+	}
+}
+
+static void
+syncChainJob(JobSystem::Job *job)
+{
+	syncChain((Frame*)job->data, (uint8)job->begin);
+}
+
+static void
+syncPackedRange(FrameHierarchy *h, int32 begin, int32 end)
+{
+	JobSystem::Job job;
+	int32 i;
+	Frame *frame;
+	for(i = begin; i < end; i++){
+		if(end - i > PACKEDCHUNK && JobSystem::wanted()){
+			job.func = syncPackedRangeJob;
+			job.data = h;
+			job.begin = (i + end)/2;
+			job.end = end;
+			JobSystem::spawn(&job);
+			end = job.begin;
+		}
+		frame = h->frames[i];
+		FORLIST(lnk, frame->objectList)
+			ObjectWithFrame::fromFrame(lnk)->sync();
+		frame->object.privateFlags &= ~Frame::SUBTREESYNC;
+	}
+}
+
+static void
+syncPackedRangeJob(JobSystem::Job *job)
+{
+	syncPackedRange((FrameHierarchy*)job->data, job->begin, job->end);
+}
+
+static void
+syncRootJob(JobSystem::Job *job)
+{
+	Frame *frame = (Frame*)job->data;
+	uint8 flags = frame->object.privateFlags;
+	// so getLTM in sync callbacks doesn't sync the hierarchy again
+	frame->object.privateFlags &= ~(Frame::SYNCLTM | Frame::SYNCOBJ);
+	if(frame->hierarchy){
+		if(flags & Frame::HIERARCHYSYNCLTM)
+			syncPackedLTM(frame->hierarchy);
+		syncPackedRange(frame->hierarchy, 0, frame->hierarchy->numFrames);
+		return;
+	}
+	if(flags & Frame::SUBTREESYNCLTM)
+		frame->ltm = frame->matrix;
+	FORLIST(lnk, frame->objectList)
+		ObjectWithFrame::fromFrame(lnk)->sync();
+	syncChain(frame->child, flags);
+}
+
+static void
+syncDirtyParallel(void)
+{
+	JobSystem::Job *jobs;
+	int32 n;
+	uint32 arena;
+
+	n = 0;
+	FORLIST(lnk, engine->frameDirtyList)
+		n++;
+	arena = beginFunctionArena();
+	jobs = rwNewT(JobSystem::Job, n, MEMDUR_FUNCTION | ID_FRAMELIST);
+	n = 0;
+	FORLIST(lnk, engine->frameDirtyList){
+		jobs[n].func = syncRootJob;
+		jobs[n].data = LLLinkGetData(lnk, Frame, inDirtyList);
+		jobs[n].begin = 0;
+		jobs[n].end = 0;
+		n++;
+	}
+	JobSystem::run(jobs, n);
+	rwFree(jobs);
+	endFunctionArena(arena);
+	engine->frameDirtyList.init();
+}
+
+/* Synch all dirty frames; LTMs and objects.
+ * In parallel if the job system is running. */
 void
 Frame::syncDirty(void)
 {
 	Frame *frame;
+	uint8 flags;
+	if(JobSystem::numThreads() > 0 && !engine->frameDirtyList.isEmpty()){
+		syncDirtyParallel();
+		return;
+	}
 	FORLIST(lnk, engine->frameDirtyList){
 		frame = LLLinkGetData(lnk, Frame, inDirtyList);
-		if(frame->object.privateFlags & Frame::HIERARCHYSYNCLTM){
+		flags = frame->object.privateFlags;
+		// clean up front, so getLTM in sync callbacks doesn't sync again
+		frame->object.privateFlags &= ~(Frame::SYNCLTM | Frame::SYNCOBJ);
+		if(frame->hierarchy){
+			if(flags & Frame::HIERARCHYSYNCLTM)
+				syncPackedLTM(frame->hierarchy);
+			syncPackedObjects(frame->hierarchy);
+		}else if(flags & Frame::HIERARCHYSYNCLTM){
 			// Sync root's LTM
-			if(frame->object.privateFlags & Frame::SUBTREESYNCLTM)
+			if(flags & Frame::SUBTREESYNCLTM)
 				frame->ltm = frame->matrix;
 			// Synch attached objects
 			FORLIST(lnk, frame->objectList)
 				ObjectWithFrame::fromFrame(lnk)->sync();
 			// ...and children
-			syncRecurse(frame->child, frame->object.privateFlags);
+			syncRecurse(frame->child, flags);
 		}else{
 			// LTMs are clean, just synch objects
 			FORLIST(lnk, frame->objectList)
 				ObjectWithFrame::fromFrame(lnk)->sync();
 			syncObjRecurse(frame->child);
 		}
-		// all clean now
-		frame->object.privateFlags &= ~(Frame::SYNCLTM | Frame::SYNCOBJ);
 	}
 	engine->frameDirtyList.init();
 }
@@ -299,12 +686,24 @@ Frame::transform(const Matrix *mat, CombineOp op)
 void
 Frame::updateObjects(void)
 {
-	// Mark root as dirty and insert into dirty list if necessary
-	if((this->root->object.privateFlags & HIERARCHYSYNC) == 0)
-		engine->frameDirtyList.add(&this->root->inDirtyList);
-	this->root->object.privateFlags |= HIERARCHYSYNC;
+	if(this->root->object.privateFlags & STATIC){
+		syncFrozen(this);
+		return;
+	}
+	// Mark root as dirty and insert into dirty list if necessary.
+	// The dirty list belongs to the main thread, the async loader
+	// dirties the hierarchies it loaded once they are handed over.
+	if(!AsyncLoader::onLoaderThread()){
+		if((this->root->object.privateFlags & HIERARCHYSYNC) == 0)
+			engine->frameDirtyList.add(&this->root->inDirtyList);
+		this->root->object.privateFlags |= HIERARCHYSYNC;
+	}
 	// Mark subtree as dirty as well
 	this->object.privateFlags |= SUBTREESYNC;
+	if(this->hierarchy){
+		this->hierarchy->matrices[this->hierarchyIndex] = this->matrix;
+		this->hierarchy->flags[this->hierarchyIndex] |= SUBTREESYNCLTM;
+	}
 }
 
 void
@@ -316,9 +715,11 @@ Frame::setHierarchyRoot(Frame *root)
 }
 
 static Frame*
-cloneRecurse(Frame *old, Frame *newroot)
+cloneRecurse(Frame *old, Frame *newroot, FrameBatch *batch)
 {
-	Frame *frame = Frame::create();
+	Frame *frame = batch->next < batch->num ?
+		initFrame((Frame*)batch->mem[batch->next++]) :
+		Frame::create();
 	if(newroot == nil)
 		newroot = frame;
 	frame->object.copy(&old->object);
@@ -326,7 +727,7 @@ cloneRecurse(Frame *old, Frame *newroot)
 	frame->root = newroot;
 	old->root = frame;	// Remember cloned frame
 	for(Frame *child = old->child; child; child = child->next){
-		Frame *clonedchild = cloneRecurse(child, newroot);
+		Frame *clonedchild = cloneRecurse(child, newroot, batch);
 		clonedchild->next = frame->child;
 		frame->child = clonedchild;
 		clonedchild->object.parent = frame;
@@ -339,10 +740,19 @@ cloneRecurse(Frame *old, Frame *newroot)
 Frame*
 Frame::cloneAndLink(void)
 {
-	Frame *newhier = cloneRecurse(this, nil);
+	// Take the whole hierarchy from the free list in one go,
+	// fall back to single allocations if that fails
+	FrameBatch batch;
+	int32 n = this->count();
+	beginBatch(&batch, n);
+	if(batch.mem)
+		batch.num = s_freeList->allocBatch(batch.mem, n);
+	Frame *newhier = cloneRecurse(this, nil, &batch);
+	if(batch.mem)
+		rwFree(batch.mem);
 	if(newhier){
 		// frame is not in dirty list so important to get this flag right
-		newhier->object.privateFlags &= ~HIERARCHYSYNC;
+		newhier->object.privateFlags &= ~(HIERARCHYSYNC | STATIC);
 		newhier->updateObjects();
 	}
 	return newhier;
@@ -410,11 +820,13 @@ FrameList_::streamWrite(Stream *stream)
 
 	int size = 0, structsize = 0;
 	structsize = 4 + this->numFrames*sizeof(FrameStreamData);
-	size += 12 + structsize;
-	for(int32 i = 0; i < this->numFrames; i++)
-		size += 12 + Frame::s_plglist.streamGetSize(this->frames[i]);
-
-	writeChunkHeader(stream, ID_FRAMELIST, size);
+	int32 chunk = beginChunk(stream, ID_FRAMELIST);
+	if(chunk < 0){
+		size += 12 + structsize;
+		for(int32 i = 0; i < this->numFrames; i++)
+			size += 12 + Frame::s_plglist.streamGetSize(this->frames[i]);
+		writeChunkHeader(stream, ID_FRAMELIST, size);
+	}
 	writeChunkHeader(stream, ID_STRUCT, structsize);
 	stream->writeU32(this->numFrames);
 	for(int32 i = 0; i < this->numFrames; i++){
@@ -430,6 +842,7 @@ FrameList_::streamWrite(Stream *stream)
 	}
 	for(int32 i = 0; i < this->numFrames; i++)
 		Frame::s_plglist.streamWrite(stream, this->frames[i]);
+	endChunk(stream, chunk);
 }
 
 static Frame*
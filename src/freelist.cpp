@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <new>
+
+#include "rwbase.h"
+#include "rwerror.h"
+#include "rwplg.h"
+#include "rwpipeline.h"
+#include "rwobjects.h"
+#include "rwengine.h"
+
+#ifndef RW_PS2
+#define RW_THREADS
+#include <mutex>
+#endif
+
+#define PLUGIN_ID 0
+
+namespace rw {
+
+/*
+ * A block is allocated as
+ *	void *next	next block
+ *	padding		up to alignment
+ *	entries		entriesPerBlock of entrySize, each aligned
+ * Free entries hold a pointer to the next free one.
+ */
+
+#define ALIGNUP(x, a) (((x) + (a)-1) & ~(uintptr)((a)-1))
+
+#ifdef RW_THREADS
+#define LOCK(fl) std::lock_guard<std::mutex> lock(*(std::mutex*)(fl)->mutex)
+#else
+#define LOCK(fl)
+#endif
+
+FreeList*
+FreeList::create(uint32 entrySize, int32 entriesPerBlock, uint32 alignment, uint32 hint)
+{
+	FreeList *fl;
+	if(alignment < sizeof(void*))
+		alignment = sizeof(void*);
+	assert((alignment & (alignment-1)) == 0);
+	fl = rwNewT(FreeList, 1, MEMDUR_GLOBAL);
+	fl->entrySize = ALIGNUP(entrySize < sizeof(void*) ? sizeof(void*) : entrySize, alignment);
+	fl->entriesPerBlock = entriesPerBlock > 0 ? entriesPerBlock : 1;
+	fl->alignment = alignment;
+	fl->hint = hint;
+	fl->freeEntries = nil;
+	fl->blocks = nil;
+	fl->numBlocks = 0;
+	fl->numUsed = 0;
+#ifdef RW_THREADS
+	fl->mutex = new (rwNew(sizeof(std::mutex), MEMDUR_GLOBAL)) std::mutex;
+#else
+	fl->mutex = nil;
+#endif
+	return fl;
+}
+
+// Entries still in use go away with their blocks, check numUsed first
+void
+FreeList::destroy(void)
+{
+	void *b, *next;
+	for(b = this->blocks; b; b = next){
+		next = *(void**)b;
+		rwFree(b);
+	}
+#ifdef RW_THREADS
+	((std::mutex*)this->mutex)->~mutex();
+	rwFree(this->mutex);
+#endif
+	rwFree(this);
+}
+
+// Add a block to the free entries, called with the lock held
+static bool32
+addBlock(FreeList *fl)
+{
+	uint8 *b, *e;
+	int32 i;
+
+	b = (uint8*)rwMalloc(sizeof(void*) + fl->alignment-1 +
+		fl->entriesPerBlock*fl->entrySize, fl->hint);
+	if(b == nil)
+		return 0;
+	*(void**)b = fl->blocks;
+	fl->blocks = b;
+	fl->numBlocks++;
+	// chain in reverse so entries are handed out in address order
+	e = (uint8*)ALIGNUP((uintptr)b + sizeof(void*), fl->alignment);
+	e += (fl->entriesPerBlock-1)*fl->entrySize;
+	for(i = 0; i < fl->entriesPerBlock; i++){
+		*(void**)e = fl->freeEntries;
+		fl->freeEntries = e;
+		e -= fl->entrySize;
+	}
+	return 1;
+}
+
+void*
+FreeList::alloc(void)
+{
+	void *e;
+	LOCK(this);
+	if(this->freeEntries == nil && !addBlock(this))
+		return nil;
+	e = this->freeEntries;
+	this->freeEntries = *(void**)e;
+	this->numUsed++;
+	return e;
+}
+
+void
+FreeList::free(void *entry)
+{
+	if(entry == nil)
+		return;
+	LOCK(this);
+	*(void**)entry = this->freeEntries;
+	this->freeEntries = entry;
+	this->numUsed--;
+}
+
+// Allocate n entries at once, returns how many we got
+int32
+FreeList::allocBatch(void **entries, int32 n)
+{
+	int32 i;
+	LOCK(this);
+	for(i = 0; i < n; i++){
+		if(this->freeEntries == nil && !addBlock(this))
+			break;
+		entries[i] = this->freeEntries;
+		this->freeEntries = *(void**)entries[i];
+	}
+	this->numUsed += i;
+	return i;
+}
+
+void
+FreeList::freeBatch(void **entries, int32 n)
+{
+	int32 i;
+	LOCK(this);
+	for(i = 0; i < n; i++){
+		if(entries[i] == nil)
+			continue;
+		*(void**)entries[i] = this->freeEntries;
+		this->freeEntries = entries[i];
+		this->numUsed--;
+	}
+}
+
+}
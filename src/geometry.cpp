@@ -15,11 +15,13 @@
 
 namespace rw {
 
-int32 Geometry::numAllocated;
-int32 Material::numAllocated;
+AtomicInt32 Geometry::numAllocated;
+AtomicInt32 Material::numAllocated;
+bool32 Geometry::autoTristrip;
 
 PluginList Geometry::s_plglist(sizeof(Geometry));
 PluginList Material::s_plglist(sizeof(Material));
+FreeList *Material::s_freeList;
 
 static SurfaceProperties defaultSurfaceProps = { 1.0f, 1.0f, 1.0f };
 
@@ -80,6 +82,8 @@ Geometry::create(int32 numVerts, int32 numTris, uint32 flags)
 	geo->lockedSinceInst = 0;
 	geo->meshHeader = nil;
 	geo->instData = nil;
+	geo->pieces = nil;
+	geo->numPieces = 0;
 	geo->refCount = 1;
 
 	s_plglist.construct(geo);
@@ -92,6 +96,7 @@ Geometry::destroy(void)
 	this->refCount--;
 	if(this->refCount <= 0){
 		s_plglist.destruct(this);
+		this->destroyPieces();
 		// Also frees colors and tex coords
 		rwFree(this->triangles);
 		// Also frees their data
@@ -108,6 +113,7 @@ void
 Geometry::lock(int32 lockFlags)
 {
 	lockedSinceInst |= lockFlags;
+	this->destroyPieces();
 	if(lockFlags & LOCKPOLYGONS){
 		rwFree(this->meshHeader);
 		this->meshHeader = nil;
@@ -158,13 +164,27 @@ Geometry::streamRead(Stream *stream)
 		for(int32 i = 0; i < geo->numTexCoordSets; i++)
 			stream->read32(geo->texCoords[i],
 				    2*geo->numVertices*4);
-		for(int32 i = 0; i < geo->numTriangles; i++){
-			uint32 tribuf[2];
-			stream->read32(tribuf, 8);
-			geo->triangles[i].v[0]  = tribuf[0] >> 16;
-			geo->triangles[i].v[1]  = tribuf[0];
-			geo->triangles[i].v[2]  = tribuf[1] >> 16;
-			geo->triangles[i].matId = tribuf[1];
+		const uint8 *tris = stream->borrow(8*geo->numTriangles);
+		if(tris){
+			// decode straight from the stream's memory
+			for(int32 i = 0; i < geo->numTriangles; i++){
+				uint32 tri0 = memLoadLittle32(tris);
+				uint32 tri1 = memLoadLittle32(tris+4);
+				geo->triangles[i].v[0]  = tri0 >> 16;
+				geo->triangles[i].v[1]  = tri0 & 0xFFFF;
+				geo->triangles[i].v[2]  = tri1 >> 16;
+				geo->triangles[i].matId = tri1;
+				tris += 8;
+			}
+		}else{
+			for(int32 i = 0; i < geo->numTriangles; i++){
+				uint32 tribuf[2];
+				stream->read32(tribuf, 8);
+				geo->triangles[i].v[0]  = tribuf[0] >> 16;
+				geo->triangles[i].v[1]  = tribuf[0] & 0xFFFF;
+				geo->triangles[i].v[2]  = tribuf[1] >> 16;
+				geo->triangles[i].matId = tribuf[1];
+			}
 		}
 	}
 
@@ -232,7 +252,9 @@ Geometry::streamWrite(Stream *stream)
 	GeoStreamData buf;
 	static float32 fbuf[3] = { 1.0f, 1.0f, 1.0f };
 
-	writeChunkHeader(stream, ID_GEOMETRY, this->streamGetSize());
+	int32 chunk = beginChunk(stream, ID_GEOMETRY);
+	if(chunk < 0)
+		writeChunkHeader(stream, ID_GEOMETRY, this->streamGetSize());
 	writeChunkHeader(stream, ID_STRUCT, geoStructSize(this));
 
 	buf.flags = this->flags | this->numTexCoordSets << 16;
@@ -249,10 +271,11 @@ Geometry::streamWrite(Stream *stream)
 		for(int32 i = 0; i < this->numTexCoordSets; i++)
 			stream->write32(this->texCoords[i],
 				    2*this->numVertices*4);
+		// only the low 16 bits fit, the mesh plugin writes the full indices
 		for(int32 i = 0; i < this->numTriangles; i++){
 			uint32 tribuf[2];
 			tribuf[0] = this->triangles[i].v[0] << 16 |
-			            this->triangles[i].v[1];
+			            (this->triangles[i].v[1] & 0xFFFF);
 			tribuf[1] = this->triangles[i].v[2] << 16 |
 			            this->triangles[i].matId;
 			stream->write32(tribuf, 8);
@@ -280,6 +303,7 @@ Geometry::streamWrite(Stream *stream)
 	this->matList.streamWrite(stream);
 
 	s_plglist.streamWrite(stream, this);
+	endChunk(stream, chunk);
 	return true;
 }
 
@@ -422,11 +446,12 @@ Geometry::allocateData(void)
 }
 
 static int
-isDegenerate(uint16 *idx)
+isDegenerate(MeshHeader *header, Mesh *m, uint32 j)
 {
-	return idx[0] == idx[1] ||
-	       idx[0] == idx[2] ||
-	       idx[1] == idx[2];
+	uint32 a = header->getIndex(m, j);
+	uint32 b = header->getIndex(m, j+1);
+	uint32 c = header->getIndex(m, j+2);
+	return a == b || a == c || b == c;
 }
 
 // This functions assumes there is enough space allocated
@@ -451,7 +476,7 @@ Geometry::generateTriangles(int8 *adc)
 		if(header->flags == MeshHeader::TRISTRIP){
 			for(uint32 j = 0; j < m->numIndices-2; j++){
 				if(!(adc && adcbits[j+2]) &&
-				   !isDegenerate(&m->indices[j]))
+				   !isDegenerate(header, m, j))
 					this->numTriangles++;
 			}
 		}else
@@ -473,19 +498,19 @@ Geometry::generateTriangles(int8 *adc)
 		if(header->flags == MeshHeader::TRISTRIP)
 			for(uint32 j = 0; j < m->numIndices-2; j++){
 				if((adc && adcbits[j+2]) ||
-				   isDegenerate(&m->indices[j]))
+				   isDegenerate(header, m, j))
 					continue;
-				tri->v[0] = m->indices[j+0];
-				tri->v[1] = m->indices[j+1 + (j%2)];
-				tri->v[2] = m->indices[j+2 - (j%2)];
+				tri->v[0] = header->getIndex(m, j+0);
+				tri->v[1] = header->getIndex(m, j+1 + (j%2));
+				tri->v[2] = header->getIndex(m, j+2 - (j%2));
 				tri->matId = matid;
 				tri++;
 			}
 		else
 			for(uint32 j = 0; j < m->numIndices-2; j+=3){
-				tri->v[0] = m->indices[j+0];
-				tri->v[1] = m->indices[j+1];
-				tri->v[2] = m->indices[j+2];
+				tri->v[0] = header->getIndex(m, j+0);
+				tri->v[1] = header->getIndex(m, j+1);
+				tri->v[2] = header->getIndex(m, j+2);
 				tri->matId = matid;
 				tri++;
 			}
@@ -525,6 +550,7 @@ Geometry::buildMeshes(void)
 	this->meshHeader = nil;
 	int32 numMeshes = this->matList.numMaterials;
 	if((this->flags & Geometry::TRISTRIP) == 0){
+		uint32 arena = beginFunctionArena();
 		int32 *numIndices = rwNewT(int32, numMeshes,
 			MEMDUR_FUNCTION | ID_GEOMETRY);
 		memset(numIndices, 0, numMeshes*sizeof(int32));
@@ -537,7 +563,8 @@ Geometry::buildMeshes(void)
 			tri++;
 		}
 		// setup meshes
-		this->allocateMeshes(numMeshes, this->numTriangles*3, 0);
+		this->allocateMeshes(numMeshes, this->numTriangles*3, 0,
+			this->needsIndex32());
 		mesh = this->meshHeader->getMeshes();
 		for(int32 i = 0; i < numMeshes; i++){
 			mesh[i].material = this->matList.materials[i];
@@ -545,21 +572,69 @@ Geometry::buildMeshes(void)
 		}
 		this->meshHeader->setupIndices();
 		rwFree(numIndices);
+		endFunctionArena(arena);
 
 		// now fill in the indices
 		for(int32 i = 0; i < numMeshes; i++)
 			mesh[i].numIndices = 0;
 		tri = this->triangles;
-		for(int32 i = 0; i < this->numTriangles; i++){
-			uint32 idx = mesh[tri->matId].numIndices;
-			mesh[tri->matId].indices[idx++] = tri->v[0];
-			mesh[tri->matId].indices[idx++] = tri->v[1];
-			mesh[tri->matId].indices[idx++] = tri->v[2];
-			mesh[tri->matId].numIndices = idx;
-			tri++;
-		}
-	}else
+		if(this->meshHeader->index32)
+			for(int32 i = 0; i < this->numTriangles; i++){
+				uint32 idx = mesh[tri->matId].numIndices;
+				mesh[tri->matId].indices32[idx++] = tri->v[0];
+				mesh[tri->matId].indices32[idx++] = tri->v[1];
+				mesh[tri->matId].indices32[idx++] = tri->v[2];
+				mesh[tri->matId].numIndices = idx;
+				tri++;
+			}
+		else
+			for(int32 i = 0; i < this->numTriangles; i++){
+				uint32 idx = mesh[tri->matId].numIndices;
+				mesh[tri->matId].indices[idx++] = tri->v[0];
+				mesh[tri->matId].indices[idx++] = tri->v[1];
+				mesh[tri->matId].indices[idx++] = tri->v[2];
+				mesh[tri->matId].numIndices = idx;
+				tri++;
+			}
+	}else{
 		this->buildTristrips();
+		if(autoTristrip)
+			this->pickTristripOrList();
+	}
+}
+
+// Keep the strips only if they don't transform more vertices
+// than a cache optimized list, which needs more indices.
+// There is only one mesh type per geometry.
+// The triangle order only changes if the list wins.
+void
+Geometry::pickTristripOrList(void)
+{
+	VertexCacheStats strip, list;
+	MeshHeader *strips;
+	Triangle *tris;
+
+	tris = rwNewT(Triangle, this->numTriangles, MEMDUR_FUNCTION | ID_GEOMETRY);
+	if(tris == nil){
+		RWERROR((ERR_ALLOC, this->numTriangles*sizeof(Triangle)));
+		return;
+	}
+	memcpy(tris, this->triangles, this->numTriangles*sizeof(Triangle));
+	this->getVertexCacheStats(&strip);
+	strips = this->meshHeader;
+	this->meshHeader = nil;
+	this->flags &= ~Geometry::TRISTRIP;
+	this->buildMeshes();
+	this->optimizeTriangleOrder();
+	this->getVertexCacheStats(&list);
+	if(strip.numTransformed <= list.numTransformed){
+		memcpy(this->triangles, tris, this->numTriangles*sizeof(Triangle));
+		rwFree(this->meshHeader);
+		this->meshHeader = strips;
+		this->flags |= Geometry::TRISTRIP;
+	}else
+		rwFree(strips);
+	rwFree(tris);
 }
 
 /* The idea is that even in meshes where winding is not preserved
@@ -574,40 +649,40 @@ Geometry::correctTristripWinding(void)
 		return;
 	this->meshHeader = nil;
 	// Allocate no indices, we realloc later
-	MeshHeader *newhead = this->allocateMeshes(header->numMeshes, 0, 1);
+	MeshHeader *newhead = this->allocateMeshes(header->numMeshes, 0, 1, header->index32);
 	newhead->flags = header->flags;
 	/* get a temporary working buffer */
-	uint16 *indices = rwNewT(uint16, header->totalIndices*2,
+	uint32 *indices = rwNewT(uint32, header->totalIndices*2,
 		MEMDUR_FUNCTION | ID_GEOMETRY);
 
 	Mesh *mesh = header->getMeshes();
 	Mesh *newmesh = newhead->getMeshes();
 	for(uint16 i = 0; i < header->numMeshes; i++){
 		newmesh->numIndices = 0;
-		newmesh->indices = &indices[newhead->totalIndices];
+		newmesh->indices32 = &indices[newhead->totalIndices];
 		newmesh->material = mesh->material;
 
 		bool inStrip = 0;
 		uint32 j;
 		for(j = 0; j < mesh->numIndices-2; j++){
 			/* Duplicate vertices indicate end of strip */
-			if(mesh->indices[j] == mesh->indices[j+1] ||
-			   mesh->indices[j+1] == mesh->indices[j+2])
+			if(header->getIndex(mesh, j) == header->getIndex(mesh, j+1) ||
+			   header->getIndex(mesh, j+1) == header->getIndex(mesh, j+2))
 				inStrip = 0;
 			else if(!inStrip){
 				/* Entering strip now,
 				 * make sure winding is correct */
 				inStrip = 1;
 				if(newmesh->numIndices % 2){
-					newmesh->indices[newmesh->numIndices] =
-					  newmesh->indices[newmesh->numIndices-1];
+					newmesh->indices32[newmesh->numIndices] =
+					  newmesh->indices32[newmesh->numIndices-1];
 					newmesh->numIndices++;
 				}
 			}
-			newmesh->indices[newmesh->numIndices++] = mesh->indices[j];
+			newmesh->indices32[newmesh->numIndices++] = header->getIndex(mesh, j);
 		}
 		for(; j < mesh->numIndices; j++)
-			newmesh->indices[newmesh->numIndices++] = mesh->indices[j];
+			newmesh->indices32[newmesh->numIndices++] = header->getIndex(mesh, j);
 		newhead->totalIndices += newmesh->numIndices;
 
 		mesh++;
@@ -615,8 +690,12 @@ Geometry::correctTristripWinding(void)
 	}
 	rwFree(header);
 	// Now allocate indices and copy them
-	this->allocateMeshes(newhead->numMeshes, newhead->totalIndices, 0);
-	memcpy(this->meshHeader->getMeshes()->indices, indices, this->meshHeader->totalIndices*2);
+	this->allocateMeshes(newhead->numMeshes, newhead->totalIndices, 0, newhead->index32);
+	if(this->meshHeader->index32)
+		memcpy(this->meshHeader->getMeshes()->indices32, indices, this->meshHeader->totalIndices*4);
+	else
+		for(uint32 i = 0; i < this->meshHeader->totalIndices; i++)
+			this->meshHeader->getMeshes()->indices[i] = indices[i];
 	rwFree(indices);
 }
 
@@ -655,7 +734,7 @@ Geometry::removeUnusedMaterials(void)
 
 	/* Build new meshes */
 	this->meshHeader = nil;
-	MeshHeader *newmh = this->allocateMeshes(numMaterials, mh->totalIndices, 0);
+	MeshHeader *newmh = this->allocateMeshes(numMaterials, mh->totalIndices, 0, mh->index32);
 	newmh->flags = mh->flags;
 	Mesh *newm = newmh->getMeshes();
 	for(uint32 i = 0; i < mh->numMeshes; i++){
@@ -672,7 +751,7 @@ Geometry::removeUnusedMaterials(void)
 		if(m[i].numIndices <= 0)
 			continue;
 		memcpy(newm->indices, m[i].indices,
-		       m[i].numIndices*sizeof(*m[i].indices));
+		       m[i].numIndices*(mh->index32 ? 4 : 2));
 		newm++;
 	}
 	rwFree(mh);
@@ -683,6 +762,167 @@ Geometry::removeUnusedMaterials(void)
 	rwFree(map);
 }
 
+#define MAXSPLITCALLBACKS 8
+
+static struct {
+	uint32 id;
+	Geometry::SplitCallback cb;
+} splitCallbacks[MAXSPLITCALLBACKS];
+static int32 numSplitCallbacks;
+
+// Like the stream callbacks, only for plugins that are registered
+int32
+Geometry::setSplitCallback(uint32 id, SplitCallback cb)
+{
+	int32 i, offset;
+	offset = s_plglist.getPluginOffset(id);
+	if(offset < 0)
+		return -1;
+	for(i = 0; i < numSplitCallbacks; i++)
+		if(splitCallbacks[i].id == id){
+			splitCallbacks[i].cb = cb;
+			return offset;
+		}
+	if(numSplitCallbacks >= MAXSPLITCALLBACKS)
+		return -1;
+	splitCallbacks[numSplitCallbacks].id = id;
+	splitCallbacks[numSplitCallbacks].cb = cb;
+	numSplitCallbacks++;
+	return offset;
+}
+
+/* Split geometry with 32 bit indices into pieces of at most 0x10000
+ * vertices that can be drawn with 16 bit indices. Triangles are taken
+ * in order, vertices used by more than one piece are duplicated.
+ * Plugins copy their per-vertex data in split callbacks,
+ * other plugin data is not copied. */
+int32
+Geometry::splitIndex16(void)
+{
+	int32 *stamp, *remap, *starts, *verts;
+	Geometry *piece;
+	Triangle *t;
+	int32 i, j, k, p, nv, n;
+	uint32 arena;
+
+	if(this->pieces)
+		return this->numPieces;
+	if(this->flags & NATIVE || this->triangles == nil ||
+	   !this->needsIndex32())
+		return 0;
+
+	arena = beginFunctionArena();
+	stamp = rwNewT(int32, this->numVertices, MEMDUR_FUNCTION | ID_GEOMETRY);
+	remap = rwNewT(int32, this->numVertices, MEMDUR_FUNCTION | ID_GEOMETRY);
+	starts = rwNewT(int32, this->numTriangles+1, MEMDUR_FUNCTION | ID_GEOMETRY);
+	verts = rwNewT(int32, 0x10000, MEMDUR_FUNCTION | ID_GEOMETRY);
+	if(stamp == nil || remap == nil || starts == nil || verts == nil){
+		RWERROR((ERR_ALLOC, this->numVertices*2*sizeof(int32)));
+		goto out;
+	}
+	memset(stamp, 0, this->numVertices*sizeof(int32));
+
+	// find where the pieces start
+	p = 1;
+	nv = 0;
+	starts[0] = 0;
+	for(i = 0; i < this->numTriangles; i++){
+		t = &this->triangles[i];
+		n = (stamp[t->v[0]] != p) +
+		    (stamp[t->v[1]] != p && t->v[1] != t->v[0]) +
+		    (stamp[t->v[2]] != p && t->v[2] != t->v[0] && t->v[2] != t->v[1]);
+		if(nv + n > 0x10000){
+			starts[p++] = i;
+			nv = 0;
+		}
+		for(j = 0; j < 3; j++)
+			if(stamp[t->v[j]] != p){
+				stamp[t->v[j]] = p;
+				nv++;
+			}
+	}
+	starts[p] = this->numTriangles;
+
+	this->pieces = rwNewT(Geometry*, p, MEMDUR_EVENT | ID_GEOMETRY);
+	if(this->pieces == nil){
+		RWERROR((ERR_ALLOC, p*sizeof(Geometry*)));
+		goto out;
+	}
+	memset(stamp, 0, this->numVertices*sizeof(int32));
+	for(k = 0; k < p; k++){
+		nv = 0;
+		for(i = starts[k]; i < starts[k+1]; i++){
+			t = &this->triangles[i];
+			for(j = 0; j < 3; j++)
+				if(stamp[t->v[j]] != k+1){
+					stamp[t->v[j]] = k+1;
+					remap[t->v[j]] = nv;
+					verts[nv++] = t->v[j];
+				}
+		}
+
+		piece = Geometry::create(nv, starts[k+1]-starts[k],
+			(this->flags & ~NATIVE) | this->numTexCoordSets<<16);
+		if(piece == nil){
+			this->numPieces = k;
+			this->destroyPieces();
+			goto out;
+		}
+		piece->addMorphTargets(this->numMorphTargets-1);
+		for(i = 0; i < this->numMorphTargets; i++){
+			MorphTarget *src = &this->morphTargets[i];
+			MorphTarget *dst = &piece->morphTargets[i];
+			dst->boundingSphere = src->boundingSphere;
+			for(j = 0; j < nv; j++){
+				if(src->vertices && dst->vertices)
+					dst->vertices[j] = src->vertices[verts[j]];
+				if(src->normals && dst->normals)
+					dst->normals[j] = src->normals[verts[j]];
+			}
+		}
+		if(this->colors && piece->colors)
+			for(j = 0; j < nv; j++)
+				piece->colors[j] = this->colors[verts[j]];
+		for(i = 0; i < this->numTexCoordSets; i++)
+			if(this->texCoords[i] && piece->texCoords[i])
+				for(j = 0; j < nv; j++)
+					piece->texCoords[i][j] = this->texCoords[i][verts[j]];
+		for(i = 0; i < numSplitCallbacks; i++)
+			splitCallbacks[i].cb(piece, this, verts, nv);
+		for(i = starts[k]; i < starts[k+1]; i++){
+			t = &piece->triangles[i-starts[k]];
+			for(j = 0; j < 3; j++)
+				t->v[j] = remap[this->triangles[i].v[j]];
+			t->matId = this->triangles[i].matId;
+		}
+		for(i = 0; i < this->matList.numMaterials; i++)
+			piece->matList.appendMaterial(this->matList.materials[i]);
+		piece->buildMeshes();
+		this->pieces[k] = piece;
+	}
+	this->numPieces = p;
+
+out:
+	rwFree(stamp);
+	rwFree(remap);
+	rwFree(starts);
+	rwFree(verts);
+	endFunctionArena(arena);
+	return this->numPieces;
+}
+
+void
+Geometry::destroyPieces(void)
+{
+	if(this->pieces == nil)
+		return;
+	for(int32 i = 0; i < this->numPieces; i++)
+		this->pieces[i]->destroy();
+	rwFree(this->pieces);
+	this->pieces = nil;
+	this->numPieces = 0;
+}
+
 Sphere
 MorphTarget::calculateBoundingSphere(void) const
 {
@@ -811,8 +1051,9 @@ fail:
 bool
 MaterialList::streamWrite(Stream *stream)
 {
-	uint32 size = this->streamGetSize();
-	writeChunkHeader(stream, ID_MATLIST, size);
+	int32 chunk = beginChunk(stream, ID_MATLIST);
+	if(chunk < 0)
+		writeChunkHeader(stream, ID_MATLIST, this->streamGetSize());
 	writeChunkHeader(stream, ID_STRUCT, 4 + this->numMaterials*4);
 	stream->writeI32(this->numMaterials);
 
@@ -833,6 +1074,7 @@ MaterialList::streamWrite(Stream *stream)
 		this->materials[i]->streamWrite(stream);
 		found:;
 	}
+	endChunk(stream, chunk);
 	return true;
 }
 
@@ -857,7 +1099,7 @@ MaterialList::streamGetSize(void)
 Material*
 Material::create(void)
 {
-	Material *mat = (Material*)rwMalloc(s_plglist.size, MEMDUR_EVENT | ID_MATERIAL);
+	Material *mat = (Material*)s_freeList->alloc();
 	if(mat == nil){
 		RWERROR((ERR_ALLOC, s_plglist.size));
 		return nil;
@@ -897,7 +1139,7 @@ Material::destroy(void)
 		s_plglist.destruct(this);
 		if(this->texture)
 			this->texture->destroy();
-		rwFree(this);
+		s_freeList->free(this);
 		numAllocated--;
 	}
 }
@@ -920,7 +1162,7 @@ struct MatStreamData
 	int32 textured;
 };
 
-static uint32 materialRights[2];
+static THREADLOCAL uint32 materialRights[2];
 
 Material*
 Material::streamRead(Stream *stream)
@@ -969,7 +1211,9 @@ Material::streamWrite(Stream *stream)
 {
 	MatStreamData buf;
 
-	writeChunkHeader(stream, ID_MATERIAL, this->streamGetSize());
+	int32 chunk = beginChunk(stream, ID_MATERIAL);
+	if(chunk < 0)
+		writeChunkHeader(stream, ID_MATERIAL, this->streamGetSize());
 	writeChunkHeader(stream, ID_STRUCT, sizeof(MatStreamData)
 		+ (rw::version >= 0x30400 ? 12 : 0));
 
@@ -993,6 +1237,7 @@ Material::streamWrite(Stream *stream)
 		this->texture->streamWrite(stream);
 
 	s_plglist.streamWrite(stream, this);
+	endChunk(stream, chunk);
 	return true;
 }
 
@@ -23,24 +23,27 @@
 
 namespace rw {
 
-static uint16 nextSerialNum = 1;
+static AtomicInt32 nextSerialNum(1);
 
 // Mesh
 
 // Allocate a mesh header, meshes and optionally indices.
 // If existing meshes already exist, retain their information.
+// With index32 the indices are uint32.
 MeshHeader*
-Geometry::allocateMeshes(int32 numMeshes, uint32 numIndices, bool32 noIndices)
+Geometry::allocateMeshes(int32 numMeshes, uint32 numIndices, bool32 noIndices, bool32 index32)
 {
 	uint32 sz;
 	MeshHeader *mh;
 	Mesh *m;
-	uint16 *indices;
+	uint8 *indices;
+	uint32 indexSize;
 	int32 oldNumMeshes;
 	int32 i;
+	indexSize = index32 ? sizeof(uint32) : sizeof(uint16);
 	sz = sizeof(MeshHeader) + numMeshes*sizeof(Mesh);
 	if(!noIndices)
-		sz += numIndices*sizeof(uint16);
+		sz += numIndices*indexSize;
 	if(this->meshHeader){
 		oldNumMeshes = this->meshHeader->numMeshes;
 		mh = (MeshHeader*)rwResize(this->meshHeader, sz, MEMDUR_EVENT | ID_GEOMETRY);
@@ -52,10 +55,11 @@ Geometry::allocateMeshes(int32 numMeshes, uint32 numIndices, bool32 noIndices)
 		this->meshHeader = mh;
 	}
 	mh->numMeshes = numMeshes;
-	mh->serialNum = nextSerialNum++;
+	mh->serialNum = (uint16)nextSerialNum++;
 	mh->totalIndices = numIndices;
+	mh->index32 = index32;
 	m = mh->getMeshes();
-	indices = (uint16*)&m[numMeshes];
+	indices = (uint8*)&m[numMeshes];
 	for(i = 0; i < mh->numMeshes; i++){
 		// keep these
 		if(i >= oldNumMeshes){
@@ -66,8 +70,8 @@ Geometry::allocateMeshes(int32 numMeshes, uint32 numIndices, bool32 noIndices)
 		if(noIndices)
 			m->indices = nil;
 		else{
-			m->indices = indices;
-			indices += m->numIndices;
+			m->indices = (uint16*)indices;
+			indices += m->numIndices*indexSize;
 		}
 		m++;
 	}
@@ -78,16 +82,18 @@ void
 MeshHeader::setupIndices(void)
 {
 	int32 i;
-	uint16 *indices;
+	uint8 *indices;
+	uint32 indexSize;
 	Mesh *m;
 	m = this->getMeshes();
-	indices = m->indices;
+	indices = (uint8*)m->indices;
 	// return if native
 	if(indices == nil)
 		return;
+	indexSize = this->index32 ? sizeof(uint32) : sizeof(uint16);
 	for(i = 0; i < this->numMeshes; i++){
-		m->indices = indices;
-		indices += m->numIndices;
+		m->indices = (uint16*)indices;
+		indices += m->numIndices*indexSize;
 		m++;
 	}
 }
@@ -114,6 +120,7 @@ readMesh(Stream *stream, int32 len, void *object, int32, int32)
 	Mesh *mesh;
 	int32 indbuf[256];
 	uint16 *indices;
+	uint32 *indices32;
 	Geometry *geo = (Geometry*)object;
 
 	stream->read32(&mhs, sizeof(MeshHeaderStream));
@@ -122,11 +129,13 @@ readMesh(Stream *stream, int32 len, void *object, int32, int32)
 	assert(geo->meshHeader == nil);
 	geo->meshHeader = nil;
 	mh = geo->allocateMeshes(mhs.numMeshes, mhs.totalIndices, 
-		geo->flags & Geometry::NATIVE && !hasData);
+		geo->flags & Geometry::NATIVE && !hasData,
+		!(geo->flags & Geometry::NATIVE) && geo->needsIndex32());
 	mh->flags = mhs.flags;
 
 	mesh = mh->getMeshes();
 	indices = mesh->indices;
+	indices32 = mesh->indices32;
 	for(uint32 i = 0; i < mh->numMeshes; i++){
 		stream->read32(&ms, sizeof(MeshStream));
 		mesh->numIndices = ms.numIndices;
@@ -139,11 +148,21 @@ readMesh(Stream *stream, int32 len, void *object, int32, int32)
 				stream->read16(mesh->indices,
 				            mesh->numIndices*2);
 			}
+		}else if(mh->index32){
+			mesh->indices32 = indices32;
+			indices32 += mesh->numIndices;
+			stream->read32(mesh->indices32, mesh->numIndices*4);
 		}else{
 			mesh->indices = indices;
 			indices += mesh->numIndices;
 			uint16 *ind = mesh->indices;
 			int32 numIndices = mesh->numIndices;
+			const uint8 *src = stream->borrow(numIndices*4);
+			if(src){
+				for(int32 j = 0; j < numIndices; j++)
+					ind[j] = memLoadLittle32(src + j*4);
+				numIndices = 0;
+			}
 			for(; numIndices > 0; numIndices -= 256){
 				int32 n = numIndices < 256 ? numIndices : 256;
 				stream->read32(indbuf, n*4);
@@ -178,6 +197,8 @@ writeMesh(Stream *stream, int32, void *object, int32, int32)
 			if(geo->instData->platform == PLATFORM_WDGL)
 				stream->write16(mesh->indices,
 				            mesh->numIndices*2);
+		}else if(geo->meshHeader->index32){
+			stream->write32(mesh->indices32, mesh->numIndices*4);
 		}else{
 			uint16 *ind = mesh->indices;
 			int32 numIndices = mesh->numIndices;
@@ -211,11 +232,51 @@ getSizeMesh(void *object, int32, int32)
 	return size;
 }
 
+// 32 bit triangle indices
+// The geometry struct only has room for 16 bit vertex indices,
+// geometry with more vertices has all of them here. Not in RW.
+
+static Stream*
+readTriangles32(Stream *stream, int32 len, void *object, int32, int32)
+{
+	Geometry *geo = (Geometry*)object;
+	if(geo->triangles == nil || len != geo->numTriangles*12){
+		RWERROR((ERR_GENERAL, "invalid 32 bit triangle indices"));
+		stream->seek(len);
+		return stream;
+	}
+	for(int32 i = 0; i < geo->numTriangles; i++)
+		stream->read32(geo->triangles[i].v, 12);
+	return stream;
+}
+
+static Stream*
+writeTriangles32(Stream *stream, int32, void *object, int32, int32)
+{
+	Geometry *geo = (Geometry*)object;
+	for(int32 i = 0; i < geo->numTriangles; i++)
+		stream->write32(geo->triangles[i].v, 12);
+	return stream;
+}
+
+static int32
+getSizeTriangles32(void *object, int32, int32)
+{
+	Geometry *geo = (Geometry*)object;
+	if(geo->flags & Geometry::NATIVE || geo->triangles == nil ||
+	   !geo->needsIndex32())
+		return 0;
+	return geo->numTriangles*12;
+}
+
 void
 registerMeshPlugin(void)
 {
 	Geometry::registerPlugin(0, ID_MESH, nil, nil, nil);
 	Geometry::registerPluginStream(ID_MESH, readMesh, writeMesh, getSizeMesh);
+	Geometry::registerPlugin(0, ID_TRIANGLES32, nil, nil, nil);
+	Geometry::registerPluginStream(ID_TRIANGLES32, readTriangles32,
+	                               writeTriangles32, getSizeTriangles32);
 }
 
 // Returns the maximum number of triangles. Just so
@@ -254,8 +315,9 @@ destroyNativeData(void *object, int32 offset, int32 size)
 	return object;
 }
 
-static Stream*
-readNativeData(Stream *stream, int32 len, void *object, int32 o, int32 s)
+// Which reader the native data is for, the stream is left where it was
+static uint32
+getNativeDataPlatform(Stream *stream)
 {
 	ChunkHeaderInfo header;
 	uint32 libid;
@@ -268,25 +330,91 @@ readNativeData(Stream *stream, int32 len, void *object, int32 o, int32 s)
 	   libraryIDPack(header.version, header.build) == libid){
 		platform = stream->readU32();
 		stream->seek(-16);
-		if(platform == PLATFORM_PS2)
-			return ps2::readNativeData(stream, len, object, o, s);
-		else if(platform == PLATFORM_XBOX)
-			return xbox::readNativeData(stream, len, object, o, s);
-		else if(platform == PLATFORM_D3D8)
-			return d3d8::readNativeData(stream, len, object, o, s);
-		else if(platform == PLATFORM_D3D9)
-			return d3d9::readNativeData(stream, len, object, o, s);
-		else{
-			fprintf(stderr, "unknown platform %d\n", platform);
-			stream->seek(len);
-		}
-	}else{
-		stream->seek(-12);
+		return platform;
+	}
+	// WarDrum's data isn't in a struct
+	stream->seek(-12);
+	return PLATFORM_WDGL;
+}
+
+static Stream*
+readNativeDataPlatform(Stream *stream, uint32 platform, int32 len, void *object, int32 o, int32 s)
+{
+	if(platform == PLATFORM_PS2)
+		return ps2::readNativeData(stream, len, object, o, s);
+	else if(platform == PLATFORM_XBOX)
+		return xbox::readNativeData(stream, len, object, o, s);
+	else if(platform == PLATFORM_D3D8)
+		return d3d8::readNativeData(stream, len, object, o, s);
+	else if(platform == PLATFORM_D3D9)
+		return d3d9::readNativeData(stream, len, object, o, s);
+	else if(platform == PLATFORM_WDGL)
 		wdgl::readNativeData(stream, len, object, o, s);
+	else{
+		fprintf(stderr, "unknown platform %d\n", platform);
+		stream->seek(len);
 	}
 	return stream;
 }
 
+struct NativeDataArgs
+{
+	Stream *stream;
+	uint32 platform;
+	int32 len;
+	void *object;
+	int32 offset;
+	int32 size;
+};
+
+static void*
+readNativeDataCB(void *data)
+{
+	NativeDataArgs *args = (NativeDataArgs*)data;
+	return readNativeDataPlatform(args->stream, args->platform, args->len,
+		args->object, args->offset, args->size);
+}
+
+// D3D native data is read straight into device buffers, so the worker
+// reads it into memory and the main thread creates and fills the buffers.
+// The other platforms only allocate memory and are parsed right here.
+static Stream*
+readNativeData(Stream *stream, int32 len, void *object, int32 o, int32 s)
+{
+	uint32 platform;
+	const uint8 *data;
+	uint8 *buf;
+	StreamMemory mem;
+	void *ret;
+
+	platform = getNativeDataPlatform(stream);
+	if(!AsyncLoader::onLoaderThread() ||
+	   (platform != PLATFORM_D3D8 && platform != PLATFORM_D3D9))
+		return readNativeDataPlatform(stream, platform, len, object, o, s);
+
+	buf = nil;
+	data = stream->borrow(len);
+	if(data == nil){
+		buf = rwNewT(uint8, len, MEMDUR_FUNCTION | ID_GEOMETRY);
+		if(buf == nil){
+			RWERROR((ERR_ALLOC, len));
+			return nil;
+		}
+		if(stream->read8(buf, len) != (uint32)len){
+			rwFree(buf);
+			return nil;
+		}
+		data = buf;
+	}
+	mem.open((uint8*)data, len);
+	NativeDataArgs args = { &mem, platform, len, object, o, s };
+	ret = AsyncLoader::callMainThread(readNativeDataCB, &args);
+	mem.close();
+	if(buf)
+		rwFree(buf);
+	return ret ? stream : nil;
+}
+
 static Stream*
 writeNativeData(Stream *stream, int32 len, void *object, int32 o, int32 s)
 {
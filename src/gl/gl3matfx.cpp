@@ -92,23 +92,9 @@ uploadEnvMatrix(Frame *frame)
 	setUniform(u_texMatrix, &envMtx);
 }
 
-void
-matfxEnvRender(InstanceDataHeader *header, InstanceData *inst, int32 vsBits, uint32 flags, MatFX::Env *env)
+static void
+uploadEnvParams(Material *m, MatFX::Env *env)
 {
-	Material *m;
-	m = inst->material;
-
-	if(env->tex == nil || env->coefficient == 0.0f){
-		matfxDefaultRender(header, inst, vsBits, flags);
-		return;
-	}
-
-	setTexture(0, m->texture);
-	setTexture(1, env->tex);
-	uploadEnvMatrix(env->frame);
-
-	setMaterial(flags, m->color, m->surfaceProps);
-
 	float fxparams[4];
 	fxparams[0] = env->coefficient;
 	fxparams[1] = env->fbAlpha ? 0.0f : 1.0f;
@@ -128,6 +114,26 @@ matfxEnvRender(InstanceDataHeader *header, InstanceData *inst, int32 vsBits, uin
 	else
 		convColor(envcol, &MatFX::envMapColor);
 	setUniform(u_envColor, envcol);
+}
+
+void
+matfxEnvRender(InstanceDataHeader *header, InstanceData *inst, int32 vsBits, uint32 flags, MatFX::Env *env)
+{
+	Material *m;
+	m = inst->material;
+
+	if(env->tex == nil || env->coefficient == 0.0f){
+		matfxDefaultRender(header, inst, vsBits, flags);
+		return;
+	}
+
+	setTexture(0, m->texture);
+	setTexture(1, env->tex);
+	uploadEnvMatrix(env->frame);
+
+	setMaterial(flags, m->color, m->surfaceProps);
+
+	uploadEnvParams(m, env);
 
 	rw::SetRenderState(VERTEXALPHA, 1);
 	rw::SetRenderState(SRCBLEND, BLENDONE);
@@ -149,9 +155,90 @@ matfxEnvRender(InstanceDataHeader *header, InstanceData *inst, int32 vsBits, uin
 	rw::SetRenderState(SRCBLEND, BLENDSRCALPHA);
 }
 
+static MatFX::Env*
+getEnv(InstanceData *inst)
+{
+	MatFX *matfx = MatFX::get(inst->material);
+	MatFX::Env *env;
+
+	if(matfx == nil || matfx->type != MatFX::ENVMAP)
+		return nil;
+	env = &matfx->fx[0].env;
+	if(env->tex == nil || env->coefficient == 0.0f)
+		return nil;
+	return env;
+}
+
+static void
+drawQueuedEnv(RenderQueue::Entry *e, RenderQueue::Entry *prev, RenderQueue::Entry *next)
+{
+	InstanceDataHeader *header = (InstanceDataHeader*)e->header;
+	InstanceData *inst = (InstanceData*)e->inst;
+	MatFX::Env *env = getEnv(inst);
+
+	setQueuedState(e, prev);
+	setTexture(1, env->tex);
+	uploadEnvMatrix(env->frame);
+	uploadEnvParams(inst->material, env);
+	rw::SetRenderState(VERTEXALPHA, 1);
+
+	drawInst(header, inst);
+
+	if(next == nil || next->header != header)
+		teardownVertexInput(header);
+	// what matfxEnvRender leaves behind
+	if(next == nil)
+		rw::SetRenderState(SRCBLEND, BLENDSRCALPHA);
+}
+
+// Adds all meshes to the render queue instead of drawing them,
+// the ones without an environment map are drawn like the default pipeline
+static bool32
+queueMatFXAtomic(Atomic *atomic, InstanceDataHeader *header)
+{
+	QueuedLights *ql;
+	Shader *shader, *envShd;
+	bool32 alphaTest;
+	uint32 blend, envBlend;
+	float32 depth;
+
+	ql = queueLights(atomic, header, sizeof(QueuedLights));
+	if(ql == nil)
+		return 0;
+	alphaTest = getAlphaTest();
+	if(ql->lit){
+		shader = alphaTest ? defaultShader_fullLight : defaultShader_fullLight_noAT;
+		envShd = alphaTest ? envShader_fullLight : envShader_fullLight_noAT;
+	}else{
+		shader = alphaTest ? defaultShader : defaultShader_noAT;
+		envShd = alphaTest ? envShader : envShader_noAT;
+	}
+	blend = rw::GetRenderState(SRCBLEND)<<4 | rw::GetRenderState(DESTBLEND);
+	envBlend = BLENDONE<<4 | rw::GetRenderState(DESTBLEND);
+	depth = RenderQueue::getDepth(atomic);
+
+	InstanceData *inst = header->inst;
+	int32 n = header->numMeshes;
+
+	while(n--){
+		// env maps are drawn with vertex alpha and additive source
+		if(getEnv(inst))
+			queueInst(drawQueuedEnv, atomic, header, inst, envShd, envBlend, depth,
+				1, ql);
+		else
+			queueInst(drawQueued, atomic, header, inst, shader, blend, depth,
+				isTranslucent(inst), ql);
+		inst++;
+	}
+	return 1;
+}
+
 void
 matfxRenderCB(Atomic *atomic, InstanceDataHeader *header)
 {
+	if(RenderQueue::isOpen() && queueMatFXAtomic(atomic, header))
+		return;
+
 	uint32 flags = atomic->geometry->flags;
 	setWorldMatrix(atomic->getFrame()->getLTM());
 	int32 vsBits = lightingCB(atomic);
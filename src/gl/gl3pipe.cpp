@@ -62,13 +62,19 @@ instanceMesh(rw::ObjPipeline *rwpipe, Geometry *geo)
 	header->totalNumIndex = meshh->totalIndices;
 	header->inst = rwNewT(InstanceData, header->numMeshes, MEMDUR_EVENT | ID_GEOMETRY);
 
-	header->indexBuffer = rwNewT(uint16, header->totalNumIndex, MEMDUR_EVENT | ID_GEOMETRY);
+	uint32 indexSize = meshh->index32 ? 4 : 2;
+	header->indexType = meshh->index32 ? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT;
+	header->indexBuffer = rwNew(header->totalNumIndex*indexSize, MEMDUR_EVENT | ID_GEOMETRY);
 	InstanceData *inst = header->inst;
 	Mesh *mesh = meshh->getMeshes();
 	uint32 offset = 0;
 	for(uint32 i = 0; i < header->numMeshes; i++){
-		findMinVertAndNumVertices(mesh->indices, mesh->numIndices,
-		                          &inst->minVert, &inst->numVertices);
+		if(meshh->index32)
+			findMinVertAndNumVertices(mesh->indices32, mesh->numIndices,
+			                          &inst->minVert, &inst->numVertices);
+		else
+			findMinVertAndNumVertices(mesh->indices, mesh->numIndices,
+			                          &inst->minVert, &inst->numVertices);
 		assert(inst->minVert != 0xFFFFFFFF);
 		inst->numIndex = mesh->numIndices;
 		inst->material = mesh->material;
@@ -76,8 +82,8 @@ instanceMesh(rw::ObjPipeline *rwpipe, Geometry *geo)
 		inst->program = 0;
 		inst->offset = offset;
 		memcpy((uint8*)header->indexBuffer + inst->offset,
-		       mesh->indices, inst->numIndex*2);
-		offset += inst->numIndex*2;
+		       mesh->indices, inst->numIndex*indexSize);
+		offset += inst->numIndex*indexSize;
 		mesh++;
 		inst++;
 	}
@@ -94,7 +100,7 @@ instanceMesh(rw::ObjPipeline *rwpipe, Geometry *geo)
 #endif
 	glGenBuffers(1, &header->ibo);
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, header->ibo);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, header->totalNumIndex*2,
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, header->totalNumIndex*indexSize,
 			header->indexBuffer, GL_STATIC_DRAW);
 
 	return header;
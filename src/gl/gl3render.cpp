@@ -25,7 +25,7 @@ drawInst_simple(InstanceDataHeader *header, InstanceData *inst)
 {
 	flushCache();
 	glDrawElements(header->primType, inst->numIndex,
-	               GL_UNSIGNED_SHORT, (void*)(uintptr)inst->offset);
+	               header->indexType, (void*)(uintptr)inst->offset);
 }
 
 // Emulate PS2 GS alpha test FB_ONLY case: failed alpha writes to frame- but not to depth buffer
@@ -144,11 +144,164 @@ lightingCB(void)
 }
 
 
+QueuedLights*
+queueLights(Atomic *atomic, InstanceDataHeader *header, uint32 size)
+{
+	QueuedLights *ql;
+
+	if(!RenderQueue::reserve(header->numMeshes))
+		return nil;
+	ql = (QueuedLights*)RenderQueue::alloc(size);
+	if(ql == nil)
+		return nil;
+	ql->lightData.directionals = ql->directionals;
+	ql->lightData.numDirectionals = 8;
+	ql->lightData.locals = ql->locals;
+	ql->lightData.numLocals = 8;
+	if(atomic->geometry->flags & rw::Geometry::LIGHT)
+		((World*)engine->currentWorld)->enumerateLights(atomic, &ql->lightData);
+	else
+		memset(&ql->lightData, 0, sizeof(ql->lightData));
+	// same as (setLights() & VSLIGHT_MASK) != 0
+	ql->lit = ql->lightData.numDirectionals > 0 || ql->lightData.numLocals > 0;
+	return ql;
+}
+
+bool32
+isTranslucent(InstanceData *inst)
+{
+	Material *m = inst->material;
+	Raster *raster = m->texture ? m->texture->raster : nil;
+	return inst->vertexAlpha || m->color.alpha != 0xFF ||
+		(raster && GETGL3RASTEREXT(raster)->hasAlpha);
+}
+
+RenderQueue::Entry*
+queueInst(RenderQueue::DrawCB draw, Atomic *atomic, InstanceDataHeader *header,
+	InstanceData *inst, Shader *shader, uint32 blend, float32 depth,
+	bool32 translucent, void *data)
+{
+	Texture *tex = inst->material->texture;
+	RenderQueue::Entry *e;
+
+	e = RenderQueue::add(draw, atomic->getPipeline(), shader, tex ? tex->raster : nil,
+		translucent ? blend : 0, depth, translucent);
+	e->atomic = atomic;
+	e->header = header;
+	e->inst = inst;
+	e->data = data;
+	return e;
+}
+
+void
+setQueuedState(RenderQueue::Entry *e, RenderQueue::Entry *prev)
+{
+	Atomic *atomic = e->atomic;
+	InstanceDataHeader *header = (InstanceDataHeader*)e->header;
+	InstanceData *inst = (InstanceData*)e->inst;
+	QueuedLights *ql = (QueuedLights*)e->data;
+	Material *m = inst->material;
+	InstanceData *previnst;
+	bool32 changed;
+
+	changed = prev == nil || prev->atomic != atomic;
+	if(changed){
+		setWorldMatrix(atomic->getFrame()->getLTM());
+		ql->lightData.directionals = ql->directionals;
+		ql->lightData.locals = ql->locals;
+		setLights(&ql->lightData);
+	}
+	RenderQueue::countState(RenderQueue::ATOMICSTATE, changed);
+
+	// prev tore its vertex input down already if it was different
+	changed = prev == nil || prev->header != header;
+	if(changed)
+		setupVertexInput(header);
+	RenderQueue::countState(RenderQueue::VERTEXSTATE, changed);
+
+	changed = prev == nil || prev->shader != e->shader;
+	if(changed)
+		((Shader*)e->shader)->use();
+	RenderQueue::countState(RenderQueue::SHADERSTATE, changed);
+
+	previnst = prev ? (InstanceData*)prev->inst : nil;
+	changed = previnst == nil || previnst->material->texture != m->texture;
+	if(changed)
+		setTexture(0, m->texture);
+	RenderQueue::countState(RenderQueue::TEXTURESTATE, changed);
+
+	// modulation depends on the geometry
+	changed = previnst == nil || previnst->material != m ||
+		prev->atomic->geometry->flags != atomic->geometry->flags;
+	if(changed)
+		setMaterial(atomic->geometry->flags, m->color, m->surfaceProps);
+	RenderQueue::countState(RenderQueue::MATERIALSTATE, changed);
+
+	changed = previnst == nil ||
+		(previnst->vertexAlpha || previnst->material->color.alpha != 0xFF) !=
+		(inst->vertexAlpha || m->color.alpha != 0xFF);
+	if(changed)
+		rw::SetRenderState(VERTEXALPHA, inst->vertexAlpha || m->color.alpha != 0xFF);
+	// only translucent meshes are queued with their blend functions
+	if(e->blend && (prev == nil || prev->blend != e->blend)){
+		rw::SetRenderState(SRCBLEND, e->blend>>4);
+		rw::SetRenderState(DESTBLEND, e->blend&0xF);
+		changed = 1;
+	}
+	RenderQueue::countState(RenderQueue::BLENDSTATE, changed);
+}
+
+void
+drawQueued(RenderQueue::Entry *e, RenderQueue::Entry *prev, RenderQueue::Entry *next)
+{
+	InstanceDataHeader *header = (InstanceDataHeader*)e->header;
+
+	setQueuedState(e, prev);
+	drawInst(header, (InstanceData*)e->inst);
+	if(next == nil || next->header != header)
+		teardownVertexInput(header);
+}
+
+// Adds all meshes to the render queue instead of drawing them
+static bool32
+queueAtomic(Atomic *atomic, InstanceDataHeader *header)
+{
+	QueuedLights *ql;
+	Shader *shader;
+	bool32 alphaTest;
+	uint32 blend;
+	float32 depth;
+
+	ql = queueLights(atomic, header, sizeof(QueuedLights));
+	if(ql == nil)
+		return 0;
+	alphaTest = getAlphaTest();
+	if(ql->lit)
+		shader = alphaTest ? defaultShader_fullLight : defaultShader_fullLight_noAT;
+	else
+		shader = alphaTest ? defaultShader : defaultShader_noAT;
+	blend = rw::GetRenderState(SRCBLEND)<<4 | rw::GetRenderState(DESTBLEND);
+	depth = RenderQueue::getDepth(atomic);
+
+	InstanceData *inst = header->inst;
+	int32 n = header->numMeshes;
+
+	while(n--){
+		queueInst(drawQueued, atomic, header, inst, shader, blend, depth,
+			isTranslucent(inst), ql);
+		inst++;
+	}
+	return 1;
+}
+
 void
 defaultRenderCB(Atomic *atomic, InstanceDataHeader *header)
 {
 	Material *m;
 
+	if(RenderQueue::isOpen() && queueAtomic(atomic, header))
+		return;
+
 	uint32 flags = atomic->geometry->flags;
 	setWorldMatrix(atomic->getFrame()->getLTM());
 	int32 vsBits = lightingCB(atomic);
@@ -210,34 +210,26 @@ skinUninstanceCB(Geometry *geo, InstanceDataHeader *header)
 
 static float skinMatrices[64*16];
 
-void
-uploadSkinMatrices(Atomic *a)
+static void
+getSkinMatrices(Atomic *a, Matrix *m)
 {
 	int i;
 	Skin *skin = Skin::get(a->geometry);
-	Matrix *m = (Matrix*)skinMatrices;
 	HAnimHierarchy *hier = Skin::getHierarchy(a);
 
 	if(hier){
 		Matrix *invMats = (Matrix*)skin->inverseMatrices;
-		Matrix tmp;
 
 		assert(skin->numBones == hier->numNodes);
-		if(hier->flags & HAnimHierarchy::LOCALSPACEMATRICES){
-			for(i = 0; i < hier->numNodes; i++){
-				invMats[i].flags = 0;
-				Matrix::mult(m, &invMats[i], &hier->matrices[i]);
-				m++;
-			}
-		}else{
+		for(i = 0; i < hier->numNodes; i++)
+			invMats[i].flags = 0;
+		if(hier->flags & HAnimHierarchy::LOCALSPACEMATRICES)
+			Matrix::multBatch(m, invMats, hier->matrices, hier->numNodes);
+		else{
 			Matrix invAtmMat;
 			Matrix::invert(&invAtmMat, a->getFrame()->getLTM());
-			for(i = 0; i < hier->numNodes; i++){
-				invMats[i].flags = 0;
-				Matrix::mult(&tmp, &hier->matrices[i], &invAtmMat);
-				Matrix::mult(m, &invMats[i], &tmp);
-				m++;
-			}
+			Matrix::transformBatch(m, hier->matrices, &invAtmMat, hier->numNodes);
+			Matrix::multBatch(m, invMats, m, hier->numNodes);
 		}
 	}else{
 		for(i = 0; i < skin->numBones; i++){
@@ -245,14 +237,85 @@ uploadSkinMatrices(Atomic *a)
 			m++;
 		}
 	}
+}
+
+void
+uploadSkinMatrices(Atomic *a)
+{
+	getSkinMatrices(a, (Matrix*)skinMatrices);
 	setUniform(u_boneMatrices, skinMatrices);
 }
 
+// Bone matrices of a queued atomic, calculated when it is queued
+struct QueuedSkin
+{
+	QueuedLights lights;
+	int32 numBones;
+	Matrix *matrices;
+};
+
+static void
+drawQueuedSkin(RenderQueue::Entry *e, RenderQueue::Entry *prev, RenderQueue::Entry *next)
+{
+	InstanceDataHeader *header = (InstanceDataHeader*)e->header;
+	QueuedSkin *qs = (QueuedSkin*)e->data;
+
+	setQueuedState(e, prev);
+	if(prev == nil || prev->atomic != e->atomic){
+		memcpy(skinMatrices, qs->matrices, qs->numBones*sizeof(Matrix));
+		setUniform(u_boneMatrices, skinMatrices);
+	}
+	drawInst(header, (InstanceData*)e->inst);
+	if(next == nil || next->header != header)
+		teardownVertexInput(header);
+}
+
+// Adds all meshes to the render queue instead of drawing them
+static bool32
+queueSkinAtomic(Atomic *atomic, InstanceDataHeader *header)
+{
+	QueuedSkin *qs;
+	Shader *shader;
+	bool32 alphaTest;
+	uint32 blend, size;
+	float32 depth;
+	int32 numBones;
+
+	numBones = Skin::get(atomic->geometry)->numBones;
+	size = (sizeof(QueuedSkin) + 15) & ~15;
+	qs = (QueuedSkin*)queueLights(atomic, header, size + numBones*sizeof(Matrix));
+	if(qs == nil)
+		return 0;
+	qs->numBones = numBones;
+	qs->matrices = (Matrix*)((uint8*)qs + size);
+	getSkinMatrices(atomic, qs->matrices);
+	alphaTest = getAlphaTest();
+	if(qs->lights.lit)
+		shader = alphaTest ? skinShader_fullLight : skinShader_fullLight_noAT;
+	else
+		shader = alphaTest ? skinShader : skinShader_noAT;
+	blend = rw::GetRenderState(SRCBLEND)<<4 | rw::GetRenderState(DESTBLEND);
+	depth = RenderQueue::getDepth(atomic);
+
+	InstanceData *inst = header->inst;
+	int32 n = header->numMeshes;
+
+	while(n--){
+		queueInst(drawQueuedSkin, atomic, header, inst, shader, blend, depth,
+			isTranslucent(inst), qs);
+		inst++;
+	}
+	return 1;
+}
+
 void
 skinRenderCB(Atomic *atomic, InstanceDataHeader *header)
 {
 	Material *m;
 
+	if(RenderQueue::isOpen() && queueSkinAtomic(atomic, header))
+		return;
+
 	uint32 flags = atomic->geometry->flags;
 	setWorldMatrix(atomic->getFrame()->getLTM());
 	int32 vsBits = lightingCB(atomic);
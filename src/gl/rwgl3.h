@@ -85,7 +85,8 @@ struct InstanceDataHeader : rw::InstanceDataHeader
 {
 	uint32      serialNumber;
 	uint32      numMeshes;
-	uint16     *indexBuffer;
+	void       *indexBuffer;
+	uint32      indexType;	// GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
 	uint32      primType;
 	uint8      *vertexBuffer;
 	int32       numAttribs;
@@ -222,6 +223,28 @@ uint32 bindTexture(uint32 texid);
 
 void flushCache(void);
 
+// Render queue support for render callbacks, see RenderQueue.
+// Lights of a queued atomic, found once when it is queued
+struct QueuedLights
+{
+	WorldLights lightData;
+	Light *directionals[8];
+	Light *locals[8];
+	bool32 lit;	// needs a lighting shader
+};
+// Makes room for the atomic's meshes and allocates size bytes of
+// entry data that start with its QueuedLights. nil if it can't be queued
+QueuedLights *queueLights(Atomic *atomic, InstanceDataHeader *header, uint32 size);
+bool32 isTranslucent(InstanceData *inst);
+// blend is only used if translucent, the queue must have room
+RenderQueue::Entry *queueInst(RenderQueue::DrawCB draw, Atomic *atomic,
+	InstanceDataHeader *header, InstanceData *inst, Shader *shader,
+	uint32 blend, float32 depth, bool32 translucent, void *data);
+// Sets everything the default pipeline needs to draw an entry.
+// Entry data must start with QueuedLights
+void setQueuedState(RenderQueue::Entry *e, RenderQueue::Entry *prev);
+void drawQueued(RenderQueue::Entry *e, RenderQueue::Entry *prev, RenderQueue::Entry *next);
+
 #endif
 
 class ObjPipeline : public rw::ObjPipeline
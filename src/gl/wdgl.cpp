@@ -327,6 +327,8 @@ instance(rw::ObjPipeline *rwpipe, Atomic *atomic)
 	// TODO: allow for REINSTANCE (or not, wdgl can't render)
 	if(geo->instData)
 		return;
+	if(!checkIndex16(geo))
+		return;
 	InstanceDataHeader *header = rwNewT(InstanceDataHeader, 1, MEMDUR_EVENT | ID_GEOMETRY);
 	geo->instData = header;
 	header->platform = PLATFORM_WDGL;
@@ -19,7 +19,7 @@
 
 namespace rw {
 
-int32 Image::numAllocated;
+AtomicInt32 Image::numAllocated;
 
 struct FileAssociation
 {
@@ -996,7 +996,9 @@ Image::read(const char *imageName)
 	int i;
 	char *filename, *ext, *found;
 	Image *img;
+	uint32 arena;
 
+	arena = beginFunctionArena();
 	filename = rwNewT(char, strlen(imageName) + 20, MEMDUR_FUNCTION | ID_IMAGE);
 	strcpy(filename, imageName);
 	ext = filename + strlen(filename);
@@ -1014,11 +1016,13 @@ Image::read(const char *imageName)
 			// It was a valid image of that format
 			if(img){
 				rwFree(filename);
+				endFunctionArena(arena);
 				return img;
 			}
 		}
 	}
 	rwFree(filename);
+	endFunctionArena(arena);
 	return nil;
 }
 
@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "rwbase.h"
+#include "rwerror.h"
+#include "rwplg.h"
+#include "rwpipeline.h"
+#include "rwobjects.h"
+#include "rwengine.h"
+
+#ifndef RW_PS2
+#define RW_THREADS
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#endif
+
+#define PLUGIN_ID 0
+
+namespace rw {
+
+typedef JobSystem::Job Job;
+
+#define MAXJOBTHREADS 16
+#define QUEUESIZE 256
+
+/*
+ * Every thread has a queue of
+ *	its share of the jobs given to run(), taken from the front by the
+ *	owner and from the back by thieves
+ *	a ring of spawned jobs, the owner takes the newest one (most likely
+ *	still in its cache), thieves the oldest (most likely the biggest)
+ */
+struct JobQueue
+{
+	Job *batch;
+	int32 first;
+	int32 last;
+	Job ring[QUEUESIZE];
+	uint32 head;
+	uint32 tail;
+#ifdef RW_THREADS
+	std::mutex mutex;
+#endif
+};
+
+#ifdef RW_THREADS
+#define LOCK(q) std::lock_guard<std::mutex> lock((q)->mutex)
+typedef std::atomic<int32> Counter;
+#else
+#define LOCK(q)
+typedef int32 Counter;
+#endif
+
+static struct
+{
+	JobQueue queues[MAXJOBTHREADS+1];	// 0 belongs to the thread calling run()
+	int32 numThreads;
+	Counter numPending;	// queued or running
+	Counter numIdle;
+	Counter running;	// somebody is in run()
+	Counter workSerial;	// bumped when idle threads should look for work again
+#ifdef RW_THREADS
+	uint32 generation;	// bumped by run() to wake the workers
+	bool32 quit;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::thread threads[MAXJOBTHREADS];
+#endif
+} jobs;
+
+static THREADLOCAL int32 queueIndex;
+static THREADLOCAL int32 inlineDepth;	// doing jobs outside of the queues
+
+static bool32
+popJob(JobQueue *q, Job *job)
+{
+	LOCK(q);
+	if(q->tail != q->head){
+		*job = q->ring[--q->tail % QUEUESIZE];
+		return 1;
+	}
+	if(q->first < q->last){
+		*job = q->batch[q->first++];
+		return 1;
+	}
+	return 0;
+}
+
+static bool32
+stealJob(JobQueue *q, Job *job)
+{
+	LOCK(q);
+	if(q->tail != q->head){
+		*job = q->ring[q->head++ % QUEUESIZE];
+		return 1;
+	}
+	if(q->first < q->last){
+		*job = q->batch[--q->last];
+		return 1;
+	}
+	return 0;
+}
+
+static bool32
+findJob(int32 self, Job *job)
+{
+	int32 i, n;
+	if(popJob(&jobs.queues[self], job))
+		return 1;
+	n = jobs.numThreads+1;
+	for(i = 1; i < n; i++)
+		if(stealJob(&jobs.queues[(self+i)%n], job))
+			return 1;
+	return 0;
+}
+
+// New jobs were queued or the last one is done
+static void
+wakeIdle(void)
+{
+#ifdef RW_THREADS
+	std::lock_guard<std::mutex> lock(jobs.mutex);
+	jobs.workSerial++;
+	jobs.wake.notify_all();
+#endif
+}
+
+static void
+waitForWork(int32 serial)
+{
+#ifdef RW_THREADS
+	std::unique_lock<std::mutex> lock(jobs.mutex);
+	while(jobs.workSerial == serial && jobs.numPending != 0)
+		jobs.wake.wait(lock);
+#else
+	(void)serial;
+#endif
+}
+
+// Run jobs until there are none left anywhere
+static void
+work(int32 self)
+{
+	Job job;
+	bool32 idle = 0;
+	int32 serial = 0;
+	for(;;){
+		if(idle)
+			serial = jobs.workSerial;
+		if(findJob(self, &job)){
+			if(idle){
+				jobs.numIdle--;
+				idle = 0;
+			}
+			job.func(&job);
+			if(--jobs.numPending == 0)
+				wakeIdle();
+			continue;
+		}
+		if(jobs.numPending == 0)
+			break;
+		// someone is still busy and may spawn more.
+		// Look once more after saying so, spawn() only wakes idle threads
+		if(!idle){
+			jobs.numIdle++;
+			idle = 1;
+			continue;
+		}
+		waitForWork(serial);
+	}
+	if(idle)
+		jobs.numIdle--;
+}
+
+#ifdef RW_THREADS
+static void
+jobThread(int32 index)
+{
+	uint32 seen;
+
+	queueIndex = index;
+	{
+		std::lock_guard<std::mutex> lock(jobs.mutex);
+		seen = jobs.generation;
+	}
+	for(;;){
+		{
+			std::unique_lock<std::mutex> lock(jobs.mutex);
+			while(jobs.generation == seen && !jobs.quit)
+				jobs.wake.wait(lock);
+			if(jobs.quit)
+				return;
+			seen = jobs.generation;
+		}
+		work(index);
+	}
+}
+#endif
+
+bool32
+JobSystem::start(int32 numThreads)
+{
+#ifdef RW_THREADS
+	if(jobs.numThreads)
+		return 0;
+	if(numThreads > MAXJOBTHREADS)
+		numThreads = MAXJOBTHREADS;
+	if(numThreads <= 0)
+		return 0;
+	jobs.quit = 0;
+	jobs.numThreads = numThreads;
+	for(int32 i = 0; i < numThreads; i++)
+		jobs.threads[i] = std::thread(jobThread, i+1);
+	return 1;
+#else
+	(void)numThreads;
+	return 0;
+#endif
+}
+
+void
+JobSystem::stop(void)
+{
+#ifdef RW_THREADS
+	if(jobs.numThreads == 0)
+		return;
+	{
+		std::lock_guard<std::mutex> lock(jobs.mutex);
+		jobs.quit = 1;
+		jobs.wake.notify_all();
+	}
+	for(int32 i = 0; i < jobs.numThreads; i++)
+		jobs.threads[i].join();
+	jobs.numThreads = 0;
+#endif
+}
+
+int32
+JobSystem::numThreads(void)
+{
+	return jobs.numThreads;
+}
+
+// Only one run() can use the queues at a time
+static bool32
+beginRun(void)
+{
+#ifdef RW_THREADS
+	int32 expected = 0;
+	return jobs.running.compare_exchange_strong(expected, 1);
+#else
+	if(jobs.running)
+		return 0;
+	jobs.running = 1;
+	return 1;
+#endif
+}
+
+// Everything, including spawned jobs, on the calling thread
+static void
+runInline(Job *list, int32 numJobs)
+{
+	inlineDepth++;
+	for(int32 i = 0; i < numJobs; i++)
+		list[i].func(&list[i]);
+	inlineDepth--;
+}
+
+void
+JobSystem::run(Job *list, int32 numJobs)
+{
+	int32 i, n;
+	JobQueue *q;
+
+	if(numJobs <= 0)
+		return;
+	// from inside a job or while another thread is in here
+	if(queueIndex != 0 || inlineDepth || !beginRun()){
+		runInline(list, numJobs);
+		return;
+	}
+	jobs.numPending += numJobs;
+	// everybody gets a contiguous share
+	n = jobs.numThreads+1;
+	for(i = 0; i < n; i++){
+		q = &jobs.queues[i];
+		LOCK(q);
+		q->batch = list;
+		q->first = (int32)((int64)numJobs*i/n);
+		q->last = (int32)((int64)numJobs*(i+1)/n);
+	}
+#ifdef RW_THREADS
+	if(jobs.numThreads){
+		std::lock_guard<std::mutex> lock(jobs.mutex);
+		jobs.generation++;
+		// also for threads still idle in the last run
+		jobs.workSerial++;
+		jobs.wake.notify_all();
+	}
+#endif
+	work(0);
+	jobs.running = 0;
+}
+
+void
+JobSystem::spawn(Job *job)
+{
+	JobQueue *q = &jobs.queues[queueIndex];
+	bool32 queued;
+	if(inlineDepth){
+		job->func(job);
+		return;
+	}
+	{
+		LOCK(q);
+		queued = q->tail - q->head < QUEUESIZE;
+		if(queued){
+			jobs.numPending++;
+			q->ring[q->tail++ % QUEUESIZE] = *job;
+		}
+	}
+	if(!queued){
+		// queue is full, do it right away
+		job->func(job);
+		return;
+	}
+	if(jobs.numIdle > 0)
+		wakeIdle();
+}
+
+bool32
+JobSystem::wanted(void)
+{
+	return jobs.numIdle > 0;
+}
+
+}
@@ -13,9 +13,10 @@
 
 namespace rw {
 
-int32 Light::numAllocated;
+AtomicInt32 Light::numAllocated;
 
 PluginList Light::s_plglist(sizeof(Light));
+FreeList *Light::s_freeList;
 
 static void
 lightSync(ObjectWithFrame*)
@@ -27,12 +28,14 @@ worldLightSync(ObjectWithFrame *obj)
 {
 	Light *light = (Light*)obj;
 	light->originalSync(obj);
+	if(light->world)
+		light->world->updateSector(light);
 }
 
 Light*
 Light::create(int32 type)
 {
-	Light *light = (Light*)rwMalloc(s_plglist.size, MEMDUR_EVENT | ID_LIGHT);
+	Light *light = (Light*)s_freeList->alloc();
 	if(light == nil){
 		RWERROR((ERR_ALLOC, s_plglist.size));
 		return nil;
@@ -56,6 +59,7 @@ Light::create(int32 type)
 
 	// world extension
 	light->world = nil;
+	light->sector = nil;
 	light->originalSync = light->object.syncCB;
 	light->object.syncCB = worldLightSync;
 
@@ -70,7 +74,7 @@ Light::destroy(void)
 	assert(this->clump == nil);
 	assert(this->world == nil);
 	this->setFrame(nil);
-	rwFree(this);
+	s_freeList->free(this);
 	numAllocated--;
 }
 
@@ -136,7 +140,9 @@ bool
 Light::streamWrite(Stream *stream)
 {
 	LightChunkData buf;
-	writeChunkHeader(stream, ID_LIGHT, this->streamGetSize());
+	int32 chunk = beginChunk(stream, ID_LIGHT);
+	if(chunk < 0)
+		writeChunkHeader(stream, ID_LIGHT, this->streamGetSize());
 	writeChunkHeader(stream, ID_STRUCT, sizeof(LightChunkData));
 	buf.radius = this->radius;
 	buf.red   = this->color.red;
@@ -151,6 +157,7 @@ Light::streamWrite(Stream *stream)
 	stream->write32(&buf, sizeof(LightChunkData));
 
 	s_plglist.streamWrite(stream, this);
+	endChunk(stream, chunk);
 	return true;
 }
 
@@ -0,0 +1,356 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "rwbase.h"
+#include "rwerror.h"
+#include "rwplg.h"
+#include "rwpipeline.h"
+#include "rwobjects.h"
+#include "rwengine.h"
+#include "rwanim.h"
+#include "rwplugins.h"
+
+#define PLUGIN_ID ID_LODATOMIC
+
+namespace rw {
+
+int32 lodAtomicOffset;
+
+// what the stream has for each level
+enum {
+	LEVEL_NONE = 0,
+	LEVEL_ATOMIC,	// the atomic's own geometry
+	LEVEL_INLINE	// a geometry chunk follows
+};
+
+#define LODPTR(a) (*PLUGINOFFSET(LODAtomic*, a, lodAtomicOffset))
+
+static LODAtomic*
+createLOD(Atomic *atomic)
+{
+	LODAtomic *lod = rwNewT(LODAtomic, 1, MEMDUR_EVENT | ID_LODATOMIC);
+	if(lod == nil){
+		RWERROR((ERR_ALLOC, sizeof(LODAtomic)));
+		return nil;
+	}
+	memset(lod, 0, sizeof(LODAtomic));
+	lod->geometries[0] = atomic->geometry;
+	if(atomic->geometry)
+		atomic->geometry->addRef();
+	lod->numLevels = 1;
+	lod->metric = LODAtomic::DISTANCE;
+	LODPTR(atomic) = lod;
+	return lod;
+}
+
+static void
+destroyLOD(LODAtomic *lod)
+{
+	for(int32 i = 0; i < lod->numLevels; i++)
+		if(lod->geometries[i])
+			lod->geometries[i]->destroy();
+	rwFree(lod);
+}
+
+static void
+lodRenderCB(Atomic *atomic)
+{
+	LODAtomic *lod = LODAtomic::get(atomic);
+	if(lod == nil || lod->renderCB == nil){
+		Atomic::defaultRenderCB(atomic);
+		return;
+	}
+	LODAtomic::selectLevel(atomic, engine->currentCamera);
+	lod->renderCB(atomic);
+}
+
+LODAtomic*
+LODAtomic::get(const Atomic *atomic)
+{
+	return LODPTR(atomic);
+}
+
+bool32
+LODAtomic::setLevel(Atomic *atomic, int32 level, Geometry *geo, float32 range)
+{
+	LODAtomic *lod;
+
+	if(level < 0 || level >= MAXLEVELS)
+		return 0;
+	lod = LODPTR(atomic);
+	if(lod == nil && (lod = createLOD(atomic)) == nil)
+		return 0;
+	if(geo)
+		geo->addRef();
+	if(lod->geometries[level])
+		lod->geometries[level]->destroy();
+	lod->geometries[level] = geo;
+	lod->ranges[level] = range;
+	if(level >= lod->numLevels)
+		lod->numLevels = level+1;
+	if(level == lod->current)
+		setCurrentLevel(atomic, level);
+	return 1;
+}
+
+Geometry*
+LODAtomic::getGeometry(const Atomic *atomic, int32 level)
+{
+	LODAtomic *lod = LODPTR(atomic);
+	if(lod == nil)
+		return level == 0 ? atomic->geometry : nil;
+	if(level < 0 || level >= lod->numLevels)
+		return nil;
+	return lod->geometries[level];
+}
+
+void
+LODAtomic::setMetric(Atomic *atomic, int32 metric)
+{
+	LODAtomic *lod = LODPTR(atomic);
+	if(lod == nil && (lod = createLOD(atomic)) == nil)
+		return;
+	lod->metric = metric;
+}
+
+int32
+LODAtomic::getCurrentLevel(const Atomic *atomic)
+{
+	LODAtomic *lod = LODPTR(atomic);
+	return lod ? lod->current : 0;
+}
+
+// Empty levels fall back to the next finer one.
+// The bounding sphere of the atomic is left alone so culling doesn't change with the level.
+void
+LODAtomic::setCurrentLevel(Atomic *atomic, int32 level)
+{
+	LODAtomic *lod = LODPTR(atomic);
+	if(lod == nil)
+		return;
+	if(level >= lod->numLevels)
+		level = lod->numLevels-1;
+	while(level > 0 && lod->geometries[level] == nil)
+		level--;
+	if(level < 0 || lod->geometries[level] == nil)
+		return;
+	lod->current = level;
+	if(atomic->geometry != lod->geometries[level])
+		atomic->setGeometry(lod->geometries[level], Atomic::SAMEBOUNDINGSPHERE);
+}
+
+int32
+LODAtomic::selectLevel(Atomic *atomic, Camera *cam)
+{
+	LODAtomic *lod;
+	Sphere *s;
+	float32 dist, size;
+	int32 i, level;
+
+	lod = LODPTR(atomic);
+	if(lod == nil)
+		return 0;
+	if(lod->numLevels < 2 || cam == nil || cam->getFrame() == nil)
+		return lod->current;
+
+	s = atomic->getWorldBoundingSphere();
+	dist = length(sub(s->center, cam->getFrame()->getLTM()->pos));
+	size = 0.0f;
+	if(lod->metric == SCREENSIZE){
+		// projected diameter relative to the screen height
+		if(cam->projection == Camera::PARALLEL)
+			size = s->radius/cam->viewWindow.y;
+		else if(dist > s->radius)
+			size = s->radius/(dist*cam->viewWindow.y);
+		else
+			size = 1.0e30f;
+	}
+	level = lod->numLevels-1;
+	for(i = 0; i < lod->numLevels-1; i++)
+		if(lod->metric == SCREENSIZE ? size >= lod->ranges[i] : dist <= lod->ranges[i]){
+			level = i;
+			break;
+		}
+	setCurrentLevel(atomic, level);
+	return lod->current;
+}
+
+void
+LODAtomic::hookRender(Atomic *atomic)
+{
+	LODAtomic *lod = LODPTR(atomic);
+	if(lod == nil && (lod = createLOD(atomic)) == nil)
+		return;
+	if(atomic->renderCB == lodRenderCB)
+		return;
+	lod->renderCB = atomic->renderCB;
+	atomic->setRenderCB(lodRenderCB);
+}
+
+void
+LODAtomic::unhookRender(Atomic *atomic)
+{
+	LODAtomic *lod = LODPTR(atomic);
+	if(lod == nil || atomic->renderCB != lodRenderCB)
+		return;
+	atomic->setRenderCB(lod->renderCB);
+	lod->renderCB = nil;
+}
+
+static void*
+createAtomicLOD(void *object, int32 offset, int32)
+{
+	*PLUGINOFFSET(LODAtomic*, object, offset) = nil;
+	return object;
+}
+
+static void*
+destroyAtomicLOD(void *object, int32 offset, int32)
+{
+	LODAtomic *lod = *PLUGINOFFSET(LODAtomic*, object, offset);
+	if(lod)
+		destroyLOD(lod);
+	*PLUGINOFFSET(LODAtomic*, object, offset) = nil;
+	return object;
+}
+
+// The render callback has already been copied, so the hook carries over
+static void*
+copyAtomicLOD(void *dst, void *src, int32 offset, int32)
+{
+	LODAtomic *srclod = *PLUGINOFFSET(LODAtomic*, src, offset);
+	LODAtomic *dstlod;
+	if(srclod == nil)
+		return dst;
+	dstlod = rwNewT(LODAtomic, 1, MEMDUR_EVENT | ID_LODATOMIC);
+	if(dstlod == nil){
+		RWERROR((ERR_ALLOC, sizeof(LODAtomic)));
+		return nil;
+	}
+	*dstlod = *srclod;
+	for(int32 i = 0; i < dstlod->numLevels; i++)
+		if(dstlod->geometries[i])
+			dstlod->geometries[i]->addRef();
+	*PLUGINOFFSET(LODAtomic*, dst, offset) = dstlod;
+	return dst;
+}
+
+/*
+ * RW's LOD Atomic PLG stores indices into the clump's geometry list, which plugins
+ * can't see, so this is a librw chunk and RW files keep skipping theirs.
+ * The level that is the atomic's geometry is marked and the others are
+ * written out as geometry chunks:
+ *	int32 numLevels, int32 metric, float32 ranges[numLevels],
+ *	for each level: int32 LEVEL_*, followed by a geometry if LEVEL_INLINE
+ */
+static Stream*
+readAtomicLOD(Stream *stream, int32, void *object, int32 offset, int32)
+{
+	Atomic *atomic = (Atomic*)object;
+	LODAtomic *lod;
+	Geometry *geo;
+	int32 i, numLevels, type;
+
+	numLevels = stream->readI32();
+	if(numLevels < 1 || numLevels > LODAtomic::MAXLEVELS){
+		RWERROR((ERR_GENERAL, "invalid number of LOD levels"));
+		return nil;
+	}
+	lod = rwNewT(LODAtomic, 1, MEMDUR_EVENT | ID_LODATOMIC);
+	if(lod == nil){
+		RWERROR((ERR_ALLOC, sizeof(LODAtomic)));
+		return nil;
+	}
+	memset(lod, 0, sizeof(LODAtomic));
+	*PLUGINOFFSET(LODAtomic*, object, offset) = lod;
+	lod->numLevels = numLevels;
+	lod->metric = stream->readI32();
+	for(i = 0; i < numLevels; i++)
+		lod->ranges[i] = stream->readF32();
+	for(i = 0; i < numLevels; i++){
+		type = stream->readI32();
+		if(type == LEVEL_ATOMIC){
+			geo = atomic->geometry;
+			if(geo)
+				geo->addRef();
+		}else if(type == LEVEL_INLINE){
+			if(!findChunk(stream, ID_GEOMETRY, nil, nil)){
+				RWERROR((ERR_CHUNK, "GEOMETRY"));
+				return nil;
+			}
+			geo = Geometry::streamRead(stream);
+			if(geo == nil)
+				return nil;
+		}else
+			geo = nil;
+		lod->geometries[i] = geo;
+	}
+
+	// start out at the finest level with its bounding sphere
+	if(lod->geometries[0] && atomic->geometry != lod->geometries[0])
+		atomic->setGeometry(lod->geometries[0], 0);
+	LODAtomic::setCurrentLevel(atomic, 0);
+	LODAtomic::hookRender(atomic);
+	return stream;
+}
+
+static Stream*
+writeAtomicLOD(Stream *stream, int32, void *object, int32 offset, int32)
+{
+	Atomic *atomic = (Atomic*)object;
+	LODAtomic *lod = *PLUGINOFFSET(LODAtomic*, object, offset);
+	Geometry *geo;
+	int32 i;
+
+	stream->writeI32(lod->numLevels);
+	stream->writeI32(lod->metric);
+	for(i = 0; i < lod->numLevels; i++)
+		stream->writeF32(lod->ranges[i]);
+	for(i = 0; i < lod->numLevels; i++){
+		geo = lod->geometries[i];
+		if(geo == nil)
+			stream->writeI32(LEVEL_NONE);
+		else if(geo == atomic->geometry)
+			stream->writeI32(LEVEL_ATOMIC);
+		else{
+			stream->writeI32(LEVEL_INLINE);
+			geo->streamWrite(stream);
+		}
+	}
+	return stream;
+}
+
+static int32
+getSizeAtomicLOD(void *object, int32 offset, int32)
+{
+	Atomic *atomic = (Atomic*)object;
+	LODAtomic *lod = *PLUGINOFFSET(LODAtomic*, object, offset);
+	Geometry *geo;
+	int32 i, size;
+
+	if(lod == nil || lod->numLevels < 2)
+		return 0;
+	size = 8 + 8*lod->numLevels;
+	for(i = 0; i < lod->numLevels; i++){
+		geo = lod->geometries[i];
+		if(geo && geo != atomic->geometry)
+			size += 12 + geo->streamGetSize();
+	}
+	return size;
+}
+
+void
+registerLODAtomicPlugin(void)
+{
+	lodAtomicOffset =
+	Atomic::registerPlugin(sizeof(LODAtomic*), ID_LODATOMIC,
+	                       createAtomicLOD, destroyAtomicLOD, copyAtomicLOD);
+	Atomic::registerPluginStream(ID_LODATOMIC,
+	                             readAtomicLOD,
+	                             writeAtomicLOD,
+	                             getSizeAtomicLOD);
+}
+
+}
@@ -0,0 +1,425 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "rwbase.h"
+#include "rwerror.h"
+#include "rwplg.h"
+#include "rwpipeline.h"
+#include "rwobjects.h"
+#include "rwengine.h"
+
+#define PLUGIN_ID ID_WORLD
+
+namespace rw {
+
+#define TILESIZE OcclusionBuffer::TILESIZE
+
+enum {
+	CLIPXLO = 0x01,
+	CLIPXHI = 0x02,
+	CLIPYLO = 0x04,
+	CLIPYHI = 0x08,
+	CLIPZLO = 0x10
+};
+
+static inline float32 minf(float32 a, float32 b) { return a < b ? a : b; }
+static inline float32 maxf(float32 a, float32 b) { return a > b ? a : b; }
+static inline int32 mini(int32 a, int32 b) { return a < b ? a : b; }
+static inline int32 maxi(int32 a, int32 b) { return a > b ? a : b; }
+
+OcclusionBuffer*
+OcclusionBuffer::create(int32 width, int32 height)
+{
+	OcclusionBuffer *ob;
+	int32 tilesX, tilesY;
+
+	tilesX = (width + TILESIZE-1)/TILESIZE;
+	tilesY = (height + TILESIZE-1)/TILESIZE;
+	ob = (OcclusionBuffer*)rwMalloc(sizeof(OcclusionBuffer) +
+		(tilesX*tilesY*TILESIZE*TILESIZE + tilesX*tilesY)*sizeof(float32),
+		MEMDUR_EVENT | ID_WORLD);
+	if(ob == nil){
+		RWERROR((ERR_ALLOC, sizeof(OcclusionBuffer)));
+		return nil;
+	}
+	ob->width = tilesX*TILESIZE;
+	ob->height = tilesY*TILESIZE;
+	ob->tilesX = tilesX;
+	ob->tilesY = tilesY;
+	ob->depth = (float32*)(ob+1);
+	ob->tileDepth = ob->depth + ob->width*ob->height;
+	ob->camera = nil;
+	ob->active = 0;
+	memset(&ob->stats, 0, sizeof(ob->stats));
+	return ob;
+}
+
+void
+OcclusionBuffer::destroy(void)
+{
+	rwFree(this);
+}
+
+void
+OcclusionBuffer::begin(Camera *cam)
+{
+	Matrix *m;
+
+	this->active = 0;
+	memset(&this->stats, 0, sizeof(this->stats));
+	memset(this->depth, 0, this->width*this->height*sizeof(float32));
+	if(cam->projection != Camera::PERSPECTIVE){
+		this->camera = nil;
+		return;
+	}
+	this->camera = cam;
+	this->viewMatrix = cam->viewMatrix;
+	this->nearPlane = cam->nearPlane;
+	// how far x and y can move for a unit in world space
+	m = &this->viewMatrix;
+	this->scaleX = sqrtf(m->right.x*m->right.x + m->up.x*m->up.x + m->at.x*m->at.x);
+	this->scaleY = sqrtf(m->right.y*m->right.y + m->up.y*m->up.y + m->at.y*m->at.y);
+}
+
+static uint32
+clipCode(const V3d *v, float32 nearPlane)
+{
+	uint32 code = 0;
+	if(v->x < 0.0f) code |= CLIPXLO;
+	if(v->x > v->z) code |= CLIPXHI;
+	if(v->y < 0.0f) code |= CLIPYLO;
+	if(v->y > v->z) code |= CLIPYHI;
+	if(v->z < nearPlane) code |= CLIPZLO;
+	return code;
+}
+
+// Edge functions and 1/z are evaluated at pixel centers
+static void
+drawTriangle(OcclusionBuffer *ob, const float32 *x, const float32 *y, const float32 *w)
+{
+	float32 area, s;
+	float32 a[3], b[3], c[3];
+	float32 dw, dwy, w0;
+	float32 e[3];
+	float32 minx, maxx, miny, maxy;
+	int32 x0, x1, y0, y1;
+	int32 tx, ty, px0, px1, py0, py1, py;
+	int32 i, j;
+
+	area = (x[1]-x[0])*(y[2]-y[0]) - (x[2]-x[0])*(y[1]-y[0]);
+	if(!(area != 0.0f))
+		return;
+	s = area < 0.0f ? -1.0f : 1.0f;
+	for(i = 0; i < 3; i++){
+		j = i == 2 ? 0 : i+1;
+		a[i] = (y[i] - y[j])*s;
+		b[i] = (x[j] - x[i])*s;
+		c[i] = -(a[i]*(x[i]-0.5f) + b[i]*(y[i]-0.5f));
+	}
+	dw = ((w[1]-w[0])*(y[2]-y[0]) - (w[2]-w[0])*(y[1]-y[0]))/area;
+	dwy = ((w[2]-w[0])*(x[1]-x[0]) - (w[1]-w[0])*(x[2]-x[0]))/area;
+	w0 = w[0] - dw*(x[0]-0.5f) - dwy*(y[0]-0.5f);
+
+	minx = minf(x[0], minf(x[1], x[2]));
+	maxx = maxf(x[0], maxf(x[1], x[2]));
+	miny = minf(y[0], minf(y[1], y[2]));
+	maxy = maxf(y[0], maxf(y[1], y[2]));
+	if(maxx < 0.0f || maxy < 0.0f || minx >= ob->width || miny >= ob->height)
+		return;
+	x0 = minx < 0.0f ? 0 : (int32)minx;
+	y0 = miny < 0.0f ? 0 : (int32)miny;
+	x1 = maxx >= ob->width ? ob->width-1 : (int32)maxx;
+	y1 = maxy >= ob->height ? ob->height-1 : (int32)maxy;
+	ob->stats.numTriangles++;
+
+	for(ty = y0/TILESIZE; ty <= y1/TILESIZE; ty++){
+		py0 = maxi(ty*TILESIZE, y0);
+		py1 = mini(ty*TILESIZE+TILESIZE-1, y1);
+		for(tx = x0/TILESIZE; tx <= x1/TILESIZE; tx++){
+			px0 = maxi(tx*TILESIZE, x0);
+			px1 = mini(tx*TILESIZE+TILESIZE-1, x1);
+			// skip tiles completely outside one edge
+			for(i = 0; i < 3; i++)
+				if(a[i]*(a[i] > 0.0f ? px1 : px0) +
+				   b[i]*(b[i] > 0.0f ? py1 : py0) + c[i] < 0.0f)
+					break;
+			if(i < 3)
+				continue;
+			for(py = py0; py <= py1; py++){
+				for(i = 0; i < 3; i++)
+					e[i] = a[i]*px0 + b[i]*py + c[i];
+				OcclusionBuffer::rasterizeRow(&ob->depth[py*ob->width + px0],
+					px1-px0+1, e, a, dw*px0 + dwy*py + w0, dw);
+			}
+		}
+	}
+}
+
+static void
+project(OcclusionBuffer *ob, const V3d *v, float32 *x, float32 *y, float32 *w)
+{
+	*w = 1.0f/v->z;
+	*x = v->x * *w * ob->width;
+	*y = v->y * *w * ob->height;
+}
+
+static void
+drawClipped(OcclusionBuffer *ob, const V3d *v0, const V3d *v1, const V3d *v2, uint32 codes)
+{
+	const V3d *in[3] = { v0, v1, v2 };
+	V3d out[4];
+	float32 x[4], y[4], w[4], t;
+	int32 i, j, n;
+
+	// only the near plane, the rest is done by the rasterizer
+	n = 0;
+	if(codes & CLIPZLO){
+		for(i = 0; i < 3; i++){
+			j = i == 2 ? 0 : i+1;
+			if(in[i]->z >= ob->nearPlane)
+				out[n++] = *in[i];
+			if((in[i]->z < ob->nearPlane) != (in[j]->z < ob->nearPlane)){
+				t = (ob->nearPlane - in[i]->z)/(in[j]->z - in[i]->z);
+				out[n++] = add(*in[i], scale(sub(*in[j], *in[i]), t));
+				out[n-1].z = ob->nearPlane;
+			}
+		}
+	}else
+		for(n = 0; n < 3; n++)
+			out[n] = *in[n];
+	for(i = 0; i < n; i++)
+		project(ob, &out[i], &x[i], &y[i], &w[i]);
+	if(n >= 3)
+		drawTriangle(ob, x, y, w);
+	if(n == 4){
+		x[1] = x[0]; y[1] = y[0]; w[1] = w[0];
+		drawTriangle(ob, &x[1], &y[1], &w[1]);
+	}
+}
+
+// stride is the distance between triangles in the index array,
+// which is either 16 or 32 bit
+static void
+drawTriangles(OcclusionBuffer *ob, const V3d *verts, int32 numVerts,
+	const uint16 *indices, const uint32 *indices32, int32 stride,
+	int32 numTris, const Matrix *ltm)
+{
+	Matrix m;
+	V3d *clip;
+	uint32 *codes;
+	uint32 arena;
+	int32 i;
+	uint32 a, b, c;
+	uint32 c0, c1, c2;
+
+	if(ob->camera == nil || numTris <= 0)
+		return;
+	arena = beginFunctionArena();
+	clip = rwNewT(V3d, numVerts, MEMDUR_FUNCTION | ID_WORLD);
+	codes = rwNewT(uint32, numVerts, MEMDUR_FUNCTION | ID_WORLD);
+	Matrix::mult(&m, ltm, &ob->viewMatrix);
+	V3d::transformPoints(clip, verts, numVerts, &m);
+	for(i = 0; i < numVerts; i++)
+		codes[i] = clipCode(&clip[i], ob->nearPlane);
+	for(i = 0; i < numTris; i++){
+		if(indices32){
+			a = indices32[0];
+			b = indices32[1];
+			c = indices32[2];
+			indices32 += stride;
+		}else{
+			a = indices[0];
+			b = indices[1];
+			c = indices[2];
+			indices += stride;
+		}
+		c0 = codes[a];
+		c1 = codes[b];
+		c2 = codes[c];
+		if(c0 & c1 & c2)
+			continue;
+		drawClipped(ob, &clip[a], &clip[b], &clip[c], c0 | c1 | c2);
+	}
+	rwFree(codes);
+	rwFree(clip);
+	endFunctionArena(arena);
+}
+
+void
+OcclusionBuffer::addTriangles(const V3d *verts, int32 numVerts,
+	const uint16 *indices, int32 numTris, const Matrix *ltm)
+{
+	drawTriangles(this, verts, numVerts, indices, nil, 3, numTris, ltm);
+}
+
+void
+OcclusionBuffer::addTriangles(const V3d *verts, int32 numVerts,
+	const uint32 *indices, int32 numTris, const Matrix *ltm)
+{
+	drawTriangles(this, verts, numVerts, nil, indices, 3, numTris, ltm);
+}
+
+void
+OcclusionBuffer::addOccluder(Atomic *atomic)
+{
+	Geometry *geo = atomic->geometry;
+	if(geo == nil || geo->triangles == nil || geo->numMorphTargets == 0)
+		return;
+	this->stats.numOccluders++;
+	drawTriangles(this, geo->morphTargets[0].vertices, geo->numVertices,
+		nil, geo->triangles[0].v, sizeof(Triangle)/sizeof(uint32), geo->numTriangles,
+		atomic->getFrame()->getLTM());
+}
+
+void
+OcclusionBuffer::end(void)
+{
+	int32 tx, ty, x, y;
+	float32 d, *row;
+
+	if(this->camera == nil)
+		return;
+	for(ty = 0; ty < this->tilesY; ty++)
+		for(tx = 0; tx < this->tilesX; tx++){
+			row = &this->depth[ty*TILESIZE*this->width + tx*TILESIZE];
+			d = row[0];
+			for(y = 0; y < TILESIZE; y++, row += this->width)
+				for(x = 0; x < TILESIZE; x++)
+					d = minf(d, row[x]);
+			this->tileDepth[ty*this->tilesX + tx] = d;
+		}
+	this->active = 1;
+}
+
+// Is any pixel of the rectangle farther away than w?
+static bool32
+testRect(OcclusionBuffer *ob, float32 minx, float32 miny, float32 maxx, float32 maxy, float32 w)
+{
+	int32 x0, x1, y0, y1;
+	int32 tx, ty, px0, px1, py0, py1, px, py;
+	float32 *row;
+
+	// occluders are only sampled at pixel centers,
+	// the neighbouring pixels tell if one really covers the border
+	minx = minx*ob->width - 1.0f;
+	maxx = maxx*ob->width + 1.0f;
+	miny = miny*ob->height - 1.0f;
+	maxy = maxy*ob->height + 1.0f;
+	// off screen is for the frustum test to decide
+	if(maxx < 0.0f || maxy < 0.0f || minx >= ob->width || miny >= ob->height)
+		return 1;
+	x0 = minx < 0.0f ? 0 : (int32)minx;
+	y0 = miny < 0.0f ? 0 : (int32)miny;
+	x1 = maxx >= ob->width ? ob->width-1 : (int32)maxx;
+	y1 = maxy >= ob->height ? ob->height-1 : (int32)maxy;
+
+	for(ty = y0/TILESIZE; ty <= y1/TILESIZE; ty++){
+		py0 = maxi(ty*TILESIZE, y0);
+		py1 = mini(ty*TILESIZE+TILESIZE-1, y1);
+		for(tx = x0/TILESIZE; tx <= x1/TILESIZE; tx++){
+			if(ob->tileDepth[ty*ob->tilesX + tx] > w)
+				continue;
+			px0 = maxi(tx*TILESIZE, x0);
+			px1 = mini(tx*TILESIZE+TILESIZE-1, x1);
+			for(py = py0; py <= py1; py++){
+				row = &ob->depth[py*ob->width];
+				for(px = px0; px <= px1; px++)
+					if(row[px] <= w)
+						return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+bool32
+OcclusionBuffer::isVisible(const Sphere *sphere)
+{
+	V3d c;
+	float32 r, rx, ry, zmin, zmax;
+	float32 x0, x1, y0, y1;
+	bool32 visible;
+
+	if(!this->active)
+		return 1;
+	this->stats.numTested++;
+	V3d::transformPoints(&c, &sphere->center, 1, &this->viewMatrix);
+	r = sphere->radius;
+	zmin = c.z - r;
+	if(zmin <= this->nearPlane)
+		return 1;
+	zmax = c.z + r;
+	// bounding box of the sphere in view space, then its projection
+	rx = r*this->scaleX;
+	ry = r*this->scaleY;
+	x0 = minf((c.x-rx)/zmin, (c.x-rx)/zmax);
+	x1 = maxf((c.x+rx)/zmin, (c.x+rx)/zmax);
+	y0 = minf((c.y-ry)/zmin, (c.y-ry)/zmax);
+	y1 = maxf((c.y+ry)/zmin, (c.y+ry)/zmax);
+	visible = testRect(this, x0, y0, x1, y1, 1.0f/zmin);
+	if(!visible)
+		this->stats.numOccluded++;
+	return visible;
+}
+
+bool32
+OcclusionBuffer::isVisible(const BBox *box)
+{
+	V3d corners[8], *v;
+	float32 zmin, x0, x1, y0, y1, x, y;
+	bool32 visible;
+	int32 i;
+
+	if(!this->active)
+		return 1;
+	this->stats.numTested++;
+	for(i = 0; i < 8; i++){
+		corners[i].x = i & 1 ? box->sup.x : box->inf.x;
+		corners[i].y = i & 2 ? box->sup.y : box->inf.y;
+		corners[i].z = i & 4 ? box->sup.z : box->inf.z;
+	}
+	V3d::transformPoints(corners, corners, 8, &this->viewMatrix);
+	zmin = corners[0].z;
+	for(i = 1; i < 8; i++)
+		zmin = minf(zmin, corners[i].z);
+	if(zmin <= this->nearPlane)
+		return 1;
+	v = corners;
+	x0 = x1 = v->x/v->z;
+	y0 = y1 = v->y/v->z;
+	for(i = 1, v++; i < 8; i++, v++){
+		x = v->x/v->z;
+		y = v->y/v->z;
+		x0 = minf(x0, x);
+		x1 = maxf(x1, x);
+		y0 = minf(y0, y);
+		y1 = maxf(y1, y);
+	}
+	visible = testRect(this, x0, y0, x1, y1, 1.0f/zmin);
+	if(!visible)
+		this->stats.numOccluded++;
+	return visible;
+}
+
+void
+OcclusionBuffer::rasterizeRowRef(float32 *row, int32 n, const float32 *e,
+	const float32 *de, float32 w, float32 dw)
+{
+	int32 j;
+	float32 fj, z;
+	for(j = 0; j < n; j++){
+		fj = (float32)j;
+		if(e[0] + fj*de[0] >= 0.0f &&
+		   e[1] + fj*de[1] >= 0.0f &&
+		   e[2] + fj*de[2] >= 0.0f){
+			z = w + fj*dw;
+			if(z > row[j])
+				row[j] = z;
+		}
+	}
+}
+
+}
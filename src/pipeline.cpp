@@ -4,11 +4,14 @@
 #include <assert.h>
 
 #include "rwbase.h"
+#include "rwerror.h"
 #include "rwplg.h"
 #include "rwpipeline.h"
 #include "rwobjects.h"
 #include "rwengine.h"
 
+#define PLUGIN_ID 0
+
 #define COLOR_ARGB(a,r,g,b) \
     ((uint32)((((a)&0xff)<<24)|(((r)&0xff)<<16)|(((g)&0xff)<<8)|((b)&0xff)))
 
@@ -65,6 +68,39 @@ findMinVertAndNumVertices(uint16 *indices, uint32 numIndices, uint32 *minVert, i
 		*numVertices = num;
 }
 
+void
+findMinVertAndNumVertices(uint32 *indices, uint32 numIndices, uint32 *minVert, int32 *numVertices)
+{
+	uint32 min = 0xFFFFFFFF;
+	uint32 max = 0;
+	while(numIndices--){
+		if(*indices < min)
+			min = *indices;
+		if(*indices > max)
+			max = *indices;
+		indices++;
+	}
+	uint32 num = max - min + 1;
+	if(min > max){
+		min = 0;
+		num = 0;
+	}
+	if(minVert)
+		*minVert = min;
+	if(numVertices)
+		*numVertices = num;
+}
+
+bool32
+checkIndex16(Geometry *geo)
+{
+	if(geo->meshHeader && geo->meshHeader->index32){
+		RWERROR((ERR_GENERAL, "can't instance geometry with 32 bit indices"));
+		return 0;
+	}
+	return 1;
+}
+
 void
 instV4d(int type, uint8 *dst, V4d *src, uint32 numVertices, uint32 stride)
 {
@@ -36,6 +36,7 @@ PluginList::close(void)
 	FORLIST(lnk, allPlugins){
 		p = LLLinkGetData(lnk, Plugin, inGlobalList);
 		l = p->parentList;
+		l->invalidate();
 		p->inParentList.remove();
 		p->inGlobalList.remove();
 		rwFree(p);
@@ -45,11 +46,85 @@ PluginList::close(void)
 	assert(allPlugins.isEmpty());
 }
 
+// lists without plugins share this so they don't allocate anything
+static Plugin *emptyTable[1];
+
 void
-PluginList::construct(void *object)
+PluginList::invalidate(void)
+{
+	if(this->table != emptyTable)
+		rwFree(this->table);
+	this->table = nil;
+}
+
+void
+PluginList::compile(void)
 {
+	int32 i, j, n;
+	Plugin *p;
+
+	n = 0;
+	FORLIST(lnk, this->plugins)
+		n++;
+	this->invalidate();
+	// one block for all four arrays
+	this->table = n ? rwNewT(Plugin*, 4*n, MEMDUR_GLOBAL) : emptyTable;
+	this->byId = this->table + n;
+	this->streamTable = this->byId + n;
+	this->alwaysTable = this->streamTable + n;
+	this->numPlugins = 0;
+	this->numStream = 0;
+	this->numAlways = 0;
 	FORLIST(lnk, this->plugins){
-		Plugin *p = PLG(lnk);
+		p = PLG(lnk);
+		this->table[this->numPlugins++] = p;
+		if(p->getSize)
+			this->streamTable[this->numStream++] = p;
+		if(p->alwaysCallback)
+			this->alwaysTable[this->numAlways++] = p;
+	}
+	// insertion sort, keeps list order for equal IDs
+	for(i = 0; i < n; i++){
+		p = this->table[i];
+		for(j = i; j > 0 && this->byId[j-1]->id > p->id; j--)
+			this->byId[j] = this->byId[j-1];
+		this->byId[j] = p;
+	}
+}
+
+// Index of the first plugin with this ID in byId, or -1
+static int32
+findFirst(PluginList *l, uint32 id)
+{
+	int32 lo, hi, mid;
+	lo = 0;
+	hi = l->numPlugins;
+	while(lo < hi){
+		mid = (lo + hi)/2;
+		if(l->byId[mid]->id < id)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	return lo < l->numPlugins && l->byId[lo]->id == id ? lo : -1;
+}
+
+Plugin*
+PluginList::find(uint32 id)
+{
+	if(this->table == nil)
+		this->compile();
+	int32 i = findFirst(this, id);
+	return i < 0 ? nil : this->byId[i];
+}
+
+void
+PluginList::construct(void *object)
+{
+	if(this->table == nil)
+		this->compile();
+	for(int32 i = 0; i < this->numPlugins; i++){
+		Plugin *p = this->table[i];
 		p->constructor(object, p->offset, p->size);
 	}
 }
@@ -57,8 +132,10 @@ PluginList::construct(void *object)
 void
 PluginList::destruct(void *object)
 {
-	FORLIST(lnk, this->plugins){
-		Plugin *p = PLG(lnk);
+	if(this->table == nil)
+		this->compile();
+	for(int32 i = 0; i < this->numPlugins; i++){
+		Plugin *p = this->table[i];
 		p->destructor(object, p->offset, p->size);
 	}
 }
@@ -66,8 +143,10 @@ PluginList::destruct(void *object)
 void
 PluginList::copy(void *dst, void *src)
 {
-	FORLIST(lnk, this->plugins){
-		Plugin *p = PLG(lnk);
+	if(this->table == nil)
+		this->compile();
+	for(int32 i = 0; i < this->numPlugins; i++){
+		Plugin *p = this->table[i];
 		p->copy(dst, src, p->offset, p->size);
 	}
 }
@@ -76,31 +155,35 @@ bool
 PluginList::streamRead(Stream *stream, void *object)
 {
 	int32 length;
+	int32 i;
 	ChunkHeaderInfo header;
 	if(!findChunk(stream, ID_EXTENSION, (uint32*)&length, nil))
 		return false;
+	if(this->table == nil)
+		this->compile();
 	while(length > 0){
 		if(!readChunkHeaderInfo(stream, &header))
 			return false;
 		length -= 12;
-		FORLIST(lnk, this->plugins){
-			Plugin *p = PLG(lnk);
-			if(p->id == header.type && p->read){
-				p->read(stream, header.length,
-				        object, p->offset, p->size);
-				goto cont;
+		i = findFirst(this, header.type);
+		if(i >= 0)
+			for(; i < this->numPlugins && this->byId[i]->id == header.type; i++){
+				Plugin *p = this->byId[i];
+				if(p->read){
+					p->read(stream, header.length,
+					        object, p->offset, p->size);
+					goto cont;
+				}
 			}
-		}
 		stream->seek(header.length);
 cont:
 		length -= header.length;
 	}
 
 	// now the always callbacks
-	FORLIST(lnk, this->plugins){
-		Plugin *p = PLG(lnk);
-		if(p->alwaysCallback)
-			p->alwaysCallback(object, p->offset, p->size);
+	for(i = 0; i < this->numAlways; i++){
+		Plugin *p = this->alwaysTable[i];
+		p->alwaysCallback(object, p->offset, p->size);
 	}
 	return true;
 }
@@ -108,16 +191,20 @@ cont:
 void
 PluginList::streamWrite(Stream *stream, void *object)
 {
-	int size = this->streamGetSize(object);
-	writeChunkHeader(stream, ID_EXTENSION, size);
-	FORLIST(lnk, this->plugins){
-		Plugin *p = PLG(lnk);
-		if(p->getSize == nil ||
-		   (size = p->getSize(object, p->offset, p->size)) <= 0)
+	int size;
+	int32 chunk = beginChunk(stream, ID_EXTENSION);
+	if(chunk < 0)
+		writeChunkHeader(stream, ID_EXTENSION, this->streamGetSize(object));
+	else if(this->table == nil)
+		this->compile();
+	for(int32 i = 0; i < this->numStream; i++){
+		Plugin *p = this->streamTable[i];
+		if((size = p->getSize(object, p->offset, p->size)) <= 0)
 			continue;
 		writeChunkHeader(stream, p->id, size);
 		p->write(stream, size, object, p->offset, p->size);
 	}
+	endChunk(stream, chunk);
 }
 
 int
@@ -125,10 +212,11 @@ PluginList::streamGetSize(void *object)
 {
 	int32 size = 0;
 	int32 plgsize;
-	FORLIST(lnk, this->plugins){
-		Plugin *p = PLG(lnk);
-		if(p->getSize &&
-		   (plgsize = p->getSize(object, p->offset, p->size)) > 0)
+	if(this->table == nil)
+		this->compile();
+	for(int32 i = 0; i < this->numStream; i++){
+		Plugin *p = this->streamTable[i];
+		if((plgsize = p->getSize(object, p->offset, p->size)) > 0)
 			size += 12 + plgsize;
 	}
 	return size;
@@ -152,15 +240,9 @@ PluginList::streamSkip(Stream *stream)
 void
 PluginList::assertRights(void *object, uint32 pluginID, uint32 data)
 {
-	FORLIST(lnk, this->plugins){
-		Plugin *p = PLG(lnk);
-		if(p->id == pluginID){
-			if(p->rightsCallback)
-				p->rightsCallback(object,
-				                  p->offset, p->size, data);
-			return;
-		}
-	}
+	Plugin *p = this->find(pluginID);
+	if(p && p->rightsCallback)
+		p->rightsCallback(object, p->offset, p->size, data);
 }
 
 
@@ -187,6 +269,7 @@ PluginList::registerPlugin(int32 size, uint32 id,
 	p->parentList = this;
 	this->plugins.append(&p->inParentList);
 	allPlugins.append(&p->inGlobalList);
+	this->invalidate();
 	return p->offset;
 }
 
@@ -200,6 +283,7 @@ PluginList::registerStream(uint32 id,
 			p->read = read;
 			p->write = write;
 			p->getSize = getSize;
+			this->invalidate();
 			return p->offset;
 		}
 	}
@@ -226,6 +310,7 @@ PluginList::setStreamAlwaysCallback(uint32 id, AlwaysCallback cb)
 		Plugin *p = PLG(lnk);
 		if(p->id == id){
 			p->alwaysCallback = cb;
+			this->invalidate();
 			return p->offset;
 		}
 	}
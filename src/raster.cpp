@@ -20,7 +20,7 @@
 
 namespace rw {
 
-int32 Raster::numAllocated;
+AtomicInt32 Raster::numAllocated;
 
 struct RasterGlobals
 {
@@ -188,6 +188,9 @@ void
 Raster::show(uint32 flags)
 {
 	engine->device.showRaster(this, flags);
+	// end of the frame, not of a camera update,
+	// there may be more than one of those per frame
+	resetFrameArena();
 }
 
 Raster*
@@ -0,0 +1,385 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "rwbase.h"
+#include "rwerror.h"
+#include "rwplg.h"
+#include "rwpipeline.h"
+#include "rwobjects.h"
+#include "rwengine.h"
+
+#define PLUGIN_ID ID_RENDERQUEUEMODULE
+
+namespace rw {
+
+typedef RenderQueue::Entry Entry;
+
+/*
+ * Sort keys, from the most significant bit:
+ *	opaque:      0 | pipeline:6 | shader:6 | raster:16 | blend:8 | depth:24 | 0:3
+ *	translucent: 1 | ~depth:24 | pipeline:6 | shader:6 | raster:16 | blend:8 | 0:3
+ * Objects are replaced by small ids in the order they are first seen,
+ * ids that don't fit are clamped, which only makes the grouping worse.
+ */
+enum {
+	IDKIND_PIPELINE,
+	IDKIND_SHADER,
+	IDKIND_RASTER,
+	NUMIDKINDS
+};
+
+#define IDTABLESIZE 1024	// power of two
+#define DATABLOCKSIZE 0x10000
+
+struct IdSlot
+{
+	void *object;
+	uint32 id;
+};
+
+struct DataBlock
+{
+	DataBlock *next;
+	uint32 used;
+	uint32 size;
+	// data follows
+};
+
+struct SortItem
+{
+	uint64 key;
+	int32 index;
+};
+
+struct RenderQueueGlobals
+{
+	bool32 open;
+	V3d camPos;
+	V3d camAt;
+	Entry *entries;
+	SortItem *items;	// twice as many for the radix sort
+	int32 numEntries;
+	int32 maxEntries;
+	IdSlot ids[IDTABLESIZE];
+	uint32 numIds[NUMIDKINDS];
+	DataBlock *blocks;	// the current one is first
+	DataBlock *freeBlocks;
+	RenderQueueStats stats;
+};
+
+static int32 renderQueueOffset;
+
+#define RQGLOBAL(v) (PLUGINOFFSET(RenderQueueGlobals, engine, renderQueueOffset)->v)
+
+bool32 RenderQueue::enabled = 1;
+
+static void*
+renderQueueOpen(void *object, int32 offset, int32 size)
+{
+	renderQueueOffset = offset;
+	RenderQueueGlobals *g = PLUGINOFFSET(RenderQueueGlobals, object, offset);
+	memset(g, 0, sizeof(*g));
+	return object;
+}
+
+static void
+freeBlocks(DataBlock *b)
+{
+	DataBlock *next;
+	for(; b; b = next){
+		next = b->next;
+		rwFree(b);
+	}
+}
+
+static void*
+renderQueueClose(void *object, int32 offset, int32 size)
+{
+	RenderQueueGlobals *g = PLUGINOFFSET(RenderQueueGlobals, object, offset);
+	rwFree(g->entries);
+	rwFree(g->items);
+	freeBlocks(g->blocks);
+	freeBlocks(g->freeBlocks);
+	memset(g, 0, sizeof(*g));
+	return object;
+}
+
+void
+RenderQueue::registerModule(void)
+{
+	Engine::registerPlugin(sizeof(RenderQueueGlobals), ID_RENDERQUEUEMODULE,
+		renderQueueOpen, renderQueueClose);
+}
+
+static uint32
+getId(RenderQueueGlobals *g, int32 kind, void *object, uint32 max)
+{
+	uintptr h;
+	uint32 i, id;
+
+	if(object == nil)
+		return 0;
+	h = (uintptr)object;
+	h ^= h >> 15;
+	h *= 0x9E3779B1u;
+	for(i = (uint32)(h >> 8); ; i++){
+		IdSlot *s = &g->ids[i & (IDTABLESIZE-1)];
+		if(s->object == object)
+			return s->id;
+		if(s->object == nil){
+			// keep a quarter of the table free so probing stays short
+			if(g->numIds[IDKIND_PIPELINE] + g->numIds[IDKIND_SHADER] + g->numIds[IDKIND_RASTER] >=
+			   IDTABLESIZE*3/4)
+				return max;
+			id = ++g->numIds[kind];
+			if(id > max)
+				id = max;
+			s->object = object;
+			s->id = id;
+			return id;
+		}
+	}
+}
+
+// Non-negative floats sort like their bit patterns
+static uint32
+quantizeDepth(float32 depth)
+{
+	union { float32 f; uint32 u; } u;
+	if(!(depth > 0.0f))
+		return 0;
+	u.f = depth;
+	return u.u >> 8;	// 23 bits left
+}
+
+bool32
+RenderQueue::begin(void)
+{
+	RenderQueueGlobals *g = PLUGINOFFSET(RenderQueueGlobals, engine, renderQueueOffset);
+	Camera *cam;
+	Matrix *ltm;
+
+	if(g->open)
+		return 0;
+	g->open = 1;
+	g->numEntries = 0;
+	memset(g->ids, 0, sizeof(g->ids));
+	memset(g->numIds, 0, sizeof(g->numIds));
+	cam = (Camera*)engine->currentCamera;
+	if(cam && cam->getFrame()){
+		ltm = cam->getFrame()->getLTM();
+		g->camPos = ltm->pos;
+		g->camAt = ltm->at;
+	}else{
+		g->camPos.set(0.0f, 0.0f, 0.0f);
+		g->camAt.set(0.0f, 0.0f, 0.0f);
+	}
+	return 1;
+}
+
+bool32
+RenderQueue::isOpen(void)
+{
+	return RQGLOBAL(open);
+}
+
+bool32
+RenderQueue::reserve(int32 num)
+{
+	RenderQueueGlobals *g = PLUGINOFFSET(RenderQueueGlobals, engine, renderQueueOffset);
+	Entry *entries;
+	SortItem *items;
+	int32 n;
+
+	if(g->numEntries + num <= g->maxEntries)
+		return 1;
+	n = g->maxEntries ? 2*g->maxEntries : 256;
+	while(n < g->numEntries + num)
+		n *= 2;
+	entries = rwResizeT(Entry, g->entries, n, MEMDUR_GLOBAL | ID_RENDERQUEUEMODULE);
+	if(entries == nil)
+		return 0;
+	g->entries = entries;
+	items = rwResizeT(SortItem, g->items, 2*n, MEMDUR_GLOBAL | ID_RENDERQUEUEMODULE);
+	if(items == nil)
+		return 0;
+	g->items = items;
+	g->maxEntries = n;
+	return 1;
+}
+
+Entry*
+RenderQueue::add(DrawCB draw, void *pipeline, void *shader, void *raster,
+	uint32 blend, float32 depth, bool32 translucent)
+{
+	RenderQueueGlobals *g = PLUGINOFFSET(RenderQueueGlobals, engine, renderQueueOffset);
+	uint64 pip, shd, ras, dep, key;
+	Entry *e;
+
+	if(!g->open || !reserve(1))
+		return nil;
+
+	pip = getId(g, IDKIND_PIPELINE, pipeline, 0x3F);
+	shd = getId(g, IDKIND_SHADER, shader, 0x3F);
+	ras = getId(g, IDKIND_RASTER, raster, 0xFFFF);
+	dep = quantizeDepth(depth);
+	blend &= 0xFF;
+	if(translucent)
+		key = 1ull<<63 | (0xFFFFFF - dep)<<39 | pip<<33 | shd<<27 | ras<<11 | (uint64)blend<<3;
+	else
+		key = pip<<57 | shd<<51 | ras<<35 | (uint64)blend<<27 | dep<<3;
+
+	e = &g->entries[g->numEntries++];
+	e->key = key;
+	e->draw = draw;
+	e->atomic = nil;
+	e->header = nil;
+	e->inst = nil;
+	e->shader = shader;
+	e->blend = blend;
+	e->data = nil;
+	return e;
+}
+
+void*
+RenderQueue::alloc(uint32 size)
+{
+	RenderQueueGlobals *g = PLUGINOFFSET(RenderQueueGlobals, engine, renderQueueOffset);
+	DataBlock *b;
+	uint8 *p;
+
+	size = (size + 15) & ~15;
+	b = g->blocks;
+	if(b == nil || b->used + size > b->size){
+		if(g->freeBlocks && size <= DATABLOCKSIZE){
+			b = g->freeBlocks;
+			g->freeBlocks = b->next;
+		}else{
+			uint32 sz = size > DATABLOCKSIZE ? size : DATABLOCKSIZE;
+			b = (DataBlock*)rwMalloc(sizeof(DataBlock) + 16 + sz,
+				MEMDUR_GLOBAL | ID_RENDERQUEUEMODULE);
+			if(b == nil)
+				return nil;
+			b->size = sz;
+		}
+		b->used = 0;
+		b->next = g->blocks;
+		g->blocks = b;
+	}
+	p = (uint8*)(((uintptr)(b+1) + 15) & ~(uintptr)15);
+	p += b->used;
+	b->used += size;
+	return p;
+}
+
+float32
+RenderQueue::getDepth(Atomic *atomic)
+{
+	RenderQueueGlobals *g = PLUGINOFFSET(RenderQueueGlobals, engine, renderQueueOffset);
+	Sphere *s = atomic->getWorldBoundingSphere();
+	return dot(sub(s->center, g->camPos), g->camAt);
+}
+
+void
+RenderQueue::countState(int32 state, bool32 changed)
+{
+	RenderQueueGlobals *g = PLUGINOFFSET(RenderQueueGlobals, engine, renderQueueOffset);
+	if(changed)
+		g->stats.changes[state]++;
+	else
+		g->stats.avoided[state]++;
+}
+
+// Stable LSD radix sort on bytes, bytes that are the same in all keys are skipped.
+// Returns the array that holds the result.
+static SortItem*
+radixSort(SortItem *items, SortItem *tmp, int32 n)
+{
+	int32 counts[8][256];
+	SortItem *t;
+	int32 i, b, sum, c;
+	uint64 key;
+
+	memset(counts, 0, sizeof(counts));
+	for(i = 0; i < n; i++){
+		key = items[i].key;
+		for(b = 0; b < 8; b++)
+			counts[b][(key >> 8*b) & 0xFF]++;
+	}
+	for(b = 0; b < 8; b++){
+		if(counts[b][(items[0].key >> 8*b) & 0xFF] == n)
+			continue;
+		sum = 0;
+		for(i = 0; i < 256; i++){
+			c = counts[b][i];
+			counts[b][i] = sum;
+			sum += c;
+		}
+		for(i = 0; i < n; i++)
+			tmp[counts[b][(items[i].key >> 8*b) & 0xFF]++] = items[i];
+		t = items;
+		items = tmp;
+		tmp = t;
+	}
+	return items;
+}
+
+void
+RenderQueue::flush(void)
+{
+	RenderQueueGlobals *g = PLUGINOFFSET(RenderQueueGlobals, engine, renderQueueOffset);
+	SortItem *sorted;
+	Entry *e, *prev, *next;
+	DataBlock *b, *nextBlock;
+	int32 i, n;
+
+	if(!g->open)
+		return;
+	// draw callbacks must not add to the queue
+	g->open = 0;
+	n = g->numEntries;
+	memset(&g->stats, 0, sizeof(g->stats));
+	g->stats.numEntries = n;
+	if(n > 0){
+		for(i = 0; i < n; i++){
+			g->items[i].key = g->entries[i].key;
+			g->items[i].index = i;
+			if(g->entries[i].key >> 63)
+				g->stats.numTranslucent++;
+		}
+		g->stats.numOpaque = n - g->stats.numTranslucent;
+		sorted = radixSort(g->items, g->items + g->maxEntries, n);
+
+		prev = nil;
+		for(i = 0; i < n; i++){
+			e = &g->entries[sorted[i].index];
+			next = i+1 < n ? &g->entries[sorted[i+1].index] : nil;
+			if(next && next->draw != e->draw)
+				next = nil;
+			e->draw(e, prev && prev->draw == e->draw ? prev : nil, next);
+			prev = e;
+		}
+	}
+	g->numEntries = 0;
+
+	// keep the data blocks for the next frame
+	for(b = g->blocks; b; b = nextBlock){
+		nextBlock = b->next;
+		if(b->size == DATABLOCKSIZE){
+			b->next = g->freeBlocks;
+			g->freeBlocks = b;
+		}else
+			rwFree(b);
+	}
+	g->blocks = nil;
+}
+
+RenderQueueStats*
+RenderQueue::getStats(void)
+{
+	return &RQGLOBAL(stats);
+}
+
+}
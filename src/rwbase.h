@@ -1,5 +1,6 @@
 #ifndef RW_PS2
 #include <stdint.h>
+#include <atomic>
 #endif
 #include <math.h>
 #ifndef M_PI
@@ -70,6 +71,15 @@ typedef int32 bool32;
 typedef uint8 byte;
 typedef uint32 uint;
 
+// for state that loader and job threads share or keep for themselves
+#ifdef RW_PS2
+typedef int32 AtomicInt32;
+#define THREADLOCAL
+#else
+typedef std::atomic<int32> AtomicInt32;
+#define THREADLOCAL thread_local
+#endif
+
 #ifndef nil
 #define nil NULL
 #endif
@@ -235,6 +245,9 @@ struct V3d
 		this->x = x; this->y = y; this->z = z; }
 	static void transformPoints(V3d *out, const V3d *in, int32 n, const Matrix *m);
 	static void transformVectors(V3d *out, const V3d *in, int32 n, const Matrix *m);
+	// scalar reference implementations
+	static void transformPointsRef(V3d *out, const V3d *in, int32 n, const Matrix *m);
+	static void transformVectorsRef(V3d *out, const V3d *in, int32 n, const Matrix *m);
 };
 
 inline V3d makeV3d(float32 x, float32 y, float32 z) { V3d v; v.x = x; v.y = y; v.z = z; return v; }
@@ -349,6 +362,10 @@ struct Matrix
 	void optimize(Tolerance *tolerance = nil);
 	void update(void) { flags &= ~(int(IDENTITY) | int(TYPEMASK)); }
 	static Matrix *mult(Matrix *dst, const Matrix *src1, const Matrix *src2);
+	// dst[i] = src1[i] * src2[i], dst may be the same array as src1 or src2
+	static void multBatch(Matrix *dst, const Matrix *src1, const Matrix *src2, int32 n);
+	// dst[i] = src[i] * mat, dst may be the same array as src
+	static void transformBatch(Matrix *dst, const Matrix *src, const Matrix *mat, int32 n);
 	static Matrix *invert(Matrix *dst, const Matrix *src);
 	static Matrix *transpose(Matrix *dst, const Matrix *src);
 	Matrix *rotate(const V3d *axis, float32 angle, CombineOp op = rw::COMBINEPOSTCONCAT);
@@ -361,6 +378,7 @@ struct Matrix
 
 	// helper functions. consider private
 	static void mult_(Matrix *dst, const Matrix *src1, const Matrix *src2);
+	static void multRef_(Matrix *dst, const Matrix *src1, const Matrix *src2);
 	static void invertOrthonormal(Matrix *dst, const Matrix *src);
 	static Matrix *invertGeneral(Matrix *dst, const Matrix *src);
 	static void makeRotation(Matrix *dst, const V3d *axis, float32 angle);
@@ -453,6 +471,14 @@ inline void memLittle16(void *data, uint32 size) { }
 #define ASSERTLITTLE
 #endif
 
+// Unaligned little-endian loads, e.g. for data from Stream::borrow
+inline uint32 memLoadLittle32(const void *data) {
+	const uint8 *b = (const uint8*)data;
+	return (uint32)b[0] | (uint32)b[1]<<8 | (uint32)b[2]<<16 | (uint32)b[3]<<24; }
+inline uint16 memLoadLittle16(const void *data) {
+	const uint8 *b = (const uint8*)data;
+	return (uint16)(b[0] | b[1]<<8); }
+
 /*
  * Streams
  */
@@ -463,12 +489,20 @@ class Stream
 {
 public:
 	virtual ~Stream(void) { close(); }
-	virtual void close(void) {}
+	// returns 0 if written data was lost
+	virtual bool32 close(void) { return 1; }
 	virtual uint32 write8(const void *data, uint32 length) = 0;
 	virtual uint32 read8(void *data, uint32 length) = 0;
 	virtual void seek(int32 offset, int32 whence = 1) = 0;
 	virtual uint32 tell(void) = 0;
 	virtual bool eof(void) = 0;
+	// Return a pointer to the next length bytes and skip over them.
+	// Only streams that have their data in memory can do this,
+	// all others return nil and the caller has to read normally.
+	// Data is not byte swapped.
+	virtual const uint8 *borrow(uint32) { return nil; }
+	// Whether we can go back and overwrite what was written
+	virtual bool seekable(void) { return false; }
 	uint32  write32(const void *data, uint32 length);
 	uint32  write16(const void *data, uint32 length);
 	uint32  read32(void *data, uint32 length);
@@ -496,14 +530,19 @@ public:
 	uint32 length;
 	uint32 capacity;
 	uint32 position;
+	bool32 growable;	// we own data and resize it when writing past the end
 
-	void close(void);
+	bool32 close(void);
 	uint32 write8(const void *data, uint32 length);
 	uint32 read8(void *data, uint32 length);
 	void seek(int32 offset, int32 whence = 1);
 	uint32 tell(void);
 	bool eof(void);
+	const uint8 *borrow(uint32 length);
+	bool seekable(void) { return true; }
 	StreamMemory *open(uint8 *data, uint32 length, uint32 capacity = 0);
+	StreamMemory *openGrowable(uint32 capacity = 0);
+	uint8 *detach(uint32 *length);
 	uint32 getLength(void);
 
 	enum {
@@ -511,18 +550,100 @@ public:
 	};
 };
 
+// Reads and writes go through a buffer of bufferSize bytes so
+// small reads and seeks inside the buffer don't reach the file functions.
+// A buffer size of 0 passes everything straight through.
 class StreamFile : public Stream
 {
 public:
 	void *file;
-	StreamFile(void) { file = nil; }
-	void close(void);
+	uint8 *buffer;
+	uint32 bufferSize;
+	uint32 bufStart;	// file offset of buffer[0]
+	uint32 bufLength;	// valid (or dirty) bytes in buffer
+	uint32 bufPos;	// current position in buffer
+	uint32 filePos;	// where the file pointer really is
+	bool32 dirty;	// buffer holds data not written yet
+	bool32 hitEof;
+	bool32 appending;
+	bool32 writeFailed;	// a write came up short, later ones are refused
+
+	static uint32 defaultBufferSize;
+	// calls into engine->filefuncs by all file streams
+	static uint32 numFileReads;
+	static uint32 numFileWrites;
+	static uint32 numFileSeeks;
+
+	StreamFile(void) { file = nil; buffer = nil; }
+	bool32 close(void);
+	uint32 write8(const void *data, uint32 length);
+	uint32 read8(void *data, uint32 length);
+	void seek(int32 offset, int32 whence = 1);
+	uint32 tell(void);
+	bool eof(void);
+	bool seekable(void) { return !this->appending; }
+	StreamFile *open(const char *path, const char *mode, uint32 bufferSize = defaultBufferSize);
+	bool32 flush(void);
+
+private:
+	void syncFilePos(uint32 pos);
+	uint32 fill(void);
+};
+
+// Read-only stream of a whole file mapped into memory.
+// Where mmap isn't available the file is read in one go
+// through the engine's file functions instead.
+class StreamMapped : public StreamMemory
+{
+public:
+	void *mapping;
+	uint32 mappedSize;
+	bool32 isMapped;
+	StreamMapped(void) { mapping = nil; }
+	bool32 close(void);
+	uint32 write8(const void *data, uint32 length);
+	StreamMapped *open(const char *path);
+};
+
+// Compresses everything written to it into zlib blocks on another stream
+// and decompresses them one at a time when reading.
+// Seeking is possible forward and a little way back.
+class StreamDeflate : public Stream
+{
+public:
+	Stream *base;
+	uint8 *window;	// uncompressed data of the current block
+	uint32 windowSize;
+	uint32 windowLength;
+	uint32 windowPos;
+	uint32 windowStart;	// uncompressed offset of window[0]
+	uint8 *zbuf;	// compressed data when base can't lend it to us
+	uint32 zbufSize;
+	uint32 blockSize;
+	bool32 writing;
+	bool32 hitEof;
+	bool32 noMoreBlocks;
+	bool32 writeFailed;
+
+	enum {
+		MAGIC = 0x315A5752,	// "RWZ1"
+		HISTORY = 64	// bytes of the last block kept for seeking back
+	};
+
+	StreamDeflate(void) { base = nil; }
+	bool32 close(void);
 	uint32 write8(const void *data, uint32 length);
 	uint32 read8(void *data, uint32 length);
 	void seek(int32 offset, int32 whence = 1);
 	uint32 tell(void);
 	bool eof(void);
-	StreamFile *open(const char *path, const char *mode);
+	StreamDeflate *open(Stream *base, bool32 write, uint32 blockSize = 64*1024);
+
+private:
+	bool32 readBlockHeader(uint32 *length, uint32 *zlength);
+	bool32 inflateBlock(uint32 length, uint32 zlength);
+	bool32 nextBlock(void);
+	bool32 deflateBlock(void);
 };
 
 enum Platform
@@ -561,7 +682,9 @@ enum VendorID
 	// Used for rasters (platform-specific)
 	VEND_RASTER         = 10,
 	// Used for driver/device allocation tags
-	VEND_DRIVER         = 11
+	VEND_DRIVER         = 11,
+	// librw's own stream chunks
+	VEND_LIBRW          = 12
 };
 
 // TODO: modules (VEND_CRITERIONINT)
@@ -608,6 +731,12 @@ enum PluginID
 	ID_NATIVEDATA    = MAKEPLUGINID(VEND_CRITERIONWORLD, 0x10),
 	ID_VERTEXFMT     = MAKEPLUGINID(VEND_CRITERIONWORLD, 0x11),
 
+	// librw
+	ID_TRIANGLES32   = MAKEPLUGINID(VEND_LIBRW, 0x00),
+	// not RW's LOD Atomic PLG (0x112), which stores geometry list indices
+	ID_LODATOMIC     = MAKEPLUGINID(VEND_LIBRW, 0x01),
+	ID_CHUNKINDEX    = MAKEPLUGINID(VEND_LIBRW, 0x02),
+
 	// custom native raster
 	ID_RASTERGL      = MAKEPLUGINID(VEND_RASTER, PLATFORM_GL),
 	ID_RASTERPS2     = MAKEPLUGINID(VEND_RASTER, PLATFORM_PS2),
@@ -631,7 +760,7 @@ enum CoreModuleID
 	// camera
 	ID_IMAGEMODULE   = MAKEPLUGINID(VEND_CRITERIONINT, 0x06),
 	ID_RASTERMODULE  = MAKEPLUGINID(VEND_CRITERIONINT, 0x07),
-	ID_TEXTUREMODULE = MAKEPLUGINID(VEND_CRITERIONINT, 0x08)
+	ID_TEXTUREMODULE = MAKEPLUGINID(VEND_CRITERIONINT, 0x08),
 	// pip
 	// immediate
 	// resources
@@ -642,6 +771,8 @@ enum CoreModuleID
 	// metrics
 	// driver
 	// chunk group
+	ID_ASYNCLOADMODULE = MAKEPLUGINID(VEND_CRITERIONINT, 0x13),
+	ID_RENDERQUEUEMODULE = MAKEPLUGINID(VEND_CRITERIONINT, 0x14)
 };
 
 #define ECODE(c, s) c
@@ -708,9 +839,44 @@ struct ChunkHeaderInfo
 
 // TODO?: make these methods of ChunkHeaderInfo?
 bool writeChunkHeader(Stream *s, int32 type, int32 size);
+int32 beginChunk(Stream *s, int32 type);
+void endChunk(Stream *s, int32 chunk);
 bool readChunkHeaderInfo(Stream *s, ChunkHeaderInfo *header);
 bool findChunk(Stream *s, uint32 type, uint32 *length, uint32 *version);
 
+// Index of all chunks in a stream for random access.
+// Offsets are relative to the position the index was built at.
+// When streamed, the index is meant to be written directly in front
+// of the data it indexes, so reading sets the base to just behind it.
+// The streamed layout is librw's own, not RW's Table of Contents (0x24).
+struct ChunkIndex
+{
+	enum { ANYPARENT = -2 };
+	struct Entry
+	{
+		uint32 type;
+		uint32 offset;	// of the chunk header
+		uint32 length;
+		uint32 version, build;
+		int32 parent;	// index of containing chunk, -1 at top level
+	};
+	uint32 base;
+	int32 numEntries;
+	int32 space;
+	Entry *entries;
+
+	static ChunkIndex *create(void);
+	void destroy(void);
+	bool32 build(Stream *s, uint32 length = 0xFFFFFFFF);
+	int32 find(uint32 type, int32 n = 0, int32 parent = ANYPARENT);
+	int32 count(uint32 type, int32 parent = ANYPARENT);
+	bool32 seek(Stream *s, int32 entry, uint32 *length = nil, uint32 *version = nil);
+	bool32 seek(Stream *s, uint32 type, int32 n, uint32 *length = nil, uint32 *version = nil);
+	static ChunkIndex *streamRead(Stream *stream);
+	void streamWrite(Stream *stream);
+	uint32 streamGetSize(void);
+};
+
 int32 findPointer(void *p, void **list, int32 num);
 uint8 *getFileContents(const char *name, uint32 *len);
 }
@@ -211,7 +211,7 @@ extern Engine *engine;
 #define RWTOSTR(X) RWTOSTR_(X)
 #define RWHERE "file: " __FILE__ " line: " RWTOSTR(__LINE__)
 
-extern const char *allocLocation;
+extern THREADLOCAL const char *allocLocation;
 
 inline void *malloc_LOC(size_t sz, uint32 hint, const char *here) { allocLocation = here; return rw::Engine::memfuncs.rwmalloc(sz,hint); }
 inline void *realloc_LOC(void *p, size_t sz, uint32 hint, const char *here) { allocLocation = here; return rw::Engine::memfuncs.rwrealloc(p,sz,hint); }
@@ -235,6 +235,96 @@ extern MemoryFunctions defaultMemfuncs;
 extern MemoryFunctions managedMemfuncs;
 void printleaks(void);	// when using managed mem funcs
 
+// Profiling of managed memory
+enum MemoryStatKind
+{
+	MEMSTAT_TOTAL,
+	MEMSTAT_DURATION,	// per MemHint
+	MEMSTAT_ID,		// per plugin/object ID in the hint
+	MEMSTAT_SITE		// per rwMalloc call site
+};
+struct MemoryStat
+{
+	uint32 hint;		// duration or ID
+	const char *site;	// call site for MEMSTAT_SITE
+	size_t current;		// bytes
+	size_t peak;
+	int32 numBlocks;
+	uint32 numAllocs;	// since Engine::init
+};
+struct MemoryRates
+{
+	uint32 allocsPerFrame;
+	size_t bytesPerFrame;
+	float allocsPerSecond;
+	float bytesPerSecond;
+};
+int32 getMemoryStats(int32 kind, MemoryStat *stats, int32 maxStats);
+void memoryProfileFrame(float timeStep);
+MemoryRates *getMemoryRates(MemoryRates *rates);
+void dumpMemoryStats(Stream *stream);
+
+// With arenaMemfuncs MEMDUR_FUNCTION memory inside a function scope
+// and MEMDUR_FRAME memory come from per-thread bump arenas.
+// Set the sizes before the first allocation.
+extern MemoryFunctions arenaMemfuncs;
+extern uint32 functionArenaSize;
+extern uint32 frameArenaSize;
+uint32 beginFunctionArena(void);
+void endFunctionArena(uint32 mark);
+void resetFrameArena(void);	// called by Raster::show, once per frame
+void getArenaPeaks(uint32 *function, uint32 *frame);
+
+// Allocator for objects of one size, e.g. a type with all its plugins.
+// Entries are carved out of blocks and never given back
+// to the heap before the list is destroyed.
+struct FreeList
+{
+	uint32 entrySize;
+	int32 entriesPerBlock;
+	uint32 alignment;
+	uint32 hint;
+	void *freeEntries;	// linked through their first word
+	void *blocks;
+	int32 numBlocks;
+	int32 numUsed;
+	void *mutex;
+
+	static FreeList *create(uint32 entrySize, int32 entriesPerBlock,
+	                        uint32 alignment, uint32 hint);
+	void destroy(void);
+	void *alloc(void);
+	void free(void *entry);
+	int32 allocBatch(void **entries, int32 n);
+	void freeBatch(void **entries, int32 n);
+};
+
+// Worker threads that help the calling thread with data parallel work.
+// Every thread has its own queue and steals from the others' when it runs dry.
+// Running jobs can split off more work with spawn(), which is best done
+// only when wanted() says some thread has nothing to do.
+// Without threads run() simply does all the work itself.
+struct JobSystem
+{
+	struct Job
+	{
+		void (*func)(Job *job);
+		void *data;
+		int32 begin;
+		int32 end;
+	};
+
+	static bool32 start(int32 numThreads);
+	static void stop(void);
+	static int32 numThreads(void);
+	// run the jobs and everything they spawn, returns when all are done.
+	// From inside a job or while another thread is in run()
+	// the calling thread does them all by itself.
+	static void run(Job *jobs, int32 numJobs);
+	static void spawn(Job *job);
+	static bool32 wanted(void);
+};
+
 namespace null {
 	void beginUpdate(Camera*);
 	void endUpdate(Camera*);
@@ -2,6 +2,9 @@
 
 namespace rw {
 
+struct FreeList;
+struct FrameHierarchy;
+
 struct Object
 {
 	uint8 type;
@@ -41,8 +44,9 @@ struct Frame
 		SUBTREESYNCOBJ   = 0x08,
 		SUBTREESYNC      = SUBTREESYNCLTM | SUBTREESYNCOBJ,
 		SYNCLTM          = HIERARCHYSYNCLTM | SUBTREESYNCLTM,
-		SYNCOBJ          = HIERARCHYSYNCOBJ | SUBTREESYNCOBJ
-		// STATIC = 0x10
+		SYNCOBJ          = HIERARCHYSYNCOBJ | SUBTREESYNCOBJ,
+		// The hierarchy is frozen, set on the root
+		STATIC           = 0x10
 	};
 
 	Object object;
@@ -54,8 +58,12 @@ struct Frame
 	Frame *child;
 	Frame *next;
 	Frame *root;
+	// set while the hierarchy is packed
+	FrameHierarchy *hierarchy;
+	int32 hierarchyIndex;
 
-	static int32 numAllocated;
+	static AtomicInt32 numAllocated;
+	static FreeList *s_freeList;
 
 	static Frame *create(void);
 	Frame *cloneHierarchy(void);
@@ -69,6 +77,8 @@ struct Frame
 	int32 count(void);
 	bool32 dirty(void) const {
 		return !!(this->root->object.privateFlags & HIERARCHYSYNC); }
+	bool32 isStatic(void) const {
+		return !!(this->root->object.privateFlags & STATIC); }
 	Matrix *getLTM(void);
 	void rotate(const V3d *axis, float32 angle, CombineOp op = rw::COMBINEPOSTCONCAT);
 	void translate(const V3d *trans, CombineOp op = rw::COMBINEPOSTCONCAT);
@@ -77,6 +87,13 @@ struct Frame
 	void updateObjects(void);
 
 
+	FrameHierarchy *pack(void);
+	void unpack(void);
+	// Frozen hierarchies are synched once and never go into the dirty list,
+	// updating one syncs it right away. Unfreeze to animate.
+	void freeze(void);
+	void unfreeze(void);
+
 	void syncHierarchyLTM(void);
 	void setHierarchyRoot(Frame *root);
 	Frame *cloneAndLink(void);
@@ -88,6 +105,22 @@ struct Frame
 	static void syncDirty(void);
 };
 
+/*
+ * A whole frame hierarchy in depth first order, parents before children.
+ * The LTMs live here while a hierarchy is packed, the local matrices are
+ * copied over by updateObjects. So sync is a linear pass over these arrays.
+ * Changing the hierarchy unpacks it again.
+ */
+struct FrameHierarchy
+{
+	int32 numFrames;
+	Frame **frames;
+	int32 *parents;		// -1 for the root
+	Matrix *matrices;
+	Matrix *ltms;
+	uint8 *flags;		// SUBTREESYNCLTM
+};
+
 struct FrameList_
 {
 	int32 numFrames;
@@ -101,6 +134,7 @@ Frame **makeFrameList(Frame *frame, Frame **flist);
 
 struct ObjectWithFrame
 {
+	// may be called on job threads, see Frame::syncDirty
 	typedef void (*Sync)(ObjectWithFrame*);
 
 	Object object;
@@ -132,7 +166,7 @@ struct Image
 	uint8 *pixels;
 	uint8 *palette;
 
-	static int32 numAllocated;
+	static AtomicInt32 numAllocated;
 
 	static Image *create(int32 width, int32 height, int32 depth);
 	void destroy(void);
@@ -242,7 +276,7 @@ struct Raster
 	Raster *parent;
 	int32 offsetX, offsetY;
 
-	static int32 numAllocated;
+	static AtomicInt32 numAllocated;
 
 	static Raster *create(int32 width, int32 height, int32 depth,
 	                      int32 format, int32 platform = 0);
@@ -374,7 +408,8 @@ struct Texture
 
 	LLLink inGlobalList;	// actually not in RW
 
-	static int32 numAllocated;
+	static AtomicInt32 numAllocated;
+	static FreeList *s_freeList;
 
 	static Texture *create(Raster *raster);
 	void addRef(void) { this->refCount++; }
@@ -433,7 +468,8 @@ struct Material
 	Pipeline *pipeline;
 	int32 refCount;
 
-	static int32 numAllocated;
+	static AtomicInt32 numAllocated;
+	static FreeList *s_freeList;
 
 	static Material *create(void);
 	void addRef(void) { this->refCount++; }
@@ -449,7 +485,10 @@ void registerMaterialRightsPlugin(void);
 
 struct Mesh
 {
-	uint16 *indices;
+	union {
+		uint16 *indices;
+		uint32 *indices32;	// if MeshHeader::index32 is set
+	};
 	uint32 numIndices;
 	Material *material;
 };
@@ -463,10 +502,15 @@ struct MeshHeader
 	uint16 numMeshes;
 	uint16 serialNum;
 	uint32 totalIndices;
-	uint32 pad;	// needed for alignment of Meshes
+	// Indices are uint32, for geometry with more than 0x10000 vertices.
+	// Not in RW, this used to be padding for alignment of Meshes.
+	bool32 index32;
 	// after this the meshes
 
 	Mesh *getMeshes(void) { return (Mesh*)(this+1); }
+	uint32 getIndex(Mesh *m, uint32 i) { return this->index32 ? m->indices32[i] : m->indices[i]; }
+	void setIndex(Mesh *m, uint32 i, uint32 idx) {
+		if(this->index32) m->indices32[i] = idx; else m->indices[i] = idx; }
 	void setupIndices(void);
 	uint32 guessNumTriangles(void);
 };
@@ -490,10 +534,19 @@ struct InstanceDataHeader
 
 struct Triangle
 {
-	uint16 v[3];
+	uint32 v[3];
 	uint16 matId;
 };
 
+// Post-transform vertex cache efficiency, measured with a FIFO cache
+struct VertexCacheStats
+{
+	float32 acmr;	// transformed vertices per triangle
+	float32 atvr;	// transformed vertices per referenced vertex
+	int32 numTriangles;
+	int32 numTransformed;
+};
+
 struct MaterialList
 {
 	Material **materials;
@@ -531,9 +584,17 @@ struct Geometry
 	MeshHeader *meshHeader;
 	InstanceDataHeader *instData;
 
+	// Pieces with 16 bit indices, instanced and rendered instead on
+	// platforms that can't draw 32 bit indices
+	Geometry **pieces;
+	int32 numPieces;
+
 	int32 refCount;
 
-	static int32 numAllocated;
+	static AtomicInt32 numAllocated;
+	// buildMeshes() on TRISTRIP geometry falls back to a
+	// triangle list when strips would use the vertex cache worse
+	static bool32 autoTristrip;
 
 	static Geometry *create(int32 numVerts, int32 numTris, uint32 flags);
 	void addRef(void) { this->refCount++; }
@@ -544,12 +605,27 @@ struct Geometry
 	void calculateBoundingSphere(void);
 	bool32 hasColoredMaterial(void);
 	void allocateData(void);
-	MeshHeader *allocateMeshes(int32 numMeshes, uint32 numIndices, bool32 noIndices);
+	MeshHeader *allocateMeshes(int32 numMeshes, uint32 numIndices, bool32 noIndices, bool32 index32 = 0);
+	bool32 needsIndex32(void) { return this->numVertices > 0x10000; }
 	void generateTriangles(int8 *adc = nil);
 	void buildMeshes(void);
 	void buildTristrips(void);	// private, used by buildMeshes
+	void pickTristripOrList(void);	// private, used by buildMeshes
 	void correctTristripWinding(void);
 	void removeUnusedMaterials(void);
+	void optimizeTriangleOrder(void);
+	void optimizeVertexOrder(void);
+	void optimizeVertexCache(VertexCacheStats *before = nil, VertexCacheStats *after = nil);
+	void getVertexCacheStats(VertexCacheStats *stats, int32 cacheSize = 16);
+	int32 splitIndex16(void);
+	// Plugins with per-vertex data copy it to the pieces of splitIndex16,
+	// vertex i of the piece is vertex verts[i] of geo
+	typedef void (*SplitCallback)(Geometry *piece, Geometry *geo, const int32 *verts, int32 numVerts);
+	static int32 setSplitCallback(uint32 id, SplitCallback cb);
+	// Quadric error edge collapse into a new geometry,
+	// e.g. for LODAtomic levels. maxError is a distance.
+	Geometry *simplify(int32 targetTriangles, float32 maxError);
+	void destroyPieces(void);
 	static Geometry *streamRead(Stream *stream);
 	bool streamWrite(Stream *stream);
 	uint32 streamGetSize(void);
@@ -603,6 +679,8 @@ void registerNativeDataPlugin(void);
 
 struct Clump;
 struct World;
+struct WorldSector;
+struct OcclusionBuffer;
 
 struct Atomic
 {
@@ -613,6 +691,7 @@ struct Atomic
 	// flags
 		COLLISIONTEST = 0x01,	// unused here
 		RENDER = 0x04,
+		OCCLUDER = 0x08,	// not in RW, see OcclusionBuffer
 	// private flags
 		WORLDBOUNDDIRTY = 0x01,
 	// for setGeometry
@@ -629,9 +708,12 @@ struct Atomic
 	RenderCB renderCB;
 
 	World *world;
+	WorldSector *sector;
+	LLLink inSector;
 	ObjectWithFrame::Sync originalSync;
 
-	static int32 numAllocated;
+	static AtomicInt32 numAllocated;
+	static FreeList *s_freeList;
 
 	static Atomic *create(void);
 	Atomic *clone(void);
@@ -682,9 +764,12 @@ struct Light
 
 	// world extension
 	World *world;
+	WorldSector *sector;	// local lights only
+	LLLink inSector;
 	ObjectWithFrame::Sync originalSync;
 
-	static int32 numAllocated;
+	static AtomicInt32 numAllocated;
+	static FreeList *s_freeList;
 
 	static Light *create(int32 type);
 	void destroy(void);
@@ -736,6 +821,8 @@ struct Camera
 	enum { CLEARIMAGE = 0x1, CLEARZ = 0x2, CLEARSTENCIL = 0x4 };
 	// return value of frustumTestSphere
 	enum { SPHEREOUTSIDE, SPHEREBOUNDARY, SPHEREINSIDE };
+	// return value of frustumTestBBox
+	enum { BOXOUTSIDE, BOXBOUNDARY, BOXINSIDE };
 
 	ObjectWithFrame object;
 	void (*beginUpdateCB)(Camera*);
@@ -772,7 +859,7 @@ struct Camera
 	void (*originalBeginUpdate)(Camera*);
 	void (*originalEndUpdate)(Camera*);
 
-	static int32 numAllocated;
+	static AtomicInt32 numAllocated;
 
 	static Camera *create(void);
 	Camera *clone(void);
@@ -791,6 +878,11 @@ struct Camera
 	void setViewOffset(const V2d *offset);
 	void setProjection(int32 proj);
 	int32 frustumTestSphere(const Sphere *s) const;
+	int32 frustumTestBBox(const BBox *box) const;
+	int32 frustumTestSpheres(const float32 *x, const float32 *y, const float32 *z,
+		const float32 *r, int32 n, int32 *visible) const;
+	int32 frustumTestSpheresRef(const float32 *x, const float32 *y, const float32 *z,
+		const float32 *r, int32 n, int32 *visible) const;
 	static Camera *streamRead(Stream *stream);
 	bool streamWrite(Stream *stream);
 	uint32 streamGetSize(void);
@@ -811,7 +903,7 @@ struct Clump
 	World *world;
 	LLLink inWorld;
 
-	static int32 numAllocated;
+	static AtomicInt32 numAllocated;
 
 	static Clump *create(void);
 	Clump *clone(void);
@@ -848,7 +940,31 @@ struct WorldLights
 	Light **locals;	// points, (soft)spots
 };
 
-// A bit of a stub right now
+// Node of the world's BSP tree. Atomics and local lights are kept in the
+// deepest sector their bounding sphere fits in, which is found again
+// whenever their frame is synched.
+struct WorldSector
+{
+	BBox box;	// everything in the sector is inside
+	int32 axis;	// children split here
+	float32 split;
+	LinkList atomics;
+	LinkList lights;
+	int32 numLights;	// in this sector and below
+};
+
+// What the last World::render did
+struct WorldRenderStats
+{
+	int32 numSectors;	// visited
+	int32 numSectorsCulled;
+	int32 numAtomics;	// in visible sectors
+	int32 numTested;	// spheres tested against the frustum
+	int32 numCulled;
+	int32 numOccluders;	// visible ones rasterized
+	int32 numOccluded;
+};
+
 struct World
 {
 	PLUGINBASE
@@ -857,10 +973,20 @@ struct World
 	LinkList localLights;	// these have positions (type >= 0x80)
 	LinkList globalLights;	// these do not (type < 0x80)
 	LinkList clumps;
-
-	static int32 numAllocated;
-
-	static World *create(BBox *bbox = nil);	// TODO: should probably make this non-optional
+	// Complete binary tree, the children of sector i are 2i+1 and 2i+2.
+	// Every sector is split in half along its longest axis,
+	// the boxes of the children overlap by half their size.
+	WorldSector *sectors;
+	int32 numSectors;
+	int32 numAtomics;
+	WorldRenderStats renderStats;
+	// if set, render() draws only atomics not hidden by visible OCCLUDERs
+	OcclusionBuffer *occlusion;
+
+	static AtomicInt32 numAllocated;
+
+	// Without a bounding box there is only one sector
+	static World *create(BBox *bbox = nil, int32 depth = 10);
 	void destroy(void);
 	void addLight(Light *light);
 	void removeLight(Light *light);
@@ -870,11 +996,146 @@ struct World
 	void removeAtomic(Atomic *atomic);
 	void addClump(Clump *clump);
 	void removeClump(Clump *clump);
+	WorldSector *findSector(const Sphere *sphere);
+	void updateSector(Atomic *atomic);
+	void updateSector(Light *light);
+	// renders the atomics the current camera can see,
+	// sorted by RenderQueue if it is enabled
 	void render(void);
 	void enumerateLights(Atomic *atomic, WorldLights *lightData);
 	void enumerateLights(WorldLights *lightData);
 };
 
+// What the OcclusionBuffer did since begin()
+struct OcclusionStats
+{
+	int32 numOccluders;
+	int32 numTriangles;	// rasterized after clipping
+	int32 numTested;
+	int32 numOccluded;
+};
+
+/*
+ * Software occlusion culling for perspective cameras.
+ * Occluder triangles are rasterized on the CPU into a small buffer
+ * that keeps the largest 1/z at every pixel center.
+ * Every TILESIZE*TILESIZE tile also keeps its smallest 1/z (farthest depth),
+ * so most tests of bounding volumes are decided by a few tiles.
+ * Everything is in the camera's view matrix space, where the screen
+ * is 0 < x/z < 1 and 0 < y/z < 1.
+ */
+struct OcclusionBuffer
+{
+	enum { TILESIZE = 8 };
+
+	int32 width, height;	// multiples of TILESIZE
+	int32 tilesX, tilesY;
+	float32 *depth;		// 1/z by rows, 0 is nothing
+	float32 *tileDepth;	// smallest 1/z of each tile, set by end()
+	Camera *camera;		// nil if occlusion is not possible
+	Matrix viewMatrix;
+	float32 nearPlane;
+	float32 scaleX, scaleY;	// view space x and y of a unit in world space
+	bool32 active;		// from end() to the next begin()
+	OcclusionStats stats;
+
+	static OcclusionBuffer *create(int32 width, int32 height);
+	void destroy(void);
+	// clears the buffer, is inactive for parallel cameras
+	void begin(Camera *cam);
+	// the triangles of the first morph target
+	void addOccluder(Atomic *atomic);
+	void addTriangles(const V3d *verts, int32 numVerts,
+		const uint16 *indices, int32 numTris, const Matrix *ltm);
+	void addTriangles(const V3d *verts, int32 numVerts,
+		const uint32 *indices, int32 numTris, const Matrix *ltm);
+	void end(void);
+	// world space, 1 unless fully behind occluders
+	bool32 isVisible(const Sphere *sphere);
+	bool32 isVisible(const BBox *box);
+
+	// Covers n pixels from row with a triangle,
+	// edge i of pixel j is e[i] + j*de[i] and covers it if >= 0,
+	// 1/z is w + j*dw
+	static void rasterizeRow(float32 *row, int32 n, const float32 *e,
+		const float32 *de, float32 w, float32 dw);
+	static void rasterizeRowRef(float32 *row, int32 n, const float32 *e,
+		const float32 *de, float32 w, float32 dw);
+};
+
+// What the last RenderQueue::flush did
+struct RenderQueueStats
+{
+	int32 numEntries;
+	int32 numOpaque;
+	int32 numTranslucent;
+	// state set by the draw callbacks and state that was already current
+	int32 changes[6];
+	int32 avoided[6];
+};
+
+/*
+ * Collects the mesh instances of all atomics rendered between begin()
+ * and flush() and draws them sorted by
+ *	opaque before translucent
+ *	opaque: pipeline, shader, texture raster, blend state, front to back
+ *	translucent: back to front, then the same as opaque
+ * so consecutive draws share as much state as possible.
+ * Render callbacks that support the queue add() their meshes with their own
+ * DrawCB while it is open, so all of them go through the same sort
+ * (the gl3 default, skin and matfx pipelines do).
+ * All others draw right away as usual, i.e. before everything that is queued.
+ */
+struct RenderQueue
+{
+	struct Entry;
+	// prev and next are the neighbours in draw order if they have the same
+	// callback, so it can tell which state is already set
+	// and when it has to clean up
+	typedef void (*DrawCB)(Entry *e, Entry *prev, Entry *next);
+	struct Entry
+	{
+		uint64 key;
+		DrawCB draw;
+		Atomic *atomic;
+		void *header;	// InstanceDataHeader
+		void *inst;	// InstanceData of the mesh
+		void *shader;
+		uint32 blend;	// as given to add()
+		void *data;	// from alloc()
+	};
+	enum State {
+		ATOMICSTATE,	// world matrix and lights
+		VERTEXSTATE,
+		SHADERSTATE,
+		TEXTURESTATE,
+		MATERIALSTATE,
+		BLENDSTATE,
+		NUMSTATES
+	};
+
+	static bool32 enabled;	// used by World::render
+
+#ifndef RWPUBLIC
+	static void registerModule(void);
+#endif
+	static bool32 begin(void);
+	static bool32 isOpen(void);
+	// makes room for num more entries
+	static bool32 reserve(int32 num);
+	// nil if the queue is not open or out of memory,
+	// never fails after reserve()
+	static Entry *add(DrawCB draw, void *pipeline, void *shader, void *raster,
+		uint32 blend, float32 depth, bool32 translucent);
+	// memory that lives until the end of flush()
+	static void *alloc(uint32 size);
+	// distance of the atomic's bounding sphere along the camera's view
+	static float32 getDepth(Atomic *atomic);
+	static void countState(int32 state, bool32 changed);
+	static void flush(void);
+	static RenderQueueStats *getStats(void);
+};
+
 struct TexDictionary
 {
 	PLUGINBASE
@@ -883,7 +1144,7 @@ struct TexDictionary
 	LinkList textures;
 	LLLink inGlobalList;
 
-	static int32 numAllocated;
+	static AtomicInt32 numAllocated;
 
 	static TexDictionary *create(void);
 	static TexDictionary *fromLink(LLLink *lnk){
@@ -902,4 +1163,57 @@ struct TexDictionary
 	static TexDictionary *getCurrent(void);
 };
 
+/*
+ * Reads clumps and texture dictionaries on worker threads.
+ * Workers parse the files and read pixel and vertex data into memory,
+ * only what touches global engine state or the device (texture lookup,
+ * dictionaries, raster and device buffer creation and upload,
+ * the frame dirty list) is handed back to the main thread,
+ * so poll() has to be called regularly, once per frame is fine.
+ * Each worker parses its own file, so more threads help as long as
+ * there are several requests in flight.
+ * While requests are in flight the memory functions have to be thread-safe
+ * (the default and managed ones are) and the main thread shouldn't stream in
+ * objects itself. Without threads, poll() loads one request synchronously.
+ */
+struct AsyncLoader
+{
+	enum Type {
+		CLUMP,
+		TEXDICTIONARY
+	};
+	enum State {
+		QUEUED,
+		LOADING,
+		DONE,
+		FAILED
+	};
+	struct Request
+	{
+		int32 type;
+		int32 state;
+		char *path;
+		Clump *clump;
+		TexDictionary *texDict;
+		void *userData;
+		Request *next;
+
+		// frees the request, not the loaded object
+		void destroy(void);
+	};
+
+	static bool32 start(int32 numThreads = 1);
+	static void stop(void);
+	static Request *requestClump(const char *path, void *userData = nil);
+	static Request *requestTexDictionary(const char *path, void *userData = nil);
+	// runs deferred main thread work and returns a finished request or nil
+	static Request *poll(void);
+	static int32 numPending(void);
+
+	static bool32 onLoaderThread(void);
+	// call func on the main thread and wait for it, or just call it
+	// if we're on the main thread already
+	static void *callMainThread(void *(*func)(void *data), void *data);
+};
+
 }
@@ -1,6 +1,7 @@
 namespace rw {
 
 struct Atomic;
+struct Geometry;
 
 class Pipeline
 {
@@ -37,6 +38,10 @@ public:
 };
 
 void findMinVertAndNumVertices(uint16 *indices, uint32 numIndices, uint32 *minVert, int32 *numVertices);
+void findMinVertAndNumVertices(uint32 *indices, uint32 numIndices, uint32 *minVert, int32 *numVertices);
+// For instance code that only handles 16 bit indices.
+// Geometry with 32 bit indices is instanced as Geometry::splitIndex16 pieces.
+bool32 checkIndex16(Geometry *geo);
 
 // everything xbox, d3d8 and d3d9 may want to use
 enum {
@@ -12,15 +12,27 @@ typedef int32 (*StreamGetSize)(void *object, int32 offset, int32 size);
 typedef void (*RightsCallback)(void *object, int32 offset, int32 size, uint32 data);
 typedef void (*AlwaysCallback)(void *object, int32 offset, int32 size);
 
+struct Plugin;
+
 struct PluginList
 {
 	int32 size;
 	int32 defaultSize;
 	LinkList plugins;
 
+	// Flat arrays compiled from the list the first time it's used
+	// after plugins changed, so we don't walk the list for every object.
+	Plugin **table;		// all plugins in list order
+	Plugin **byId;		// all plugins sorted by ID
+	Plugin **streamTable;	// plugins that write data
+	Plugin **alwaysTable;	// plugins with always callbacks
+	int32 numPlugins;
+	int32 numStream;
+	int32 numAlways;
+
 	PluginList(void) {}
 	PluginList(int32 defSize)
-	 : size(defSize), defaultSize(defSize)
+	 : size(defSize), defaultSize(defSize), table(nil)
 	{ plugins.init(); }
 
 	static void open(void);
@@ -41,6 +53,10 @@ struct PluginList
 	int32 setStreamRightsCallback(uint32 id, RightsCallback cb);
 	int32 setStreamAlwaysCallback(uint32 id, AlwaysCallback cb);
 	int32 getPluginOffset(uint32 id);
+
+	void compile(void);
+	void invalidate(void);
+	Plugin *find(uint32 id);
 };
 
 struct Plugin
@@ -80,6 +80,43 @@ extern bool32 hAnimDoStream;
 void registerHAnimPlugin(void);
 
 
+/*
+ * LOD Atomic
+ */
+
+// Levels are picked per frame from the distance to the camera or from
+// the projected size. Every level keeps its own instance data, switching
+// only swaps the atomic's geometry.
+struct LODAtomic
+{
+	enum { MAXLEVELS = 10 };
+	enum Metric {
+		DISTANCE = 0,	// level i is used up to ranges[i]
+		SCREENSIZE	// level i is used down to ranges[i] (fraction of screen height)
+	};
+
+	Geometry *geometries[MAXLEVELS];
+	float32 ranges[MAXLEVELS];
+	int32 numLevels;
+	int32 current;
+	int32 metric;
+	Atomic::RenderCB renderCB;	// the hooked callback, nil if not hooked
+
+	static LODAtomic *get(const Atomic *atomic);
+	static bool32 setLevel(Atomic *atomic, int32 level, Geometry *geo, float32 range);
+	static Geometry *getGeometry(const Atomic *atomic, int32 level);
+	static void setMetric(Atomic *atomic, int32 metric);
+	static int32 getCurrentLevel(const Atomic *atomic);
+	static void setCurrentLevel(Atomic *atomic, int32 level);
+	static int32 selectLevel(Atomic *atomic, Camera *cam);
+	static void hookRender(Atomic *atomic);
+	static void unhookRender(Atomic *atomic);
+};
+
+extern int32 lodAtomicOffset;
+void registerLODAtomicPlugin(void);
+
+
 /*
  * MatFX
  */
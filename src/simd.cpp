@@ -0,0 +1,417 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "rwbase.h"
+#include "rwerror.h"
+#include "rwplg.h"
+#include "rwpipeline.h"
+#include "rwobjects.h"
+#include "rwengine.h"
+
+#ifndef RW_NO_SIMD
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RW_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define RW_NEON
+#include <arm_neon.h>
+#endif
+#endif
+
+#define PLUGIN_ID 0
+
+namespace rw {
+
+/*
+ * Vector versions of the matrix and vector math in base.cpp.
+ * The operations are done in the same order as in the scalar code,
+ * so results are the same bit for bit.
+ * The fourth column of a Matrix holds flags and padding, which
+ * are masked out of the calculation and left alone in the result.
+ */
+
+#ifdef RW_SSE2
+
+#define SPLAT(v, i) _mm_shuffle_ps(v, v, _MM_SHUFFLE(i,i,i,i))
+
+static const union { uint32 u[4]; __m128 v; } xyzMask = { { ~0u, ~0u, ~0u, 0 } };
+
+static inline __m128
+multRow(__m128 a, __m128 r, __m128 u, __m128 t)
+{
+	return _mm_add_ps(_mm_add_ps(_mm_mul_ps(SPLAT(a, 0), r),
+	                             _mm_mul_ps(SPLAT(a, 1), u)),
+	                  _mm_mul_ps(SPLAT(a, 2), t));
+}
+
+static inline void
+storeRow(float32 *dst, __m128 v, __m128 mask)
+{
+	_mm_storeu_ps(dst, _mm_or_ps(_mm_and_ps(v, mask),
+	                             _mm_andnot_ps(mask, _mm_loadu_ps(dst))));
+}
+
+static inline void
+multSIMD(Matrix *dst, const Matrix *src1, const Matrix *src2)
+{
+	__m128 mask = xyzMask.v;
+	// fourth column may not even be a valid float
+	__m128 r = _mm_and_ps(_mm_loadu_ps(&src2->right.x), mask);
+	__m128 u = _mm_and_ps(_mm_loadu_ps(&src2->up.x), mask);
+	__m128 t = _mm_and_ps(_mm_loadu_ps(&src2->at.x), mask);
+	__m128 p = _mm_and_ps(_mm_loadu_ps(&src2->pos.x), mask);
+	__m128 d0 = multRow(_mm_loadu_ps(&src1->right.x), r, u, t);
+	__m128 d1 = multRow(_mm_loadu_ps(&src1->up.x), r, u, t);
+	__m128 d2 = multRow(_mm_loadu_ps(&src1->at.x), r, u, t);
+	__m128 d3 = _mm_add_ps(multRow(_mm_loadu_ps(&src1->pos.x), r, u, t), p);
+	storeRow(&dst->right.x, d0, mask);
+	storeRow(&dst->up.x, d1, mask);
+	storeRow(&dst->at.x, d2, mask);
+	storeRow(&dst->pos.x, d3, mask);
+}
+
+// 4 packed V3ds in three registers to xxxx yyyy zzzz and back
+static inline void
+loadV3d4(const V3d *in, __m128 *x, __m128 *y, __m128 *z)
+{
+	const float32 *f = &in->x;
+	__m128 v0 = _mm_loadu_ps(f);
+	__m128 v1 = _mm_loadu_ps(f+4);
+	__m128 v2 = _mm_loadu_ps(f+8);
+	__m128 t = _mm_shuffle_ps(v1, v2, _MM_SHUFFLE(2,1,3,2));	// x2 y2 x3 y3
+	__m128 s = _mm_shuffle_ps(v0, _mm_shuffle_ps(v0, v1, _MM_SHUFFLE(0,0,3,3)),
+	                          _MM_SHUFFLE(2,0,1,0));		// x0 y0 x1 y1
+	__m128 w = _mm_shuffle_ps(v0, v1, _MM_SHUFFLE(1,1,2,2));	// z0 z0 z1 z1
+	*x = _mm_shuffle_ps(s, t, _MM_SHUFFLE(2,0,2,0));
+	*y = _mm_shuffle_ps(s, t, _MM_SHUFFLE(3,1,3,1));
+	*z = _mm_shuffle_ps(w, v2, _MM_SHUFFLE(3,0,2,0));
+}
+
+static inline void
+storeV3d4(V3d *out, __m128 x, __m128 y, __m128 z)
+{
+	float32 *f = &out->x;
+	__m128 v0 = _mm_shuffle_ps(_mm_shuffle_ps(x, y, _MM_SHUFFLE(0,0,0,0)),
+	                           _mm_shuffle_ps(z, x, _MM_SHUFFLE(1,1,0,0)),
+	                           _MM_SHUFFLE(2,0,2,0));
+	__m128 v1 = _mm_shuffle_ps(_mm_shuffle_ps(y, z, _MM_SHUFFLE(1,1,1,1)),
+	                           _mm_shuffle_ps(x, y, _MM_SHUFFLE(2,2,2,2)),
+	                           _MM_SHUFFLE(2,0,2,0));
+	__m128 v2 = _mm_shuffle_ps(_mm_shuffle_ps(z, x, _MM_SHUFFLE(3,3,2,2)),
+	                           _mm_shuffle_ps(y, z, _MM_SHUFFLE(3,3,3,3)),
+	                           _MM_SHUFFLE(2,0,2,0));
+	_mm_storeu_ps(f, v0);
+	_mm_storeu_ps(f+4, v1);
+	_mm_storeu_ps(f+8, v2);
+}
+
+#define VEC __m128
+#define VSPLAT(f) _mm_set1_ps(f)
+#define VADD(a, b) _mm_add_ps(a, b)
+#define VMUL(a, b) _mm_mul_ps(a, b)
+#define LOADV3D4(in, x, y, z) loadV3d4(in, &x, &y, &z)
+#define STOREV3D4(out, x, y, z) storeV3d4(out, x, y, z)
+#define VLOAD(p) _mm_loadu_ps(p)
+#define VSUB(a, b) _mm_sub_ps(a, b)
+#define MASK __m128
+#define MZERO _mm_setzero_ps()
+#define MGT(a, b) _mm_cmpgt_ps(a, b)
+#define MOR(a, b) _mm_or_ps(a, b)
+#define MBITS(m) _mm_movemask_ps(m)
+#define VSTORE(p, v) _mm_storeu_ps(p, v)
+#define VMAX(a, b) _mm_max_ps(a, b)
+#define VSET4(a, b, c, d) _mm_setr_ps(a, b, c, d)
+#define MGE(a, b) _mm_cmpge_ps(a, b)
+#define MAND(a, b) _mm_and_ps(a, b)
+#define VSELECT(m, a, b) _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b))
+
+#endif
+
+#ifdef RW_NEON
+
+static inline float32x4_t
+multRow(const V3d &a, float32x4_t r, float32x4_t u, float32x4_t t)
+{
+	// no vmla, that may be fused and round differently
+	return vaddq_f32(vaddq_f32(vmulq_n_f32(r, a.x),
+	                           vmulq_n_f32(u, a.y)),
+	                 vmulq_n_f32(t, a.z));
+}
+
+static inline void
+multSIMD(Matrix *dst, const Matrix *src1, const Matrix *src2)
+{
+	float32x4_t r = vsetq_lane_f32(0.0f, vld1q_f32(&src2->right.x), 3);
+	float32x4_t u = vsetq_lane_f32(0.0f, vld1q_f32(&src2->up.x), 3);
+	float32x4_t t = vsetq_lane_f32(0.0f, vld1q_f32(&src2->at.x), 3);
+	float32x4_t p = vsetq_lane_f32(0.0f, vld1q_f32(&src2->pos.x), 3);
+	float32x4_t d0 = multRow(src1->right, r, u, t);
+	float32x4_t d1 = multRow(src1->up, r, u, t);
+	float32x4_t d2 = multRow(src1->at, r, u, t);
+	float32x4_t d3 = vaddq_f32(multRow(src1->pos, r, u, t), p);
+	uint32 flags = dst->flags;
+	uint32 pad1 = dst->pad1;
+	uint32 pad2 = dst->pad2;
+	uint32 pad3 = dst->pad3;
+	vst1q_f32(&dst->right.x, d0);
+	vst1q_f32(&dst->up.x, d1);
+	vst1q_f32(&dst->at.x, d2);
+	vst1q_f32(&dst->pos.x, d3);
+	dst->flags = flags;
+	dst->pad1 = pad1;
+	dst->pad2 = pad2;
+	dst->pad3 = pad3;
+}
+
+#define VEC float32x4_t
+#define VSPLAT(f) vdupq_n_f32(f)
+#define VADD(a, b) vaddq_f32(a, b)
+#define VMUL(a, b) vmulq_f32(a, b)
+#define LOADV3D4(in, x, y, z) do{ float32x4x3_t v = vld3q_f32(&(in)->x); \
+	x = v.val[0]; y = v.val[1]; z = v.val[2]; }while(0)
+#define STOREV3D4(out, x, y, z) do{ float32x4x3_t v; \
+	v.val[0] = x; v.val[1] = y; v.val[2] = z; vst3q_f32(&(out)->x, v); }while(0)
+#define VLOAD(p) vld1q_f32(p)
+#define VSUB(a, b) vsubq_f32(a, b)
+#define MASK uint32x4_t
+#define MZERO vdupq_n_u32(0)
+#define MGT(a, b) vcgtq_f32(a, b)
+#define MOR(a, b) vorrq_u32(a, b)
+#define MBITS(m) maskBits(m)
+#define VSTORE(p, v) vst1q_f32(p, v)
+#define VMAX(a, b) vmaxq_f32(a, b)
+#define VSET4(a, b, c, d) set4(a, b, c, d)
+#define MGE(a, b) vcgeq_f32(a, b)
+#define MAND(a, b) vandq_u32(a, b)
+#define VSELECT(m, a, b) vbslq_f32(m, a, b)
+
+static inline float32x4_t
+set4(float32 a, float32 b, float32 c, float32 d)
+{
+	float32 f[4] = { a, b, c, d };
+	return vld1q_f32(f);
+}
+
+static inline int32
+maskBits(uint32x4_t m)
+{
+	static const uint32 bits[4] = { 1, 2, 4, 8 };
+	uint32x4_t b = vandq_u32(m, vld1q_u32(bits));
+	uint32x2_t s = vorr_u32(vget_low_u32(b), vget_high_u32(b));
+	return vget_lane_u32(s, 0) | vget_lane_u32(s, 1);
+}
+
+#endif
+
+#ifdef VEC
+
+void
+Matrix::mult_(Matrix *dst, const Matrix *src1, const Matrix *src2)
+{
+	multSIMD(dst, src1, src2);
+}
+
+void
+V3d::transformPoints(V3d *out, const V3d *in, int32 n, const Matrix *m)
+{
+	int32 i;
+	VEC x, y, z, ox, oy, oz;
+	VEC rx = VSPLAT(m->right.x), ry = VSPLAT(m->right.y), rz = VSPLAT(m->right.z);
+	VEC ux = VSPLAT(m->up.x), uy = VSPLAT(m->up.y), uz = VSPLAT(m->up.z);
+	VEC ax = VSPLAT(m->at.x), ay = VSPLAT(m->at.y), az = VSPLAT(m->at.z);
+	VEC px = VSPLAT(m->pos.x), py = VSPLAT(m->pos.y), pz = VSPLAT(m->pos.z);
+	for(i = 0; i+4 <= n; i += 4){
+		LOADV3D4(&in[i], x, y, z);
+		ox = VADD(VADD(VADD(VMUL(x, rx), VMUL(y, ux)), VMUL(z, ax)), px);
+		oy = VADD(VADD(VADD(VMUL(x, ry), VMUL(y, uy)), VMUL(z, ay)), py);
+		oz = VADD(VADD(VADD(VMUL(x, rz), VMUL(y, uz)), VMUL(z, az)), pz);
+		STOREV3D4(&out[i], ox, oy, oz);
+	}
+	transformPointsRef(&out[i], &in[i], n-i, m);
+}
+
+void
+V3d::transformVectors(V3d *out, const V3d *in, int32 n, const Matrix *m)
+{
+	int32 i;
+	VEC x, y, z, ox, oy, oz;
+	VEC rx = VSPLAT(m->right.x), ry = VSPLAT(m->right.y), rz = VSPLAT(m->right.z);
+	VEC ux = VSPLAT(m->up.x), uy = VSPLAT(m->up.y), uz = VSPLAT(m->up.z);
+	VEC ax = VSPLAT(m->at.x), ay = VSPLAT(m->at.y), az = VSPLAT(m->at.z);
+	for(i = 0; i+4 <= n; i += 4){
+		LOADV3D4(&in[i], x, y, z);
+		ox = VADD(VADD(VMUL(x, rx), VMUL(y, ux)), VMUL(z, ax));
+		oy = VADD(VADD(VMUL(x, ry), VMUL(y, uy)), VMUL(z, ay));
+		oz = VADD(VADD(VMUL(x, rz), VMUL(y, uz)), VMUL(z, az));
+		STOREV3D4(&out[i], ox, oy, oz);
+	}
+	transformVectorsRef(&out[i], &in[i], n-i, m);
+}
+
+// Four spheres against all six planes at once
+int32
+Camera::frustumTestSpheres(const float32 *x, const float32 *y, const float32 *z,
+                           const float32 *r, int32 n, int32 *visible) const
+{
+	int32 i, j, bits, numVisible;
+	VEC vx, vy, vz, vr, dist;
+	MASK outside;
+	const FrustumPlane *p;
+	numVisible = 0;
+	for(i = 0; i+4 <= n; i += 4){
+		vx = VLOAD(&x[i]);
+		vy = VLOAD(&y[i]);
+		vz = VLOAD(&z[i]);
+		vr = VLOAD(&r[i]);
+		outside = MZERO;
+		p = this->frustumPlanes;
+		for(j = 0; j < 6; j++, p++){
+			dist = VSUB(VADD(VADD(VMUL(VSPLAT(p->plane.normal.x), vx),
+			                      VMUL(VSPLAT(p->plane.normal.y), vy)),
+			                 VMUL(VSPLAT(p->plane.normal.z), vz)),
+			            VSPLAT(p->plane.distance));
+			outside = MOR(outside, MGT(dist, vr));
+		}
+		bits = MBITS(outside);
+		for(j = 0; j < 4; j++)
+			if((bits & (1<<j)) == 0)
+				visible[numVisible++] = i+j;
+	}
+	// rest one by one
+	j = numVisible;
+	numVisible += frustumTestSpheresRef(&x[i], &y[i], &z[i], &r[i], n-i, &visible[j]);
+	for(; j < numVisible; j++)
+		visible[j] += i;
+	return numVisible;
+}
+
+// Four pixels at a time, the rest like the reference
+void
+OcclusionBuffer::rasterizeRow(float32 *row, int32 n, const float32 *e,
+	const float32 *de, float32 w, float32 dw)
+{
+	int32 j;
+	float32 fj, z;
+	VEC vj, four, zero, old;
+	MASK inside;
+	VEC e0 = VSPLAT(e[0]), e1 = VSPLAT(e[1]), e2 = VSPLAT(e[2]);
+	VEC de0 = VSPLAT(de[0]), de1 = VSPLAT(de[1]), de2 = VSPLAT(de[2]);
+	VEC vw = VSPLAT(w), vdw = VSPLAT(dw);
+	vj = VSET4(0.0f, 1.0f, 2.0f, 3.0f);
+	four = VSPLAT(4.0f);
+	zero = VSPLAT(0.0f);
+	for(j = 0; j+4 <= n; j += 4){
+		inside = MAND(MAND(MGE(VADD(e0, VMUL(vj, de0)), zero),
+		                   MGE(VADD(e1, VMUL(vj, de1)), zero)),
+		              MGE(VADD(e2, VMUL(vj, de2)), zero));
+		if(MBITS(inside)){
+			old = VLOAD(&row[j]);
+			VSTORE(&row[j], VSELECT(inside, VMAX(VADD(vw, VMUL(vj, vdw)), old), old));
+		}
+		vj = VADD(vj, four);
+	}
+	for(; j < n; j++){
+		fj = (float32)j;
+		if(e[0] + fj*de[0] >= 0.0f &&
+		   e[1] + fj*de[1] >= 0.0f &&
+		   e[2] + fj*de[2] >= 0.0f){
+			z = w + fj*dw;
+			if(z > row[j])
+				row[j] = z;
+		}
+	}
+}
+
+#else
+
+void
+OcclusionBuffer::rasterizeRow(float32 *row, int32 n, const float32 *e,
+	const float32 *de, float32 w, float32 dw)
+{
+	rasterizeRowRef(row, n, e, de, w, dw);
+}
+
+int32
+Camera::frustumTestSpheres(const float32 *x, const float32 *y, const float32 *z,
+                           const float32 *r, int32 n, int32 *visible) const
+{
+	return frustumTestSpheresRef(x, y, z, r, n, visible);
+}
+
+void
+Matrix::mult_(Matrix *dst, const Matrix *src1, const Matrix *src2)
+{
+	multRef_(dst, src1, src2);
+}
+
+void
+V3d::transformPoints(V3d *out, const V3d *in, int32 n, const Matrix *m)
+{
+	transformPointsRef(out, in, n, m);
+}
+
+void
+V3d::transformVectors(V3d *out, const V3d *in, int32 n, const Matrix *m)
+{
+	transformVectorsRef(out, in, n, m);
+}
+
+#endif
+
+// The scalar mult_ writes dst before it has read all of src1 and src2
+static inline void
+multAliased(Matrix *dst, const Matrix *src1, const Matrix *src2)
+{
+	Matrix tmp;
+	if(dst == src1 || dst == src2){
+		tmp = *dst;
+		Matrix::mult_(&tmp, src1, src2);
+		*dst = tmp;
+	}else
+		Matrix::mult_(dst, src1, src2);
+}
+
+// Same as Matrix::mult on each pair, but without the call overhead
+void
+Matrix::multBatch(Matrix *dst, const Matrix *src1, const Matrix *src2, int32 n)
+{
+	int32 i;
+	uint32 flags;
+	for(i = 0; i < n; i++){
+		if(src1[i].flags & IDENTITY)
+			dst[i] = src2[i];
+		else if(src2[i].flags & IDENTITY)
+			dst[i] = src1[i];
+		else{
+			flags = src1[i].flags & src2[i].flags;
+			multAliased(&dst[i], &src1[i], &src2[i]);
+			dst[i].flags = flags;
+		}
+	}
+}
+
+void
+Matrix::transformBatch(Matrix *dst, const Matrix *src, const Matrix *mat, int32 n)
+{
+	int32 i;
+	Matrix m;
+	if(mat->flags & IDENTITY){
+		if(dst != src)
+			memmove(dst, src, n*sizeof(Matrix));
+		return;
+	}
+	// dst might overlap mat
+	m = *mat;
+	for(i = 0; i < n; i++){
+		if(src[i].flags & IDENTITY)
+			dst[i] = m;
+		else{
+			multAliased(&dst[i], &src[i], &m);
+			dst[i].flags = src[i].flags & m.flags;
+		}
+	}
+}
+
+}
@@ -0,0 +1,776 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "rwbase.h"
+#include "rwerror.h"
+#include "rwplg.h"
+#include "rwpipeline.h"
+#include "rwobjects.h"
+#include "rwengine.h"
+#include "rwanim.h"
+#include "rwplugins.h"
+
+#define PLUGIN_ID ID_GEOMETRY
+
+namespace rw {
+
+/*
+ * Quadric error simplification after Garland and Heckbert's
+ * "Surface Simplification Using Quadric Error Metrics".
+ * Edges are collapsed into one of their vertices, so the vertices that
+ * remain keep all their attributes and nothing has to be interpolated.
+ *
+ * Vertices that share their position with another one (UV, color or normal
+ * seams) are locked. Vertices on open or material borders only move along
+ * the border and corners are locked. Differences in prelit color, tex coords
+ * and skin weights add to the error of a collapse, vertices that are
+ * influenced by different bones are never merged.
+ */
+
+#define BORDERWEIGHT 10.0f
+#define MINCOSINE 0.25f	// of the angle a triangle may turn in a collapse
+#define MINQUALITY 0.1f	// below this collapses may only improve a triangle
+
+enum {
+	VERT_MANIFOLD,
+	VERT_BORDER,
+	VERT_LOCKED
+};
+
+// Sum of squared distances to planes, weighted by triangle area
+struct Quadric
+{
+	float32 a00, a01, a02, a11, a12, a22;
+	float32 b0, b1, b2;
+	float32 c;
+	float32 w;
+};
+
+struct EdgeCollapse
+{
+	int32 from, to;
+	float32 error;
+};
+
+struct SimplifyVertex
+{
+	int32 start;	// into the adjacency list
+	int32 numTris;
+	int32 border[2];	// neighbours along the border
+	int32 numBorder;
+	uint8 kind;
+	int32 touched;	// pass that last changed this vertex
+};
+
+struct Simplifier
+{
+	Geometry *geo;
+	Skin *skin;
+	V3d *pos;
+	int32 numVertices;
+	Triangle *tris;
+	int32 numTris;
+	Quadric *quadrics;
+	SimplifyVertex *verts;
+	int32 *adj;	// triangles around each vertex
+	EdgeCollapse *collapses;
+};
+
+static void
+quadricFromPlane(Quadric *q, const V3d &n, float32 d, float32 w)
+{
+	q->a00 = w*n.x*n.x;
+	q->a01 = w*n.x*n.y;
+	q->a02 = w*n.x*n.z;
+	q->a11 = w*n.y*n.y;
+	q->a12 = w*n.y*n.z;
+	q->a22 = w*n.z*n.z;
+	q->b0 = w*n.x*d;
+	q->b1 = w*n.y*d;
+	q->b2 = w*n.z*d;
+	q->c = w*d*d;
+	q->w = w;
+}
+
+static void
+quadricAdd(Quadric *q, const Quadric *r)
+{
+	q->a00 += r->a00;
+	q->a01 += r->a01;
+	q->a02 += r->a02;
+	q->a11 += r->a11;
+	q->a12 += r->a12;
+	q->a22 += r->a22;
+	q->b0 += r->b0;
+	q->b1 += r->b1;
+	q->b2 += r->b2;
+	q->c += r->c;
+	q->w += r->w;
+}
+
+// mean squared distance of p to the planes
+static float32
+quadricError(const Quadric *q, const V3d &p)
+{
+	float32 e;
+	if(q->w <= 0.0f)
+		return 0.0f;
+	e = q->a00*p.x*p.x + q->a11*p.y*p.y + q->a22*p.z*p.z +
+	    2.0f*(q->a01*p.x*p.y + q->a02*p.x*p.z + q->a12*p.y*p.z) +
+	    2.0f*(q->b0*p.x + q->b1*p.y + q->b2*p.z) + q->c;
+	return fabsf(e)/q->w;
+}
+
+static bool32
+hasEdge(Triangle *t, uint32 a, uint32 b)
+{
+	return (t->v[0] == a && t->v[1] == b) ||
+	       (t->v[1] == a && t->v[2] == b) ||
+	       (t->v[2] == a && t->v[0] == b);
+}
+
+static bool32
+hasVertex(Triangle *t, uint32 v)
+{
+	return t->v[0] == v || t->v[1] == v || t->v[2] == v;
+}
+
+static void
+buildAdjacency(Simplifier *s)
+{
+	SimplifyVertex *v;
+	int32 i, j, off;
+
+	for(i = 0; i < s->numVertices; i++)
+		s->verts[i].numTris = 0;
+	for(i = 0; i < s->numTris; i++)
+		for(j = 0; j < 3; j++)
+			s->verts[s->tris[i].v[j]].numTris++;
+	off = 0;
+	for(i = 0; i < s->numVertices; i++){
+		v = &s->verts[i];
+		v->start = off;
+		off += v->numTris;
+		v->numTris = 0;
+	}
+	for(i = 0; i < s->numTris; i++)
+		for(j = 0; j < 3; j++){
+			v = &s->verts[s->tris[i].v[j]];
+			s->adj[v->start + v->numTris++] = i;
+		}
+}
+
+static void
+addBorderNeighbour(SimplifyVertex *v, int32 n)
+{
+	if(v->numBorder > 2 ||
+	   (v->numBorder > 0 && v->border[0] == n) ||
+	   (v->numBorder > 1 && v->border[1] == n))
+		return;
+	if(v->numBorder < 2)
+		v->border[v->numBorder] = n;
+	v->numBorder++;
+}
+
+struct PositionKey
+{
+	float32 x, y, z;
+	int32 i;
+};
+
+static int
+cmpPositions(const void *a, const void *b)
+{
+	const PositionKey *ka = (const PositionKey*)a;
+	const PositionKey *kb = (const PositionKey*)b;
+	if(ka->x != kb->x) return ka->x < kb->x ? -1 : 1;
+	if(ka->y != kb->y) return ka->y < kb->y ? -1 : 1;
+	if(ka->z != kb->z) return ka->z < kb->z ? -1 : 1;
+	return 0;
+}
+
+static bool32
+classifyVertices(Simplifier *s)
+{
+	PositionKey *keys;
+	SimplifyVertex *va, *vb;
+	Triangle *t, *o;
+	int32 i, j, k, same, opposite;
+	uint32 a, b;
+
+	for(i = 0; i < s->numVertices; i++){
+		s->verts[i].numBorder = 0;
+		s->verts[i].kind = VERT_MANIFOLD;
+		s->verts[i].touched = -1;
+	}
+
+	// seams
+	keys = rwNewT(PositionKey, s->numVertices, MEMDUR_FUNCTION | ID_GEOMETRY);
+	if(keys == nil){
+		RWERROR((ERR_ALLOC, s->numVertices*sizeof(PositionKey)));
+		return 0;
+	}
+	for(i = 0; i < s->numVertices; i++){
+		keys[i].x = s->pos[i].x;
+		keys[i].y = s->pos[i].y;
+		keys[i].z = s->pos[i].z;
+		keys[i].i = i;
+	}
+	qsort(keys, s->numVertices, sizeof(PositionKey), cmpPositions);
+	for(i = 1; i < s->numVertices; i++)
+		if(cmpPositions(&keys[i-1], &keys[i]) == 0){
+			s->verts[keys[i-1].i].kind = VERT_LOCKED;
+			s->verts[keys[i].i].kind = VERT_LOCKED;
+		}
+	rwFree(keys);
+
+	// Open edges and edges between materials are borders,
+	// edges with more than two triangles lock their vertices.
+	for(i = 0; i < s->numTris; i++){
+		t = &s->tris[i];
+		for(j = 0; j < 3; j++){
+			a = t->v[j];
+			b = t->v[(j+1) % 3];
+			va = &s->verts[a];
+			vb = &s->verts[b];
+			same = 0;
+			opposite = 0;
+			for(k = 0; k < va->numTris; k++){
+				o = &s->tris[s->adj[va->start + k]];
+				if(o == t || !hasVertex(o, b))
+					continue;
+				same++;
+				if(hasEdge(o, b, a) && o->matId == t->matId)
+					opposite++;
+			}
+			if(same > 1){
+				va->kind = VERT_LOCKED;
+				vb->kind = VERT_LOCKED;
+			}else if(opposite == 0){
+				addBorderNeighbour(va, b);
+				addBorderNeighbour(vb, a);
+			}
+		}
+	}
+	for(i = 0; i < s->numVertices; i++){
+		va = &s->verts[i];
+		if(va->kind == VERT_MANIFOLD && va->numBorder > 0)
+			va->kind = va->numBorder == 2 ? VERT_BORDER : VERT_LOCKED;
+	}
+	return 1;
+}
+
+static void
+computeQuadrics(Simplifier *s)
+{
+	Quadric q;
+	Triangle *t;
+	V3d p0, p1, p2, n, e, bn;
+	float32 area, len;
+	int32 i, j;
+	uint32 a, b;
+
+	memset(s->quadrics, 0, s->numVertices*sizeof(Quadric));
+	for(i = 0; i < s->numTris; i++){
+		t = &s->tris[i];
+		p0 = s->pos[t->v[0]];
+		p1 = s->pos[t->v[1]];
+		p2 = s->pos[t->v[2]];
+		n = cross(sub(p1, p0), sub(p2, p0));
+		area = length(n);
+		if(area == 0.0f)
+			continue;
+		n = scale(n, 1.0f/area);
+		quadricFromPlane(&q, n, -dot(n, p0), area*0.5f);
+		for(j = 0; j < 3; j++)
+			quadricAdd(&s->quadrics[t->v[j]], &q);
+
+		// planes perpendicular to border edges keep the outline in place
+		for(j = 0; j < 3; j++){
+			a = t->v[j];
+			b = t->v[(j+1) % 3];
+			if(s->verts[a].numBorder == 0 || s->verts[b].numBorder == 0)
+				continue;
+			if(s->verts[a].border[0] != (int32)b && s->verts[a].border[1] != (int32)b)
+				continue;
+			e = sub(s->pos[b], s->pos[a]);
+			bn = cross(e, n);
+			len = length(bn);
+			if(len == 0.0f)
+				continue;
+			bn = scale(bn, 1.0f/len);
+			quadricFromPlane(&q, bn, -dot(bn, s->pos[a]), dot(e, e)*BORDERWEIGHT);
+			// only a penalty, not counted as area
+			q.w = 0.0f;
+			quadricAdd(&s->quadrics[a], &q);
+			quadricAdd(&s->quadrics[b], &q);
+		}
+	}
+}
+
+// Bones with a weight, the order may differ
+static bool32
+sameBones(Skin *skin, int32 a, int32 b)
+{
+	int32 i, j;
+	uint8 *ia = &skin->indices[a*4];
+	uint8 *ib = &skin->indices[b*4];
+	float *wa = &skin->weights[a*4];
+	float *wb = &skin->weights[b*4];
+	for(i = 0; i < 4; i++){
+		if(wa[i] == 0.0f)
+			continue;
+		for(j = 0; j < 4; j++)
+			if(wb[j] != 0.0f && ib[j] == ia[i])
+				break;
+		if(j == 4)
+			return 0;
+	}
+	for(i = 0; i < 4; i++){
+		if(wb[i] == 0.0f)
+			continue;
+		for(j = 0; j < 4; j++)
+			if(wa[j] != 0.0f && ia[j] == ib[i])
+				break;
+		if(j == 4)
+			return 0;
+	}
+	return 1;
+}
+
+#define MAXATTRIBS (2*8 + 4 + 4)
+
+static float32
+boneWeight(Skin *skin, int32 v, uint8 bone)
+{
+	for(int32 i = 0; i < 4; i++)
+		if(skin->weights[v*4+i] != 0.0f && skin->indices[v*4+i] == bone)
+			return skin->weights[v*4+i];
+	return 0.0f;
+}
+
+// Tex coords, prelit color and the weights of ref's bones, all roughly in [0,1]
+static int32
+getAttributes(Simplifier *s, int32 v, int32 ref, float32 *attribs)
+{
+	Geometry *geo = s->geo;
+	int32 i, n;
+
+	n = 0;
+	for(i = 0; i < geo->numTexCoordSets; i++){
+		attribs[n++] = geo->texCoords[i][v].u;
+		attribs[n++] = geo->texCoords[i][v].v;
+	}
+	if(geo->colors){
+		attribs[n++] = geo->colors[v].red/255.0f;
+		attribs[n++] = geo->colors[v].green/255.0f;
+		attribs[n++] = geo->colors[v].blue/255.0f;
+		attribs[n++] = geo->colors[v].alpha/255.0f;
+	}
+	if(s->skin)
+		for(i = 0; i < 4; i++)
+			attribs[n++] = boneWeight(s->skin, v, s->skin->indices[ref*4+i]);
+	return n;
+}
+
+/* Attributes that vary linearly over the surface don't change when a
+ * vertex is removed. So the error is how far the attributes of to are from
+ * what the triangles around from interpolate at its position, scaled by the
+ * edge length to be comparable to distances. */
+static float32
+attributeError(Simplifier *s, int32 from, int32 to)
+{
+	SimplifyVertex *v = &s->verts[from];
+	float32 attribs[3][MAXATTRIBS], target[MAXATTRIBS];
+	Triangle *t;
+	V3d p0, e1, e2, x, edge;
+	float32 d11, d12, d22, dx1, dx2, det, b1, b2, d, e;
+	int32 i, j, k, n, numTris;
+
+	n = getAttributes(s, to, from, target);
+	if(n == 0)
+		return 0.0f;
+	e = 0.0f;
+	numTris = 0;
+	for(i = 0; i < v->numTris; i++){
+		t = &s->tris[s->adj[v->start + i]];
+		if(hasVertex(t, to))
+			continue;
+		p0 = s->pos[t->v[0]];
+		e1 = sub(s->pos[t->v[1]], p0);
+		e2 = sub(s->pos[t->v[2]], p0);
+		x = sub(s->pos[to], p0);
+		d11 = dot(e1, e1);
+		d12 = dot(e1, e2);
+		d22 = dot(e2, e2);
+		det = d11*d22 - d12*d12;
+		if(det <= 0.0f)
+			continue;
+		// barycentric coordinates of to projected into the plane
+		dx1 = dot(x, e1);
+		dx2 = dot(x, e2);
+		b1 = (d22*dx1 - d12*dx2)/det;
+		b2 = (d11*dx2 - d12*dx1)/det;
+		for(j = 0; j < 3; j++)
+			getAttributes(s, t->v[j], from, attribs[j]);
+		for(k = 0; k < n; k++){
+			d = (1.0f-b1-b2)*attribs[0][k] + b1*attribs[1][k] + b2*attribs[2][k] - target[k];
+			e += d*d;
+		}
+		numTris++;
+	}
+	if(numTris == 0)
+		return 0.0f;
+	edge = sub(s->pos[from], s->pos[to]);
+	return e/numTris*dot(edge, edge);
+}
+
+static bool32
+canCollapse(Simplifier *s, int32 from, int32 to)
+{
+	SimplifyVertex *v = &s->verts[from];
+	if(v->kind == VERT_LOCKED)
+		return 0;
+	if(v->kind == VERT_BORDER && v->border[0] != to && v->border[1] != to)
+		return 0;
+	if(s->skin && !sameBones(s->skin, from, to))
+		return 0;
+	return 1;
+}
+
+static float32
+collapseError(Simplifier *s, int32 from, int32 to)
+{
+	Quadric q = s->quadrics[from];
+	quadricAdd(&q, &s->quadrics[to]);
+	return quadricError(&q, s->pos[to]) + attributeError(s, from, to);
+}
+
+static int
+cmpCollapses(const void *a, const void *b)
+{
+	float32 ea = ((const EdgeCollapse*)a)->error;
+	float32 eb = ((const EdgeCollapse*)b)->error;
+	return ea < eb ? -1 : ea > eb ? 1 : 0;
+}
+
+static int32
+pickCollapses(Simplifier *s)
+{
+	EdgeCollapse *c;
+	Triangle *t;
+	int32 i, j, n;
+	uint32 a, b;
+
+	n = 0;
+	for(i = 0; i < s->numTris; i++){
+		t = &s->tris[i];
+		for(j = 0; j < 3; j++){
+			a = t->v[j];
+			b = t->v[(j+1) % 3];
+			// every edge is seen from both sides if it has two triangles
+			if(a > b && s->verts[a].kind != VERT_BORDER && s->verts[b].kind != VERT_BORDER)
+				continue;
+			if(canCollapse(s, a, b)){
+				c = &s->collapses[n++];
+				c->from = a;
+				c->to = b;
+				c->error = collapseError(s, a, b);
+			}
+			if(canCollapse(s, b, a)){
+				c = &s->collapses[n++];
+				c->from = b;
+				c->to = a;
+				c->error = collapseError(s, b, a);
+			}
+		}
+	}
+	return n;
+}
+
+// 1 for an equilateral triangle, 0 for a degenerate one
+static float32
+triangleQuality(V3d *p, V3d n)
+{
+	float32 e = dot(sub(p[1], p[0]), sub(p[1], p[0])) +
+		dot(sub(p[2], p[1]), sub(p[2], p[1])) +
+		dot(sub(p[0], p[2]), sub(p[0], p[2]));
+	return e > 0.0f ? 2.0f*1.7320508f*length(n)/e : 0.0f;
+}
+
+// Triangles around from must not flip or turn into
+// slivers when it moves to to
+static bool32
+collapseFlips(Simplifier *s, int32 from, int32 to)
+{
+	SimplifyVertex *v = &s->verts[from];
+	Triangle *t;
+	V3d p[3], n0, n1;
+	float32 q0, q1;
+	int32 i, j;
+
+	for(i = 0; i < v->numTris; i++){
+		t = &s->tris[s->adj[v->start + i]];
+		if(hasVertex(t, to))
+			continue;
+		for(j = 0; j < 3; j++)
+			p[j] = s->pos[t->v[j]];
+		n0 = cross(sub(p[1], p[0]), sub(p[2], p[0]));
+		q0 = triangleQuality(p, n0);
+		for(j = 0; j < 3; j++)
+			if(t->v[j] == (uint32)from)
+				p[j] = s->pos[to];
+		n1 = cross(sub(p[1], p[0]), sub(p[2], p[0]));
+		if(dot(n0, n1) <= MINCOSINE*length(n0)*length(n1))
+			return 1;
+		q1 = triangleQuality(p, n1);
+		if(q1 < MINQUALITY && q1 < q0)
+			return 1;
+	}
+	return 0;
+}
+
+static void
+replaceBorderNeighbour(SimplifyVertex *v, int32 old, int32 n)
+{
+	if(v->border[0] == old)
+		v->border[0] = n;
+	else if(v->border[1] == old)
+		v->border[1] = n;
+}
+
+static void
+collapseEdge(Simplifier *s, int32 from, int32 to, int32 pass)
+{
+	SimplifyVertex *v = &s->verts[from];
+	SimplifyVertex *vt = &s->verts[to];
+	Triangle *t;
+	int32 i, j, other;
+
+	for(i = 0; i < v->numTris; i++){
+		t = &s->tris[s->adj[v->start + i]];
+		for(j = 0; j < 3; j++)
+			s->verts[t->v[j]].touched = pass;
+		if(hasVertex(t, to)){
+			// mark dead, removed after the pass
+			t->matId = 0xFFFF;
+			continue;
+		}
+		for(j = 0; j < 3; j++)
+			if(t->v[j] == (uint32)from)
+				t->v[j] = to;
+	}
+	if(v->kind == VERT_BORDER){
+		other = v->border[0] == to ? v->border[1] : v->border[0];
+		replaceBorderNeighbour(vt, from, other);
+		replaceBorderNeighbour(&s->verts[other], from, to);
+	}
+	quadricAdd(&s->quadrics[to], &s->quadrics[from]);
+	v->kind = VERT_LOCKED;
+	v->numTris = 0;
+}
+
+static int32
+countKilled(Simplifier *s, int32 from, int32 to)
+{
+	SimplifyVertex *v = &s->verts[from];
+	int32 i, n;
+	n = 0;
+	for(i = 0; i < v->numTris; i++)
+		if(hasVertex(&s->tris[s->adj[v->start + i]], to))
+			n++;
+	return n;
+}
+
+static void
+removeDeadTriangles(Simplifier *s)
+{
+	int32 i, n;
+	n = 0;
+	for(i = 0; i < s->numTris; i++)
+		if(s->tris[i].matId != 0xFFFF)
+			s->tris[n++] = s->tris[i];
+	s->numTris = n;
+}
+
+// New geometry with only the vertices still in use
+static Geometry*
+makeGeometry(Simplifier *s, int32 *remap)
+{
+	Geometry *src = s->geo;
+	Geometry *dst;
+	Skin *skin;
+	int32 i, j, nv;
+
+	for(i = 0; i < src->numVertices; i++)
+		remap[i] = -1;
+	for(i = 0; i < s->numTris; i++)
+		for(j = 0; j < 3; j++)
+			remap[s->tris[i].v[j]] = 0;
+	nv = 0;
+	for(i = 0; i < src->numVertices; i++)
+		if(remap[i] == 0)
+			remap[i] = nv++;
+
+	dst = Geometry::create(nv, s->numTris,
+		(src->flags & ~Geometry::NATIVE) | src->numTexCoordSets<<16);
+	if(dst == nil)
+		return nil;
+	dst->addMorphTargets(src->numMorphTargets-1);
+	for(i = 0; i < src->numVertices; i++){
+		if(remap[i] < 0)
+			continue;
+		for(j = 0; j < src->numMorphTargets; j++){
+			MorphTarget *ms = &src->morphTargets[j];
+			MorphTarget *md = &dst->morphTargets[j];
+			if(ms->vertices && md->vertices)
+				md->vertices[remap[i]] = ms->vertices[i];
+			if(ms->normals && md->normals)
+				md->normals[remap[i]] = ms->normals[i];
+		}
+		if(src->colors && dst->colors)
+			dst->colors[remap[i]] = src->colors[i];
+		for(j = 0; j < src->numTexCoordSets; j++)
+			if(src->texCoords[j] && dst->texCoords[j])
+				dst->texCoords[j][remap[i]] = src->texCoords[j][i];
+	}
+	for(i = 0; i < s->numTris; i++){
+		for(j = 0; j < 3; j++)
+			dst->triangles[i].v[j] = remap[s->tris[i].v[j]];
+		dst->triangles[i].matId = s->tris[i].matId;
+	}
+	for(i = 0; i < src->matList.numMaterials; i++)
+		dst->matList.appendMaterial(src->matList.materials[i]);
+
+	if(s->skin){
+		skin = rwNewT(Skin, 1, MEMDUR_EVENT | ID_SKIN);
+		if(skin == nil){
+			RWERROR((ERR_ALLOC, sizeof(Skin)));
+			dst->destroy();
+			return nil;
+		}
+		skin->init(s->skin->numBones, s->skin->numUsedBones, nv);
+		if(skin->numBones)
+			memcpy(skin->inverseMatrices, s->skin->inverseMatrices,
+			       skin->numBones*64);
+		for(i = 0; i < src->numVertices; i++){
+			if(remap[i] < 0)
+				continue;
+			memcpy(&skin->indices[remap[i]*4], &s->skin->indices[i*4], 4);
+			memcpy(&skin->weights[remap[i]*4], &s->skin->weights[i*4], 16);
+		}
+		skin->numWeights = s->skin->numWeights;
+		if(skin->numUsedBones)
+			skin->findUsedBones(nv);
+		Skin::set(dst, skin);
+	}
+
+	for(i = 0; i < dst->numMorphTargets; i++)
+		dst->morphTargets[i].boundingSphere = dst->morphTargets[i].calculateBoundingSphere();
+	dst->buildMeshes();
+	return dst;
+}
+
+/*
+ * Collapse edges until there are no more than targetTriangles
+ * or no collapse has an error below maxError (a distance).
+ * Every pass picks all possible collapses, sorts them and does the cheaper
+ * ones that don't touch a vertex changed in the same pass.
+ */
+Geometry*
+Geometry::simplify(int32 targetTriangles, float32 maxError)
+{
+	Simplifier s;
+	Geometry *ret;
+	EdgeCollapse *c;
+	int32 *remap;
+	int32 i, n, pass, goal, numCollapsed, numAlive;
+	float32 errorLimit;
+	uint32 arena;
+
+	if(this->flags & NATIVE || this->triangles == nil ||
+	   this->numMorphTargets == 0 || this->morphTargets[0].vertices == nil)
+		return nil;
+
+	ret = nil;
+	arena = beginFunctionArena();
+	s.geo = this;
+	s.skin = skinGlobals.geoOffset ? Skin::get(this) : nil;
+	if(s.skin && (s.skin->indices == nil || s.skin->weights == nil))
+		s.skin = nil;
+	s.pos = this->morphTargets[0].vertices;
+	s.numVertices = this->numVertices;
+	s.tris = rwNewT(Triangle, this->numTriangles, MEMDUR_FUNCTION | ID_GEOMETRY);
+	s.quadrics = rwNewT(Quadric, this->numVertices, MEMDUR_FUNCTION | ID_GEOMETRY);
+	s.verts = rwNewT(SimplifyVertex, this->numVertices, MEMDUR_FUNCTION | ID_GEOMETRY);
+	s.adj = rwNewT(int32, this->numTriangles*3, MEMDUR_FUNCTION | ID_GEOMETRY);
+	s.collapses = rwNewT(EdgeCollapse, this->numTriangles*6, MEMDUR_FUNCTION | ID_GEOMETRY);
+	remap = rwNewT(int32, this->numVertices, MEMDUR_FUNCTION | ID_GEOMETRY);
+	if(s.tris == nil || s.quadrics == nil || s.verts == nil ||
+	   s.adj == nil || s.collapses == nil || remap == nil){
+		RWERROR((ERR_ALLOC, this->numTriangles*(sizeof(Triangle) + 3*sizeof(int32) + 6*sizeof(EdgeCollapse))));
+		goto out;
+	}
+
+	// degenerate triangles go right away
+	s.numTris = 0;
+	for(i = 0; i < this->numTriangles; i++){
+		Triangle *t = &this->triangles[i];
+		if(t->v[0] != t->v[1] && t->v[0] != t->v[2] && t->v[1] != t->v[2])
+			s.tris[s.numTris++] = *t;
+	}
+	buildAdjacency(&s);
+	if(!classifyVertices(&s))
+		goto out;
+	computeQuadrics(&s);
+
+	for(pass = 0; s.numTris > targetTriangles; pass++){
+		n = pickCollapses(&s);
+		if(n == 0)
+			break;
+		qsort(s.collapses, n, sizeof(EdgeCollapse), cmpCollapses);
+
+		// Don't go much past the collapses we need, later passes
+		// see the changed mesh. Each one removes about two triangles.
+		goal = (s.numTris - targetTriangles)/2;
+		errorLimit = maxError*maxError;
+		if(goal*3 < n && s.collapses[goal*3].error < errorLimit)
+			errorLimit = s.collapses[goal*3].error;
+
+		numCollapsed = 0;
+		numAlive = s.numTris;
+		for(i = 0; i < n && numAlive > targetTriangles; i++){
+			c = &s.collapses[i];
+			if(c->error > errorLimit)
+				break;
+			if(s.verts[c->from].touched == pass ||
+			   s.verts[c->to].touched == pass ||
+			   collapseFlips(&s, c->from, c->to))
+				continue;
+			numAlive -= countKilled(&s, c->from, c->to);
+			collapseEdge(&s, c->from, c->to, pass);
+			numCollapsed++;
+		}
+		if(numCollapsed == 0)
+			break;
+		removeDeadTriangles(&s);
+		buildAdjacency(&s);
+	}
+
+	ret = makeGeometry(&s, remap);
+
+out:
+	rwFree(s.tris);
+	rwFree(s.quadrics);
+	rwFree(s.verts);
+	rwFree(s.adj);
+	rwFree(s.collapses);
+	rwFree(remap);
+	endFunctionArena(arena);
+	return ret;
+}
+
+}
@@ -72,6 +72,31 @@ copySkin(void *dst, void *src, int32 offset, int32)
 	return dst;
 }
 
+// Bone indices and weights of the vertices in a piece of Geometry::splitIndex16
+static void
+splitSkin(Geometry *piece, Geometry *geo, const int32 *verts, int32 numVerts)
+{
+	Skin *skin = Skin::get(geo);
+	if(skin == nil || skin->indices == nil || skin->weights == nil)
+		return;
+	Skin *pskin = rwNewT(Skin, 1, MEMDUR_EVENT | ID_SKIN);
+	if(pskin == nil){
+		RWERROR((ERR_ALLOC, sizeof(Skin)));
+		return;
+	}
+	pskin->init(skin->numBones, skin->numUsedBones, numVerts);
+	pskin->numWeights = skin->numWeights;
+	if(skin->numUsedBones)
+		memcpy(pskin->usedBones, skin->usedBones, skin->numUsedBones);
+	if(skin->numBones)
+		memcpy(pskin->inverseMatrices, skin->inverseMatrices, skin->numBones*64);
+	for(int32 i = 0; i < numVerts; i++){
+		memcpy(&pskin->indices[i*4], &skin->indices[verts[i]*4], 4);
+		memcpy(&pskin->weights[i*4], &skin->weights[verts[i]*4], 16);
+	}
+	Skin::set(piece, pskin);
+}
+
 Stream*
 readSkinSplitData(Stream *stream, Skin *skin)
 {
@@ -380,6 +405,7 @@ registerSkinPlugin(void)
 	Geometry::registerPluginStream(ID_SKIN,
 	                               readSkin, writeSkin, getSizeSkin);
 	skinGlobals.geoOffset = o;
+	Geometry::setSplitCallback(ID_SKIN, splitSkin);
 	o = Atomic::registerPlugin(sizeof(HAnimHierarchy*),ID_SKIN,
 	                           createSkinAtm, destroySkinAtm, copySkinAtm);
 	skinGlobals.atomicOffset = o;
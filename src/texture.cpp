@@ -22,11 +22,12 @@
 
 namespace rw {
 
-int32 Texture::numAllocated;
-int32 TexDictionary::numAllocated;
+AtomicInt32 Texture::numAllocated;
+AtomicInt32 TexDictionary::numAllocated;
 
 PluginList TexDictionary::s_plglist(sizeof(TexDictionary));
 PluginList Texture::s_plglist(sizeof(Texture));
+FreeList *Texture::s_freeList;
 PluginList Raster::s_plglist(sizeof(Raster));
 
 struct TextureGlobals
@@ -176,6 +177,36 @@ TexDictionary::find(const char *name)
 	return nil;
 }
 
+struct TexDictArgs
+{
+	Texture **textures;
+	int32 numTextures;
+};
+
+// The dictionary list is global, so the loader has to do this on the main thread
+static void*
+createTexDictCB(void *data)
+{
+	TexDictArgs *args = (TexDictArgs*)data;
+	TexDictionary *txd = TexDictionary::create();
+	if(txd == nil)
+		return nil;
+	for(int32 i = 0; i < args->numTextures; i++)
+		txd->add(args->textures[i]);
+	return txd;
+}
+
+static void*
+destroyTexturesCB(void *data)
+{
+	TexDictArgs *args = (TexDictArgs*)data;
+	for(int32 i = 0; i < args->numTextures; i++)
+		args->textures[i]->destroy();
+	return nil;
+}
+
+static void *destroyTexDictCB(void *txd) { ((TexDictionary*)txd)->destroy(); return nil; }
+
 TexDictionary*
 TexDictionary::streamRead(Stream *stream)
 {
@@ -187,9 +218,14 @@ TexDictionary::streamRead(Stream *stream)
 	stream->readI16(); // device id (0 = unknown, 1 = d3d8, 2 = d3d9,
 	                   // 3 = gcn, 4 = null, 5 = opengl,
 	                   // 6 = ps2, 7 = softras, 8 = xbox, 9 = psp)
-	TexDictionary *txd = TexDictionary::create();
-	if(txd == nil)
+	TexDictArgs args;
+	args.numTextures = 0;
+	args.textures = rwNewT(Texture*, numTex, MEMDUR_FUNCTION | ID_TEXDICTIONARY);
+	if(args.textures == nil && numTex > 0){
+		RWERROR((ERR_ALLOC, numTex*sizeof(Texture*)));
 		return nil;
+	}
+	TexDictionary *txd;
 	Texture *tex;
 	for(int32 i = 0; i < numTex; i++){
 		if(!findChunk(stream, ID_TEXTURENATIVE, nil, nil)){
@@ -199,33 +235,50 @@ TexDictionary::streamRead(Stream *stream)
 		tex = Texture::streamReadNative(stream);
 		if(tex == nil)
 			goto fail;
+		args.textures[args.numTextures++] = tex;
 		Texture::s_plglist.streamRead(stream, tex);
-		txd->add(tex);
 	}
+	// Only make the dictionary and fill it when all textures are there
+	txd = (TexDictionary*)AsyncLoader::callMainThread(createTexDictCB, &args);
+	if(txd == nil)
+		goto fail;
+	if(args.textures)
+		rwFree(args.textures);
 	if(s_plglist.streamRead(stream, txd))
 		return txd;
+	AsyncLoader::callMainThread(destroyTexDictCB, txd);
+	return nil;
 fail:
-	txd->destroy();
+	AsyncLoader::callMainThread(destroyTexturesCB, &args);
+	if(args.textures)
+		rwFree(args.textures);
 	return nil;
 }
 
 void
 TexDictionary::streamWrite(Stream *stream)
 {
-	writeChunkHeader(stream, ID_TEXDICTIONARY, this->streamGetSize());
+	int32 chunk = beginChunk(stream, ID_TEXDICTIONARY);
+	if(chunk < 0)
+		writeChunkHeader(stream, ID_TEXDICTIONARY, this->streamGetSize());
 	writeChunkHeader(stream, ID_STRUCT, 4);
 	int32 numTex = this->count();
 	stream->writeI16(numTex);
 	stream->writeI16(0);
 	FORLIST(lnk, this->textures){
 		Texture *tex = Texture::fromDict(lnk);
-		uint32 sz = tex->streamGetSizeNative();
-		sz += 12 + Texture::s_plglist.streamGetSize(tex);
-		writeChunkHeader(stream, ID_TEXTURENATIVE, sz);
+		int32 texchunk = beginChunk(stream, ID_TEXTURENATIVE);
+		if(texchunk < 0){
+			uint32 sz = tex->streamGetSizeNative();
+			sz += 12 + Texture::s_plglist.streamGetSize(tex);
+			writeChunkHeader(stream, ID_TEXTURENATIVE, sz);
+		}
 		tex->streamWriteNative(stream);
 		Texture::s_plglist.streamWrite(stream, tex);
+		endChunk(stream, texchunk);
 	}
 	s_plglist.streamWrite(stream, this);
+	endChunk(stream, chunk);
 }
 
 uint32
@@ -266,7 +319,7 @@ Texture *(*Texture::readCB)(const char *name, const char *mask) = defaultReadCB;
 Texture*
 Texture::create(Raster *raster)
 {
-	Texture *tex = (Texture*)rwMalloc(s_plglist.size, MEMDUR_EVENT | ID_TEXTURE);
+	Texture *tex = (Texture*)s_freeList->alloc();
 	if(tex == nil){
 		RWERROR((ERR_ALLOC, s_plglist.size));
 		return nil;
@@ -295,7 +348,7 @@ Texture::destroy(void)
 		if(this->raster)
 			this->raster->destroy();
 		this->inGlobalList.remove();
-		rwFree(this);
+		s_freeList->free(this);
 		numAllocated--;
 	}
 }
@@ -310,6 +363,18 @@ defaultFindCB(const char *name)
 }
 
 
+static Texture*
+createFromImage(const char *name, const char *mask, Image *img)
+{
+	Texture *tex = Texture::create(Raster::createFromImage(img));
+	if(tex == nil)
+		return nil;
+	strncpy(tex->name, name, 32);
+	if(mask)
+		strncpy(tex->mask, mask, 32);
+	return tex;
+}
+
 static Texture*
 defaultReadCB(const char *name, const char *mask)
 {
@@ -318,32 +383,20 @@ defaultReadCB(const char *name, const char *mask)
 
 	img = Image::readMasked(name, mask);
 	if(img){
-		tex = Texture::create(Raster::createFromImage(img));
-		strncpy(tex->name, name, 32);
-		if(mask)
-			strncpy(tex->mask, mask, 32);
+		tex = createFromImage(name, mask, img);
 		img->destroy();
 		return tex;
 	}else
 		return nil;
 }
 
-Texture*
-Texture::read(const char *name, const char *mask)
+// Makes a dummy if the texture couldn't be read, then puts it into the current dictionary
+static Texture*
+finishRead(const char *name, const char *mask, Texture *tex)
 {
-	(void)mask;
 	Raster *raster = nil;
-	Texture *tex;
 
-	if(tex = Texture::findCB(name), tex){
-		tex->addRef();
-		return tex;
-	}
-	if(TEXTUREGLOBAL(loadTextures)){
-		tex = Texture::readCB(name, mask);
-		if(tex == nil)
-			goto dummytex;
-	}else dummytex: if(TEXTUREGLOBAL(makeDummies)){
+	if(tex == nil && TEXTUREGLOBAL(makeDummies)){
 //printf("missing texture %s %s\n", name ? name : "", mask ? mask : "");
 		tex = Texture::create(nil);
 		if(tex == nil)
@@ -362,6 +415,80 @@ Texture::read(const char *name, const char *mask)
 	return tex;
 }
 
+Texture*
+Texture::read(const char *name, const char *mask)
+{
+	Texture *tex;
+
+	if(tex = Texture::findCB(name), tex){
+		tex->addRef();
+		return tex;
+	}
+	tex = nil;
+	if(TEXTUREGLOBAL(loadTextures))
+		tex = Texture::readCB(name, mask);
+	return finishRead(name, mask, tex);
+}
+
+struct TextureReadArgs
+{
+	const char *name;
+	const char *mask;
+	uint32 filterAddressing;
+	bool32 readImage;	// the default readCB would be used
+	Image *img;	// read by the loader thread
+};
+
+// Dictionary lookup, main thread only
+static void*
+findTextureCB(void *data)
+{
+	TextureReadArgs *args = (TextureReadArgs*)data;
+	Texture *tex = Texture::findCB(args->name);
+	if(tex){
+		tex->addRef();
+		return tex;
+	}
+	args->readImage = TEXTUREGLOBAL(loadTextures) && Texture::readCB == defaultReadCB;
+	return nil;
+}
+
+// Creates the raster from an image the loader thread has read,
+// or reads the texture here if that wasn't possible
+static void*
+readTextureCB(void *data)
+{
+	TextureReadArgs *args = (TextureReadArgs*)data;
+	bool32 mipState = Texture::getMipmapping();
+	bool32 autoMipState = Texture::getAutoMipmapping();
+	int32 filter = args->filterAddressing&0xFF;
+	if(filter == Texture::MIPNEAREST || filter == Texture::MIPLINEAR ||
+	   filter == Texture::LINEARMIPNEAREST || filter == Texture::LINEARMIPLINEAR){
+		Texture::setMipmapping(1);
+		Texture::setAutoMipmapping((args->filterAddressing&0x10000) == 0);
+	}else{
+		Texture::setMipmapping(0);
+		Texture::setAutoMipmapping(0);
+	}
+
+	Texture *tex;
+	if(!args->readImage)
+		tex = Texture::read(args->name, args->mask);
+	else if(tex = Texture::findCB(args->name), tex)
+		// some other request got here first
+		tex->addRef();
+	else
+		tex = finishRead(args->name, args->mask,
+			args->img ? createFromImage(args->name, args->mask, args->img) : nil);
+	// others may be using it already
+	if(tex && tex->refCount == 1)
+		tex->filterAddressing = args->filterAddressing&0xFFFF;
+
+	Texture::setMipmapping(mipState);
+	Texture::setAutoMipmapping(autoMipState);
+	return tex;
+}
+
 Texture*
 Texture::streamRead(Stream *stream)
 {
@@ -391,30 +518,22 @@ Texture::streamRead(Stream *stream)
 	}
 	stream->read8(mask, length);
 
-	bool32 mipState = getMipmapping();
-	bool32 autoMipState = getAutoMipmapping();
-	int32 filter = filterAddressing&0xFF;
-	if(filter == MIPNEAREST || filter == MIPLINEAR ||
-	   filter == LINEARMIPNEAREST || filter == LINEARMIPLINEAR){
-		setMipmapping(1);
-		setAutoMipmapping((filterAddressing&0x10000) == 0);
-	}else{
-		setMipmapping(0);
-		setAutoMipmapping(0);
+	// Images are read and decoded here, only raster creation
+	// and the dictionaries are left to the main thread
+	TextureReadArgs args = { name, mask, filterAddressing, 0, nil };
+	Texture *tex = (Texture*)AsyncLoader::callMainThread(findTextureCB, &args);
+	if(tex == nil){
+		if(args.readImage)
+			args.img = Image::readMasked(name, mask);
+		tex = (Texture*)AsyncLoader::callMainThread(readTextureCB, &args);
+		if(args.img)
+			args.img->destroy();
 	}
 
-	Texture *tex = Texture::read(name, mask);
-
-	setMipmapping(mipState);
-	setAutoMipmapping(autoMipState);
-
 	if(tex == nil){
 		s_plglist.streamSkip(stream);
 		return nil;
 	}
-	if(tex->refCount == 1)
-		tex->filterAddressing = filterAddressing&0xFFFF;
-
 	if(s_plglist.streamRead(stream, tex))
 		return tex;
 
@@ -427,7 +546,9 @@ Texture::streamWrite(Stream *stream)
 {
 	int size;
 	char buf[36];
-	writeChunkHeader(stream, ID_TEXTURE, this->streamGetSize());
+	int32 chunk = beginChunk(stream, ID_TEXTURE);
+	if(chunk < 0)
+		writeChunkHeader(stream, ID_TEXTURE, this->streamGetSize());
 	writeChunkHeader(stream, ID_STRUCT, 4);
 	uint32 filterAddressing = this->filterAddressing;
 	if(this->raster && (raster->format & Raster::AUTOMIPMAP) == 0)
@@ -447,6 +568,7 @@ Texture::streamWrite(Stream *stream)
 	stream->write8(buf, size);
 
 	s_plglist.streamWrite(stream, this);
+	endChunk(stream, chunk);
 	return true;
 }
 
@@ -462,9 +584,11 @@ Texture::streamGetSize(void)
 	return size;
 }
 
-Texture*
-Texture::streamReadNative(Stream *stream)
+// Native textures are uploaded to the device right away, so main thread only
+static void*
+readNativeTextureCB(void *data)
 {
+	Stream *stream = (Stream*)data;
 	if(!findChunk(stream, ID_STRUCT, nil, nil)){
 		RWERROR((ERR_CHUNK, "STRUCT"));
 		return nil;
@@ -485,6 +609,48 @@ Texture::streamReadNative(Stream *stream)
 	return nil;
 }
 
+Texture*
+Texture::streamReadNative(Stream *stream)
+{
+	uint32 length;
+	const uint8 *data;
+	uint8 *buf;
+	StreamMemory mem;
+	Texture *tex;
+
+	if(!AsyncLoader::onLoaderThread())
+		return (Texture*)readNativeTextureCB(stream);
+
+	// Read the whole chunk here, the main thread
+	// only creates the raster and copies the pixels into it
+	if(!findChunk(stream, ID_STRUCT, &length, nil)){
+		RWERROR((ERR_CHUNK, "STRUCT"));
+		return nil;
+	}
+	stream->seek(-12);
+	length += 12;
+	buf = nil;
+	data = stream->borrow(length);
+	if(data == nil){
+		buf = rwNewT(uint8, length, MEMDUR_FUNCTION | ID_TEXTURE);
+		if(buf == nil){
+			RWERROR((ERR_ALLOC, length));
+			return nil;
+		}
+		if(stream->read8(buf, length) != length){
+			rwFree(buf);
+			return nil;
+		}
+		data = buf;
+	}
+	mem.open((uint8*)data, length);
+	tex = (Texture*)AsyncLoader::callMainThread(readNativeTextureCB, &mem);
+	mem.close();
+	if(buf)
+		rwFree(buf);
+	return tex;
+}
+
 void
 Texture::streamWriteNative(Stream *stream)
 {
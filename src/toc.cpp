@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "rwbase.h"
+#include "rwerror.h"
+#include "rwplg.h"
+#include "rwpipeline.h"
+#include "rwobjects.h"
+#include "rwengine.h"
+
+#define PLUGIN_ID ID_CHUNKINDEX
+
+namespace rw {
+
+ChunkIndex*
+ChunkIndex::create(void)
+{
+	ChunkIndex *idx = rwNewT(ChunkIndex, 1, MEMDUR_EVENT | ID_CHUNKINDEX);
+	idx->base = 0;
+	idx->numEntries = 0;
+	idx->space = 0;
+	idx->entries = nil;
+	return idx;
+}
+
+void
+ChunkIndex::destroy(void)
+{
+	rwFree(this->entries);
+	rwFree(this);
+}
+
+static ChunkIndex::Entry*
+addEntry(ChunkIndex *idx)
+{
+	if(idx->numEntries >= idx->space){
+		idx->space = idx->space ? idx->space*2 : 64;
+		idx->entries = rwResizeT(ChunkIndex::Entry, idx->entries, idx->space,
+			MEMDUR_EVENT | ID_CHUNKINDEX);
+	}
+	return &idx->entries[idx->numEntries++];
+}
+
+/* We can't know whether a chunk contains more chunks or just data,
+ * so like dumprwtree we assume sub-chunks when the headers
+ * have the same library ID as their parent and fit inside it.
+ * If that turns out to be wrong we roll back and keep only the parent. */
+static bool32
+indexChunks(ChunkIndex *idx, Stream *s, uint32 end, int32 parent)
+{
+	ChunkHeaderInfo header;
+	ChunkIndex::Entry *e, *p;
+	uint32 pos;
+	int32 self;
+
+	p = parent >= 0 ? &idx->entries[parent] : nil;
+	for(;;){
+		pos = s->tell();
+		if(pos >= end)
+			break;
+		if(p && end - pos < 12)
+			return 0;
+		if(!readChunkHeaderInfo(s, &header))
+			return p == nil;
+		if(p == nil && header.type == ID_NAOBJECT)
+			break;
+		if(p && (header.version != p->version ||
+		         header.build != p->build ||
+		         header.length > end - pos - 12))
+			return 0;
+
+		self = idx->numEntries;
+		e = addEntry(idx);
+		e->type = header.type;
+		e->offset = pos - idx->base;
+		e->length = header.length;
+		e->version = header.version;
+		e->build = header.build;
+		e->parent = parent;
+		// addEntry may have moved the array
+		p = parent >= 0 ? &idx->entries[parent] : nil;
+
+		if(header.type != ID_STRUCT && header.type != ID_STRING &&
+		   header.length >= 12){
+			if(!indexChunks(idx, s, pos + 12 + header.length, self))
+				idx->numEntries = self+1;
+		}
+		s->seek(pos + 12 + header.length, 0);
+	}
+	return 1;
+}
+
+// Index all chunks from the current stream position up to length bytes
+bool32
+ChunkIndex::build(Stream *s, uint32 length)
+{
+	uint32 end;
+	this->numEntries = 0;
+	this->base = s->tell();
+	end = length == 0xFFFFFFFF ? 0xFFFFFFFF : this->base + length;
+	indexChunks(this, s, end, -1);
+	return this->numEntries > 0;
+}
+
+// Find the n-th chunk of a type, optionally only directly below a parent
+int32
+ChunkIndex::find(uint32 type, int32 n, int32 parent)
+{
+	for(int32 i = 0; i < this->numEntries; i++){
+		if(this->entries[i].type != type)
+			continue;
+		if(parent != ANYPARENT && this->entries[i].parent != parent)
+			continue;
+		if(n-- == 0)
+			return i;
+	}
+	return -1;
+}
+
+int32
+ChunkIndex::count(uint32 type, int32 parent)
+{
+	int32 n = 0;
+	for(int32 i = 0; i < this->numEntries; i++)
+		if(this->entries[i].type == type &&
+		   (parent == ANYPARENT || this->entries[i].parent == parent))
+			n++;
+	return n;
+}
+
+// Seek to the data of a chunk, i.e. just behind its header.
+bool32
+ChunkIndex::seek(Stream *s, int32 entry, uint32 *length, uint32 *version)
+{
+	Entry *e;
+	if(entry < 0 || entry >= this->numEntries)
+		return 0;
+	e = &this->entries[entry];
+	s->seek(this->base + e->offset + 12, 0);
+	if(length)
+		*length = e->length;
+	if(version)
+		*version = e->version;
+	return 1;
+}
+
+bool32
+ChunkIndex::seek(Stream *s, uint32 type, int32 n, uint32 *length, uint32 *version)
+{
+	return this->seek(s, this->find(type, n), length, version);
+}
+
+struct TocStreamEntry
+{
+	uint32 type;
+	uint32 offset;
+	uint32 length;
+	uint32 libid;
+	int32 parent;
+};
+
+ChunkIndex*
+ChunkIndex::streamRead(Stream *stream)
+{
+	uint32 length;
+	TocStreamEntry buf;
+	ChunkIndex *idx;
+	int32 n;
+
+	if(!findChunk(stream, ID_STRUCT, &length, nil)){
+		RWERROR((ERR_CHUNK, "STRUCT"));
+		return nil;
+	}
+	n = stream->readI32();
+	if(length != 4 + n*sizeof(TocStreamEntry)){
+		RWERROR((ERR_GENERAL, "invalid table of contents"));
+		return nil;
+	}
+	idx = ChunkIndex::create();
+	idx->space = n;
+	idx->entries = rwNewT(Entry, n, MEMDUR_EVENT | ID_CHUNKINDEX);
+	for(int32 i = 0; i < n; i++){
+		Entry *e = &idx->entries[i];
+		stream->read32(&buf, sizeof(TocStreamEntry));
+		e->type = buf.type;
+		e->offset = buf.offset;
+		e->length = buf.length;
+		e->version = libraryIDUnpackVersion(buf.libid);
+		e->build = libraryIDUnpackBuild(buf.libid);
+		e->parent = buf.parent;
+	}
+	idx->numEntries = n;
+	// indexed data follows directly
+	idx->base = stream->tell();
+	return idx;
+}
+
+void
+ChunkIndex::streamWrite(Stream *stream)
+{
+	TocStreamEntry buf;
+	writeChunkHeader(stream, ID_CHUNKINDEX, this->streamGetSize());
+	writeChunkHeader(stream, ID_STRUCT, 4 + this->numEntries*sizeof(TocStreamEntry));
+	stream->writeI32(this->numEntries);
+	for(int32 i = 0; i < this->numEntries; i++){
+		Entry *e = &this->entries[i];
+		buf.type = e->type;
+		buf.offset = e->offset;
+		buf.length = e->length;
+		buf.libid = libraryIDPack(e->version, e->build);
+		buf.parent = e->parent;
+		stream->write32(&buf, sizeof(TocStreamEntry));
+	}
+}
+
+uint32
+ChunkIndex::streamGetSize(void)
+{
+	return 12 + 4 + this->numEntries*sizeof(TocStreamEntry);
+}
+
+}
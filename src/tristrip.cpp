@@ -25,7 +25,7 @@ struct GraphEdge
 
 struct StripNode
 {
-	uint16 v[3];	/* vertex indices */
+	uint32 v[3];	/* vertex indices */
 	uint8 parent : 2;	/* tunnel parent node (edge index) */
 	uint8 visited : 1;	/* visited in breadth first search */
 	uint8 stripVisited : 1;	/* strip starting at this node was visited during search */
@@ -41,6 +41,9 @@ struct StripMesh
 	StripNode *nodes;
 	LinkList loneNodes;	/* nodes not connected to any others */
 	LinkList endNodes;	/* strip start/end nodes */
+	int32 *edgeHeads;	/* hash of edges to node*3 + edge */
+	int32 *edgeNext;
+	uint32 hashMask;
 };
 
 //#define trace(...) printf(__VA_ARGS__)
@@ -78,43 +81,51 @@ printEnds(StripMesh *sm)
 }
 
 static void
-printSmesh(StripMesh *sm)
+initNode(StripNode *n, Triangle *t)
 {
-	for(int32 i = 0; i < sm->numNodes; i++)
-		printNode(sm, &sm->nodes[i]);
+	n->v[0] = t->v[0];
+	n->v[1] = t->v[1];
+	n->v[2] = t->v[2];
+	n->e[0].node = 0;
+	n->e[1].node = 0;
+	n->e[2].node = 0;
+	n->e[0].isConnected = 0;
+	n->e[1].isConnected = 0;
+	n->e[2].isConnected = 0;
+	n->e[0].isStrip = 0;
+	n->e[1].isStrip = 0;
+	n->e[2].isStrip = 0;
+	n->parent = 0;
+	n->visited = 0;
+	n->stripVisited = 0;
+	n->isEnd = 0;
+	n->stripId = -1;
+	n->inlist.init();
 }
 
+static uint32
+hashEdge(int32 a, int32 b)
+{
+	return ((uint32)a*0x9E3779B1u ^ (uint32)b*0x85EBCA77u) >> 7;
+}
+
+/* Hash all edges. The chains are in node order, so lookups
+ * find the same node a linear search would. */
 static void
-collectFaces(Geometry *geo, StripMesh *sm, uint16 m)
+hashEdges(StripMesh *sm)
 {
 	StripNode *n;
-	Triangle *t;
-	sm->numNodes = 0;
-	for(int32 i = 0; i < geo->numTriangles; i++){
-		t = &geo->triangles[i];
-		if(t->matId == m){
-			n = &sm->nodes[sm->numNodes++];
-			n->v[0] = t->v[0];
-			n->v[1] = t->v[1];
-			n->v[2] = t->v[2];
-			assert(t->v[0] < geo->numVertices);
-			assert(t->v[1] < geo->numVertices);
-			assert(t->v[2] < geo->numVertices);
-			n->e[0].node = 0;
-			n->e[1].node = 0;
-			n->e[2].node = 0;
-			n->e[0].isConnected = 0;
-			n->e[1].isConnected = 0;
-			n->e[2].isConnected = 0;
-			n->e[0].isStrip = 0;
-			n->e[1].isStrip = 0;
-			n->e[2].isStrip = 0;
-			n->parent = 0;
-			n->visited = 0;
-			n->stripVisited = 0;
-			n->isEnd = 0;
-			n->stripId = -1;
-			n->inlist.init();
+	uint32 h;
+	int32 i, j, k;
+	for(i = 0; i <= (int32)sm->hashMask; i++)
+		sm->edgeHeads[i] = -1;
+	for(i = sm->numNodes-1; i >= 0; i--){
+		n = &sm->nodes[i];
+		for(j = 2; j >= 0; j--){
+			k = i*3 + j;
+			h = hashEdge(n->v[j], n->v[(j+1) % 3]) & sm->hashMask;
+			sm->edgeNext[k] = sm->edgeHeads[h];
+			sm->edgeHeads[h] = k;
 		}
 	}
 }
@@ -125,19 +136,20 @@ findEdge(StripMesh *sm, int32 e[2])
 {
 	StripNode *n;
 	GraphEdge ge = { 0, 0, 0, 0 };
-	for(int32 i = 0; i < sm->numNodes; i++){
+	int32 i, j, k;
+	for(k = sm->edgeHeads[hashEdge(e[0], e[1]) & sm->hashMask]; k >= 0; k = sm->edgeNext[k]){
+		i = k / 3;
+		j = k % 3;
 		n = &sm->nodes[i];
-		for(int32 j = 0; j < 3; j++){
-			if(n->e[j].isConnected)
-				continue;
-			if(e[0] == n->v[j] &&
-			   e[1] == n->v[(j+1) % 3]){
-				ge.node = i;
-				// signal success
-				ge.isConnected = 1;
-				ge.otherEdge = j;
-				return ge;
-			}
+		if(n->e[j].isConnected)
+			continue;
+		if((uint32)e[0] == n->v[j] &&
+		   (uint32)e[1] == n->v[(j+1) % 3]){
+			ge.node = i;
+			// signal success
+			ge.isConnected = 1;
+			ge.otherEdge = j;
+			return ge;
 		}
 	}
 	return ge;
@@ -150,6 +162,7 @@ connectNodesPreserve(StripMesh *sm)
 	StripNode *n, *nn;
 	int32 e[2];
 	GraphEdge ge;
+	hashEdges(sm);
 	for(int32 i = 0; i < sm->numNodes; i++){
 		n = &sm->nodes[i];
 		for(int32 j = 0; j < 3; j++){
@@ -373,8 +386,6 @@ applyTunnel(StripMesh *sm, StripNode *end, StripNode *start)
 //trace("	");
 //printNode(sm, start);
 
-//printSmesh(sm);
-//trace("-------\n");
 	tmplist.init();
 	while(!sm->endNodes.isEmpty()){
 		n = LLLinkGetData(sm->endNodes.link.next, StripNode, inlist);
@@ -442,7 +453,8 @@ getNextEdge(StripNode *n, int32 last)
 #define RIGHT(x) NEXT(x)
 #define LEFT(x) PREV(x)
 
-/* Generate mesh indices for all strips in a StripMesh */
+/* Generate mesh indices for all strips in a StripMesh.
+ * m->indices32 needs space for five indices per node. */
 static void
 makeMesh(StripMesh *sm, Mesh *m)
 {
@@ -453,8 +465,7 @@ makeMesh(StripMesh *sm, Mesh *m)
 	StripNode *n;
 
 	/* three indices + two for stitch per triangle must be enough */
-	m->indices = rwNewT(uint16, sm->numNodes*5, MEMDUR_FUNCTION | ID_GEOMETRY);
-	memset(m->indices, 0xFF, sm->numNodes*5*sizeof(uint16));
+	memset(m->indices32, 0xFF, sm->numNodes*5*sizeof(uint32));
 
 	even = 1;
 	FORLIST(lnk, sm->endNodes){
@@ -477,13 +488,13 @@ makeMesh(StripMesh *sm, Mesh *m)
 		if(even){
 			/* Start with a right turn */
 			i = LEFT(j);
-			m->indices[m->numIndices++] = n->v[i];
-			m->indices[m->numIndices++] = n->v[NEXT(i)];
+			m->indices32[m->numIndices++] = n->v[i];
+			m->indices32[m->numIndices++] = n->v[NEXT(i)];
 		}else{
 			/* Start with a left turn */
 			i = RIGHT(j);
-			m->indices[m->numIndices++] = n->v[NEXT(i)];
-			m->indices[m->numIndices++] = n->v[i];
+			m->indices32[m->numIndices++] = n->v[NEXT(i)];
+			m->indices32[m->numIndices++] = n->v[i];
 		}
 trace("\nstart %d %d\n", numStripEdges(n), m->numIndices-2);
 		lastrightturn = -1;
@@ -492,7 +503,7 @@ trace("\nstart %d %d\n", numStripEdges(n), m->numIndices-2);
 			rightturn = RIGHT(i) == j;
 			if(rightturn == lastrightturn){
 				// insert a swap if we're not alternating
-				m->indices[m->numIndices] = m->indices[m->numIndices-2];
+				m->indices32[m->numIndices] = m->indices32[m->numIndices-2];
 trace("SWAP\n");
 				m->numIndices++;
 				even = !even;
@@ -500,9 +511,9 @@ trace("SWAP\n");
 trace("%d:%d%c %d %d %d\n", n-sm->nodes, m->numIndices, even ? ' ' : '.', n->v[0], n->v[1], n->v[2]);
 			lastrightturn = rightturn;
 			if(rightturn)
-				m->indices[m->numIndices++] = n->v[NEXT(j)];
+				m->indices32[m->numIndices++] = n->v[NEXT(j)];
 			else
-				m->indices[m->numIndices++] = n->v[j];
+				m->indices32[m->numIndices++] = n->v[j];
 			even = !even;
 
 			/* go to next triangle */
@@ -513,12 +524,12 @@ trace("%d:%d%c %d %d %d\n", n-sm->nodes, m->numIndices, even ? ' ' : '.', n->v[0
 
 		/* finish strip */
 trace("%d:%d%c %d %d %d\nend\n", n-sm->nodes, m->numIndices, even ? ' ' : '.', n->v[0], n->v[1], n->v[2]);
-		m->indices[m->numIndices++] = n->v[LEFT(i)];
+		m->indices32[m->numIndices++] = n->v[LEFT(i)];
 		even = !even;
 		if(seam){
-			m->indices[seam] = m->indices[seam-1];
-			m->indices[seam+1] = m->indices[seam+2];
-trace("STITCH %d: %d %d\n", seam, m->indices[seam], m->indices[seam+1]);
+			m->indices32[seam] = m->indices32[seam-1];
+			m->indices32[seam+1] = m->indices32[seam+2];
+trace("STITCH %d: %d %d\n", seam, m->indices32[seam], m->indices32[seam+1]);
 		}
 	}
 
@@ -528,155 +539,256 @@ trace("STITCH %d: %d %d\n", seam, m->indices[seam], m->indices[seam+1]);
 		if(numStripEdges(n) != 0)
 			continue;
 		if(m->numIndices != 0){
-			m->indices[m->numIndices] = m->indices[m->numIndices-1];
+			m->indices32[m->numIndices] = m->indices32[m->numIndices-1];
 			m->numIndices++;
-			m->indices[m->numIndices++] = n->v[!even];
+			m->indices32[m->numIndices++] = n->v[!even];
 		}
-		m->indices[m->numIndices++] = n->v[!even];
-		m->indices[m->numIndices++] = n->v[even];
-		m->indices[m->numIndices++] = n->v[2];
+		m->indices32[m->numIndices++] = n->v[!even];
+		m->indices32[m->numIndices++] = n->v[even];
+		m->indices32[m->numIndices++] = n->v[2];
 		even = !even;
 	}
 	FORLIST(lnk, sm->loneNodes){
 		n = LLLinkGetData(lnk, StripNode, inlist);
 		if(m->numIndices != 0){
-			m->indices[m->numIndices] = m->indices[m->numIndices-1];
+			m->indices32[m->numIndices] = m->indices32[m->numIndices-1];
 			m->numIndices++;
-			m->indices[m->numIndices++] = n->v[!even];
+			m->indices32[m->numIndices++] = n->v[!even];
 		}
-		m->indices[m->numIndices++] = n->v[!even];
-		m->indices[m->numIndices++] = n->v[even];
-		m->indices[m->numIndices++] = n->v[2];
+		m->indices32[m->numIndices++] = n->v[!even];
+		m->indices32[m->numIndices++] = n->v[even];
+		m->indices32[m->numIndices++] = n->v[2];
 		even = !even;
 	}
 }
 
 static void verifyMesh(Geometry *geo);
 
+struct StripJob
+{
+	StripMesh smesh;
+	Mesh mesh;
+};
+
 /*
- * For each material:
- * 1. build dual graph (collectFaces, connectNodes)
+ * 1. build dual graph (connectNodes)
  * 2. make some simple strip (buildStrips)
  * 3. apply tunnel operator (tunnel)
  */
+static void
+stripMeshJob(JobSystem::Job *job)
+{
+	StripJob *sj = &((StripJob*)job->data)[job->begin];
+	StripMesh *smesh = &sj->smesh;
+
+	smesh->loneNodes.init();
+	smesh->endNodes.init();
+	connectNodesPreserve(smesh);
+	buildStrips(smesh);
+	// TODO: make this work
+//	tunnel(smesh);
+
+	makeMesh(smesh, &sj->mesh);
+}
+
+/*
+ * Every material is stripped on its own, in parallel if the job system is running.
+ * All memory is allocated up front since function arenas are per thread.
+ * Strips are made with 32 bit indices and narrowed if the geometry doesn't need them.
+ */
 void
 Geometry::buildTristrips(void)
 {
-	int32 i;
-	uint16 *indices;
-	MeshHeader *header;
-	Mesh *ms, *md;
-	StripMesh smesh;
-
-//	trace("%ld\n", sizeof(StripNode));
-
-	this->allocateMeshes(matList.numMaterials, 0, 1);
-
-	smesh.nodes = rwNewT(StripNode, this->numTriangles, MEMDUR_FUNCTION | ID_GEOMETRY);
-	ms = this->meshHeader->getMeshes();
-	for(int32 i = 0; i < this->matList.numMaterials; i++){
-		smesh.loneNodes.init();
-		smesh.endNodes.init();
-		collectFaces(this, &smesh, i);
-		connectNodesPreserve(&smesh);
-		buildStrips(&smesh);
-printSmesh(&smesh);
-//trace("-------\n");
-//printLone(&smesh);
-//trace("-------\n");
-//printEnds(&smesh);
-//trace("-------\n");
-		// TODO: make this work
-//		tunnel(&smesh);
-//trace("-------\n");
-//printEnds(&smesh);
-
-		ms[i].material = this->matList.materials[i];
-		makeMesh(&smesh, &ms[i]);
-		this->meshHeader->totalIndices += ms[i].numIndices;
+	int32 i, numMeshes, hashSize;
+	uint32 totalIndices;
+	uint32 arena;
+	StripNode *nodes;
+	StripJob *sjobs;
+	JobSystem::Job *jobs;
+	int32 *offsets, *edgeHeads, *edgeNext;
+	uint32 *indices;
+	uint32 j;
+	Mesh *md;
+
+	numMeshes = this->matList.numMaterials;
+	arena = beginFunctionArena();
+	offsets = rwNewT(int32, numMeshes+1, MEMDUR_FUNCTION | ID_GEOMETRY);
+	sjobs = rwNewT(StripJob, numMeshes, MEMDUR_FUNCTION | ID_GEOMETRY);
+	jobs = rwNewT(JobSystem::Job, numMeshes, MEMDUR_FUNCTION | ID_GEOMETRY);
+	nodes = rwNewT(StripNode, this->numTriangles, MEMDUR_FUNCTION | ID_GEOMETRY);
+	edgeNext = rwNewT(int32, this->numTriangles*3, MEMDUR_FUNCTION | ID_GEOMETRY);
+	indices = rwNewT(uint32, this->numTriangles*5, MEMDUR_FUNCTION | ID_GEOMETRY);
+
+	/* sort triangles into meshes */
+	memset(offsets, 0, (numMeshes+1)*sizeof(int32));
+	for(i = 0; i < this->numTriangles; i++){
+		assert(this->triangles[i].matId < numMeshes);
+		offsets[this->triangles[i].matId+1]++;
+	}
+	hashSize = 0;
+	for(i = 0; i < numMeshes; i++){
+		StripMesh *sm = &sjobs[i].smesh;
+		sm->numNodes = 0;
+		sm->nodes = &nodes[offsets[i]];
+		sm->edgeNext = &edgeNext[offsets[i]*3];
+		/* at most half full */
+		sm->hashMask = 15;
+		while(sm->hashMask+1 < (uint32)offsets[i+1]*6)
+			sm->hashMask = sm->hashMask*2 + 1;
+		hashSize += sm->hashMask+1;
+		sjobs[i].mesh.material = this->matList.materials[i];
+		sjobs[i].mesh.indices32 = &indices[offsets[i]*5];
+		sjobs[i].mesh.numIndices = 0;
+		offsets[i+1] += offsets[i];
+	}
+	for(i = 0; i < this->numTriangles; i++){
+		Triangle *t = &this->triangles[i];
+		StripMesh *sm = &sjobs[t->matId].smesh;
+		assert(t->v[0] < (uint32)this->numVertices);
+		assert(t->v[1] < (uint32)this->numVertices);
+		assert(t->v[2] < (uint32)this->numVertices);
+		initNode(&sm->nodes[sm->numNodes++], t);
 	}
-	rwFree(smesh.nodes);
+	edgeHeads = rwNewT(int32, hashSize, MEMDUR_FUNCTION | ID_GEOMETRY);
+	hashSize = 0;
+	for(i = 0; i < numMeshes; i++){
+		sjobs[i].smesh.edgeHeads = &edgeHeads[hashSize];
+		hashSize += sjobs[i].smesh.hashMask+1;
+		jobs[i].func = stripMeshJob;
+		jobs[i].data = sjobs;
+		jobs[i].begin = i;
+		jobs[i].end = i+1;
+	}
+
+	JobSystem::run(jobs, numMeshes);
 
-	/* Now re-allocate and copy data */
-	header = this->meshHeader;
-	this->meshHeader = nil;
-	this->allocateMeshes(header->numMeshes, header->totalIndices, 0);
+	/* Now allocate and copy data */
+	totalIndices = 0;
+	for(i = 0; i < numMeshes; i++)
+		totalIndices += sjobs[i].mesh.numIndices;
+	this->allocateMeshes(numMeshes, totalIndices, 0, this->needsIndex32());
 	this->meshHeader->flags = MeshHeader::TRISTRIP;
 	md = this->meshHeader->getMeshes();
-	indices = md->indices;
-	for(i = 0; i < header->numMeshes; i++){
-		md[i].material = ms[i].material;
-		md[i].numIndices = ms[i].numIndices;
-		md[i].indices = indices;
-		indices += md[i].numIndices;
-		memcpy(md[i].indices, ms[i].indices, md[i].numIndices*sizeof(uint16));
-		rwFree(ms[i].indices);
+	for(i = 0; i < numMeshes; i++){
+		md[i].material = sjobs[i].mesh.material;
+		md[i].numIndices = sjobs[i].mesh.numIndices;
 	}
-	rwFree(header);
+	this->meshHeader->setupIndices();
+	for(i = 0; i < numMeshes; i++)
+		if(this->meshHeader->index32)
+			memcpy(md[i].indices32, sjobs[i].mesh.indices32, md[i].numIndices*sizeof(uint32));
+		else
+			for(j = 0; j < md[i].numIndices; j++)
+				md[i].indices[j] = sjobs[i].mesh.indices32[j];
+
+	rwFree(offsets);
+	rwFree(sjobs);
+	rwFree(jobs);
+	rwFree(nodes);
+	rwFree(edgeNext);
+	rwFree(indices);
+	rwFree(edgeHeads);
+	endFunctionArena(arena);
 
 	verifyMesh(this);
 }
 
-/* Check that tristripped mesh and geometry triangles are actually the same. */
+struct TriangleKey
+{
+	uint64 hi, lo;
+};
+
+/* Material and vertices rotated so the smallest comes first, winding is kept. */
+static TriangleKey
+triangleKey(uint32 m, uint32 a, uint32 b, uint32 c)
+{
+	TriangleKey k;
+	uint32 t;
+	if(b < a && b < c){
+		t = a; a = b; b = c; c = t;
+	}else if(c < a && c < b){
+		t = c; c = b; b = a; a = t;
+	}
+	k.hi = (uint64)m<<32 | a;
+	k.lo = (uint64)b<<32 | c;
+	return k;
+}
+
+static int
+cmpKeys(const void *a, const void *b)
+{
+	const TriangleKey *ka = (const TriangleKey*)a;
+	const TriangleKey *kb = (const TriangleKey*)b;
+	if(ka->hi != kb->hi)
+		return ka->hi < kb->hi ? -1 : 1;
+	return ka->lo < kb->lo ? -1 : ka->lo > kb->lo ? 1 : 0;
+}
+
+/* Check that tristripped mesh and geometry triangles are actually the same.
+ * Degenerate triangles are ignored on both sides. */
 static void
 verifyMesh(Geometry *geo)
 {
-	int32 i, k;
+	int32 i, k, n;
 	uint32 j;
 	int32 x;
-	int32 a, b, c, m;
+	uint32 a, b, c;
+	int32 m;
 	Mesh *mesh;
 	Triangle *t;
-	uint8 *seen;
-
-	seen = rwNewT(uint8, geo->numTriangles, MEMDUR_FUNCTION | ID_GEOMETRY);
-	memset(seen, 0, geo->numTriangles);
+	TriangleKey *keys, *stripKeys;
+	uint32 arena;
+
+	arena = beginFunctionArena();
+	keys = rwNewT(TriangleKey, geo->numTriangles, MEMDUR_FUNCTION | ID_GEOMETRY);
+	stripKeys = rwNewT(TriangleKey, geo->numTriangles, MEMDUR_FUNCTION | ID_GEOMETRY);
+	n = 0;
+	for(i = 0; i < geo->numTriangles; i++){
+		t = &geo->triangles[i];
+		if(t->v[0] == t->v[1] || t->v[0] == t->v[2] || t->v[1] == t->v[2])
+			continue;
+		keys[n++] = triangleKey(t->matId, t->v[0], t->v[1], t->v[2]);
+	}
 
+	k = 0;
 	mesh = geo->meshHeader->getMeshes();
 	for(i = 0; i < geo->meshHeader->numMeshes; i++){
 		m = geo->matList.findIndex(mesh->material);
 		x = 0;
-		for(j = 0; j < mesh->numIndices-2; j++){
-			a = mesh->indices[j+x];
+		for(j = 0; j+2 < mesh->numIndices; j++){
+			a = geo->meshHeader->getIndex(mesh, j+x);
 			x = !x;
-			b = mesh->indices[j+x];
-			c = mesh->indices[j+2];
-			if(a >= geo->numVertices ||
-			   b >= geo->numVertices ||
-			   c >= geo->numVertices){
+			b = geo->meshHeader->getIndex(mesh, j+x);
+			c = geo->meshHeader->getIndex(mesh, j+2);
+			if(a >= (uint32)geo->numVertices ||
+			   b >= (uint32)geo->numVertices ||
+			   c >= (uint32)geo->numVertices){
 				fprintf(stderr, "triangle %d %d %d out of range (%d)\n", a, b, c, geo->numVertices);
 				goto loss;
 			}
 			if(a == b || a == c || b == c)
 				continue;
 trace("%d %d %d\n", a, b, c);
-
-			/* now that we have a triangle, try to find it */
-			for(k = 0; k < geo->numTriangles; k++){
-				t = &geo->triangles[k];
-				if(seen[k] || t->matId != m) continue;
-				if((t->v[0] == a && t->v[1] == b && t->v[2] == c) ||
-				   (t->v[1] == a && t->v[2] == b && t->v[0] == c) ||
-				   (t->v[2] == a && t->v[0] == b && t->v[1] == c)){
-					seen[k] = 1;
-					goto found;
-				}
-			}
-			goto loss;
-		found:	;
+			if(k == n)
+				goto loss;
+			stripKeys[k++] = triangleKey(m, a, b, c);
 		}
 		mesh++;
 	}
+	if(k != n)
+		goto loss;
 
-	/* Also check that all triangles are in the mesh */
-	for(i = 0; i < geo->numTriangles; i++)
-		if(!seen[i]){
+	qsort(keys, n, sizeof(TriangleKey), cmpKeys);
+	qsort(stripKeys, n, sizeof(TriangleKey), cmpKeys);
+	if(memcmp(keys, stripKeys, n*sizeof(TriangleKey)) != 0){
 	loss:
-			fprintf(stderr, "TRISTRIP verify failed\n");
-			exit(1);
-		}
+		fprintf(stderr, "TRISTRIP verify failed\n");
+		exit(1);
+	}
 
-	rwFree(seen);
+	rwFree(keys);
+	rwFree(stripKeys);
+	endFunctionArena(arena);
 }
 
 }
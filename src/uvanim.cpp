@@ -93,8 +93,9 @@ fail:
 bool
 UVAnimDictionary::streamWrite(Stream *stream)
 {
-	uint32 size = this->streamGetSize();
-	writeChunkHeader(stream, ID_UVANIMDICT, size);
+	int32 chunk = beginChunk(stream, ID_UVANIMDICT);
+	if(chunk < 0)
+		writeChunkHeader(stream, ID_UVANIMDICT, this->streamGetSize());
 	writeChunkHeader(stream, ID_STRUCT, 4);
 	int32 numAnims = this->count();
 	stream->writeI32(numAnims);
@@ -102,6 +103,7 @@ UVAnimDictionary::streamWrite(Stream *stream)
 		UVAnimDictEntry *de = UVAnimDictEntry::fromDict(lnk);
 		de->anim->streamWrite(stream);
 	}
+	endChunk(stream, chunk);
 	return true;
 }
 
@@ -356,6 +358,23 @@ makeDummyAnimation(const char *name)
 	return anim;
 }
 
+// The dictionary is shared, so this happens on the main thread
+static void*
+findUVAnimCB(void *data)
+{
+	const char *name = (const char*)data;
+	Animation *anim = nil;
+	if(currentUVAnimDictionary)
+		anim = currentUVAnimDictionary->find(name);
+	if(anim == nil){
+		anim = makeDummyAnimation(name);
+		if(currentUVAnimDictionary)
+			currentUVAnimDictionary->add(anim);
+	}
+	UVAnimCustomData::get(anim)->refCount++;
+	return anim;
+}
+
 static Stream*
 readUVAnim(Stream *stream, int32, void *object, int32 offset, int32)
 {
@@ -370,20 +389,11 @@ readUVAnim(Stream *stream, int32, void *object, int32 offset, int32)
 	for(int32 i = 0; i < 8; i++){
 		if(mask & bit){
 			stream->read8(name, 32);
-			Animation *anim = nil;
-			if(currentUVAnimDictionary)
-				anim = currentUVAnimDictionary->find(name);
-			if(anim == nil){
-				anim = makeDummyAnimation(name);
-				if(currentUVAnimDictionary)
-					currentUVAnimDictionary->add(anim);
-			}
-			UVAnimCustomData *custom = UVAnimCustomData::get(anim);
+			Animation *anim = (Animation*)AsyncLoader::callMainThread(findUVAnimCB, name);
 			AnimInterpolator *interp;
 			interp = AnimInterpolator::create(anim->getNumNodes(),
 				anim->interpInfo->interpKeyFrameSize);
 			interp->setCurrentAnim(anim);
-			custom->refCount++;
 			uvanim->interp[i] = interp;
 		}
 		bit <<= 1;
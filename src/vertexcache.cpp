@@ -0,0 +1,453 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "rwbase.h"
+#include "rwerror.h"
+#include "rwplg.h"
+#include "rwpipeline.h"
+#include "rwobjects.h"
+#include "rwengine.h"
+#include "rwanim.h"
+#include "rwplugins.h"
+
+#define PLUGIN_ID ID_GEOMETRY
+
+namespace rw {
+
+/*
+ * Triangle order after Tom Forsyth's "Linear-Speed Vertex Cache Optimisation".
+ * Vertices are scored by their position in a simulated LRU cache and
+ * by how many triangles still use them, and the triangle with the
+ * best score among those touching the cache is emitted next.
+ */
+
+#define CACHESIZE 32
+#define CACHEDECAYPOWER 1.5f
+#define LASTTRISCORE 0.75f
+#define VALENCEBOOSTSCALE 2.0f
+#define VALENCEBOOSTPOWER 0.5f
+#define NUMVALENCESCORES 32
+
+struct CacheVertex
+{
+	int32 numActive;	// triangles not yet emitted
+	int32 start;	// into the adjacency list
+	int32 cachePos;
+	float32 score;
+};
+
+struct CacheScores
+{
+	float32 cache[CACHESIZE];
+	float32 valence[NUMVALENCESCORES];
+};
+
+static void
+initScores(CacheScores *s)
+{
+	int32 i;
+	for(i = 0; i < CACHESIZE; i++)
+		if(i < 3)
+			s->cache[i] = LASTTRISCORE;
+		else
+			s->cache[i] = powf(1.0f - (i-3)*(1.0f/(CACHESIZE-3)), CACHEDECAYPOWER);
+	s->valence[0] = 0.0f;
+	for(i = 1; i < NUMVALENCESCORES; i++)
+		s->valence[i] = VALENCEBOOSTSCALE*powf((float32)i, -VALENCEBOOSTPOWER);
+}
+
+static float32
+vertexScore(CacheScores *s, CacheVertex *v)
+{
+	float32 score;
+	if(v->numActive == 0)
+		return -1.0f;
+	score = v->cachePos >= 0 ? s->cache[v->cachePos] : 0.0f;
+	if(v->numActive < NUMVALENCESCORES)
+		score += s->valence[v->numActive];
+	else
+		score += VALENCEBOOSTSCALE*powf((float32)v->numActive, -VALENCEBOOSTPOWER);
+	return score;
+}
+
+// verts must be cleared (numActive 0, start and cachePos -1) and is left that way
+static void
+optimizeTriangles(Triangle *out, Triangle *tris, int32 n, CacheVertex *verts,
+	int32 *adj, float32 *triScores, uint8 *added, CacheScores *s)
+{
+	int32 cache[CACHESIZE+3], newCache[CACHESIZE+3];
+	int32 cacheLen, newLen;
+	int32 i, j, k, t, off, best, cursor;
+	float32 score, bestScore;
+	CacheVertex *v;
+	uint32 *tv;
+
+	// adjacency lists
+	for(t = 0; t < n; t++)
+		for(k = 0; k < 3; k++)
+			verts[tris[t].v[k]].numActive++;
+	off = 0;
+	for(t = 0; t < n; t++)
+		for(k = 0; k < 3; k++){
+			v = &verts[tris[t].v[k]];
+			if(v->start < 0){
+				v->start = off;
+				off += v->numActive;
+				v->numActive = 0;
+			}
+			adj[v->start + v->numActive++] = t;
+		}
+
+	for(t = 0; t < n; t++)
+		for(k = 0; k < 3; k++){
+			v = &verts[tris[t].v[k]];
+			v->score = vertexScore(s, v);
+		}
+	best = -1;
+	bestScore = -1.0f;
+	for(t = 0; t < n; t++){
+		tv = tris[t].v;
+		triScores[t] = verts[tv[0]].score + verts[tv[1]].score + verts[tv[2]].score;
+		added[t] = 0;
+		if(triScores[t] > bestScore){
+			bestScore = triScores[t];
+			best = t;
+		}
+	}
+
+	cacheLen = 0;
+	cursor = 0;
+	for(i = 0; i < n; i++){
+		// nothing in the cache is useful, start somewhere new
+		if(best < 0){
+			while(added[cursor])
+				cursor++;
+			best = cursor;
+		}
+		t = best;
+		added[t] = 1;
+		out[i] = tris[t];
+		tv = tris[t].v;
+
+		// the triangle's vertices go to the front of the cache
+		newLen = 0;
+		for(k = 0; k < 3; k++){
+			v = &verts[tv[k]];
+			for(j = 0; j < v->numActive; j++)
+				if(adj[v->start + j] == t){
+					adj[v->start + j] = adj[v->start + v->numActive - 1];
+					v->numActive--;
+					break;
+				}
+			for(j = 0; j < newLen; j++)
+				if(newCache[j] == (int32)tv[k])
+					break;
+			if(j == newLen)
+				newCache[newLen++] = tv[k];
+		}
+		for(j = 0; j < cacheLen; j++)
+			if(cache[j] != (int32)tv[0] && cache[j] != (int32)tv[1] && cache[j] != (int32)tv[2])
+				newCache[newLen++] = cache[j];
+
+		for(j = 0; j < newLen; j++){
+			v = &verts[newCache[j]];
+			v->cachePos = j < CACHESIZE ? j : -1;
+			v->score = vertexScore(s, v);
+		}
+		cacheLen = newLen < CACHESIZE ? newLen : CACHESIZE;
+		memcpy(cache, newCache, cacheLen*sizeof(int32));
+
+		// only triangles touching the cache changed
+		best = -1;
+		bestScore = -1.0f;
+		for(j = 0; j < cacheLen; j++){
+			v = &verts[cache[j]];
+			for(k = 0; k < v->numActive; k++){
+				t = adj[v->start + k];
+				tv = tris[t].v;
+				score = verts[tv[0]].score + verts[tv[1]].score + verts[tv[2]].score;
+				triScores[t] = score;
+				if(score > bestScore){
+					bestScore = score;
+					best = t;
+				}
+			}
+		}
+	}
+
+	for(j = 0; j < cacheLen; j++)
+		verts[cache[j]].cachePos = -1;
+	for(t = 0; t < n; t++)
+		for(k = 0; k < 3; k++)
+			verts[tris[t].v[k]].start = -1;
+}
+
+// Reorders triangles within each material, meshes are rebuilt to match.
+// Tristripped geometry keeps the strip order.
+// Instanced geometry is left alone, its buffers would go stale.
+void
+Geometry::optimizeTriangleOrder(void)
+{
+	CacheScores scores;
+	CacheVertex *verts;
+	Triangle *sorted;
+	int32 *adj, *offsets;
+	float32 *triScores;
+	uint8 *added;
+	int32 i, n, numMats;
+	uint32 arena;
+
+	if(this->flags & (NATIVE | TRISTRIP) || this->instData ||
+	   this->numTriangles == 0)
+		return;
+	if(this->meshHeader && this->meshHeader->flags & MeshHeader::TRISTRIP)
+		return;
+
+	arena = beginFunctionArena();
+	n = this->numTriangles;
+	numMats = this->matList.numMaterials > 0 ? this->matList.numMaterials : 1;
+	verts = rwNewT(CacheVertex, this->numVertices, MEMDUR_FUNCTION | ID_GEOMETRY);
+	sorted = rwNewT(Triangle, n, MEMDUR_FUNCTION | ID_GEOMETRY);
+	adj = rwNewT(int32, 3*n, MEMDUR_FUNCTION | ID_GEOMETRY);
+	offsets = rwNewT(int32, numMats+1, MEMDUR_FUNCTION | ID_GEOMETRY);
+	triScores = rwNewT(float32, n, MEMDUR_FUNCTION | ID_GEOMETRY);
+	added = rwNewT(uint8, n, MEMDUR_FUNCTION | ID_GEOMETRY);
+	if(verts == nil || sorted == nil || adj == nil || offsets == nil ||
+	   triScores == nil || added == nil){
+		RWERROR((ERR_ALLOC, n*(sizeof(Triangle) + 3*sizeof(int32) + sizeof(float32) + 1)));
+		goto out;
+	}
+	initScores(&scores);
+	for(i = 0; i < this->numVertices; i++){
+		verts[i].numActive = 0;
+		verts[i].start = -1;
+		verts[i].cachePos = -1;
+		verts[i].score = 0.0f;
+	}
+
+	// group by material, keeping the original order
+	memset(offsets, 0, (numMats+1)*sizeof(int32));
+	for(i = 0; i < n; i++){
+		assert(this->triangles[i].matId < numMats);
+		offsets[this->triangles[i].matId+1]++;
+	}
+	for(i = 0; i < numMats; i++)
+		offsets[i+1] += offsets[i];
+	for(i = 0; i < n; i++)
+		sorted[offsets[this->triangles[i].matId]++] = this->triangles[i];
+	for(i = numMats; i > 0; i--)
+		offsets[i] = offsets[i-1];
+	offsets[0] = 0;
+
+	for(i = 0; i < numMats; i++)
+		if(offsets[i+1] > offsets[i])
+			optimizeTriangles(&this->triangles[offsets[i]], &sorted[offsets[i]],
+				offsets[i+1] - offsets[i], verts, adj, triScores, added, &scores);
+
+	if(this->meshHeader)
+		this->buildMeshes();
+out:
+	rwFree(verts);
+	rwFree(sorted);
+	rwFree(adj);
+	rwFree(offsets);
+	rwFree(triScores);
+	rwFree(added);
+	endFunctionArena(arena);
+}
+
+static void
+permute(void *data, int32 size, int32 *remap, int32 n, uint8 *tmp)
+{
+	uint8 *dst = (uint8*)data;
+	int32 i;
+	memcpy(tmp, data, n*size);
+	for(i = 0; i < n; i++)
+		memcpy(&dst[remap[i]*size], &tmp[i*size], size);
+}
+
+// Renumbers vertices in the order the meshes first use them, so vertex fetches are
+// mostly sequential. All per-vertex data including skin weights is moved along.
+// Instanced geometry is left alone, as above.
+void
+Geometry::optimizeVertexOrder(void)
+{
+	int32 *remap;
+	uint8 *tmp;
+	Mesh *m;
+	Skin *skin;
+	int32 i, j, next;
+	uint32 k;
+	uint32 arena;
+
+	if(this->flags & NATIVE || this->instData || this->numVertices == 0)
+		return;
+
+	arena = beginFunctionArena();
+	remap = rwNewT(int32, this->numVertices, MEMDUR_FUNCTION | ID_GEOMETRY);
+	tmp = rwNewT(uint8, this->numVertices*sizeof(float32[4]), MEMDUR_FUNCTION | ID_GEOMETRY);
+	if(remap == nil || tmp == nil){
+		RWERROR((ERR_ALLOC, this->numVertices*(sizeof(int32) + sizeof(float32[4]))));
+		goto out;
+	}
+	for(i = 0; i < this->numVertices; i++)
+		remap[i] = -1;
+	next = 0;
+	if(this->meshHeader){
+		m = this->meshHeader->getMeshes();
+		for(i = 0; i < this->meshHeader->numMeshes; i++)
+			for(k = 0; k < m[i].numIndices; k++)
+				if(remap[this->meshHeader->getIndex(&m[i], k)] < 0)
+					remap[this->meshHeader->getIndex(&m[i], k)] = next++;
+	}
+	for(i = 0; i < this->numTriangles; i++)
+		for(j = 0; j < 3; j++)
+			if(remap[this->triangles[i].v[j]] < 0)
+				remap[this->triangles[i].v[j]] = next++;
+	// unused vertices go last
+	for(i = 0; i < this->numVertices; i++)
+		if(remap[i] < 0)
+			remap[i] = next++;
+	for(i = 0; i < this->numVertices; i++)
+		if(remap[i] != i)
+			break;
+	if(i == this->numVertices)
+		goto out;
+
+	for(i = 0; i < this->numMorphTargets; i++){
+		MorphTarget *mt = &this->morphTargets[i];
+		if(mt->vertices)
+			permute(mt->vertices, sizeof(V3d), remap, this->numVertices, tmp);
+		if(mt->normals)
+			permute(mt->normals, sizeof(V3d), remap, this->numVertices, tmp);
+	}
+	if(this->colors)
+		permute(this->colors, sizeof(RGBA), remap, this->numVertices, tmp);
+	for(i = 0; i < this->numTexCoordSets; i++)
+		if(this->texCoords[i])
+			permute(this->texCoords[i], sizeof(TexCoords), remap, this->numVertices, tmp);
+	skin = skinGlobals.geoOffset ? Skin::get(this) : nil;
+	if(skin && skin->indices && skin->weights){
+		permute(skin->indices, sizeof(uint8[4]), remap, this->numVertices, tmp);
+		permute(skin->weights, sizeof(float32[4]), remap, this->numVertices, tmp);
+	}
+
+	for(i = 0; i < this->numTriangles; i++)
+		for(j = 0; j < 3; j++)
+			this->triangles[i].v[j] = remap[this->triangles[i].v[j]];
+	if(this->meshHeader){
+		m = this->meshHeader->getMeshes();
+		for(i = 0; i < this->meshHeader->numMeshes; i++)
+			for(k = 0; k < m[i].numIndices; k++)
+				this->meshHeader->setIndex(&m[i], k,
+					remap[this->meshHeader->getIndex(&m[i], k)]);
+	}
+out:
+	rwFree(remap);
+	rwFree(tmp);
+	endFunctionArena(arena);
+}
+
+void
+Geometry::optimizeVertexCache(VertexCacheStats *before, VertexCacheStats *after)
+{
+	if(before)
+		this->getVertexCacheStats(before);
+	this->optimizeTriangleOrder();
+	this->optimizeVertexOrder();
+	if(after)
+		this->getVertexCacheStats(after);
+}
+
+struct CacheSim
+{
+	uint32 *stamps;	// 0 if never transformed
+	uint32 time;
+	uint32 cacheSize;
+	int32 numUsed;
+	int32 numTriangles;
+};
+
+static void
+simVertex(CacheSim *sim, uint32 v)
+{
+	if(sim->stamps[v] == 0)
+		sim->numUsed++;
+	else if(sim->time - sim->stamps[v] < sim->cacheSize)
+		return;
+	sim->stamps[v] = ++sim->time;
+}
+
+static void
+simTriangle(CacheSim *sim, uint32 a, uint32 b, uint32 c)
+{
+	if(a == b || b == c || a == c)
+		return;
+	simVertex(sim, a);
+	simVertex(sim, b);
+	simVertex(sim, c);
+	sim->numTriangles++;
+}
+
+// ACMR of 0.5 is the best a regular grid can do, 3 is no reuse at all.
+// ATVR of 1 means every vertex is transformed once.
+void
+Geometry::getVertexCacheStats(VertexCacheStats *stats, int32 cacheSize)
+{
+	CacheSim sim;
+	MeshHeader *mh;
+	Mesh *m;
+	int32 i;
+	uint32 k;
+	uint32 arena;
+
+	memset(stats, 0, sizeof(*stats));
+	if(this->flags & NATIVE || this->numVertices == 0)
+		return;
+	arena = beginFunctionArena();
+	sim.stamps = rwNewT(uint32, this->numVertices, MEMDUR_FUNCTION | ID_GEOMETRY);
+	if(sim.stamps == nil){
+		RWERROR((ERR_ALLOC, this->numVertices*sizeof(uint32)));
+		endFunctionArena(arena);
+		return;
+	}
+	memset(sim.stamps, 0, this->numVertices*sizeof(uint32));
+	sim.time = 0;
+	sim.cacheSize = cacheSize;
+	sim.numUsed = 0;
+	sim.numTriangles = 0;
+
+	mh = this->meshHeader;
+	if(mh){
+		m = mh->getMeshes();
+		for(i = 0; i < mh->numMeshes; i++){
+			if(mh->flags & MeshHeader::TRISTRIP){
+				for(k = 2; k < m[i].numIndices; k++)
+					simTriangle(&sim, mh->getIndex(&m[i], k-2),
+						mh->getIndex(&m[i], k-1), mh->getIndex(&m[i], k));
+			}else{
+				for(k = 2; k < m[i].numIndices; k += 3)
+					simTriangle(&sim, mh->getIndex(&m[i], k-2),
+						mh->getIndex(&m[i], k-1), mh->getIndex(&m[i], k));
+			}
+		}
+	}else{
+		for(i = 0; i < this->numTriangles; i++)
+			simTriangle(&sim, this->triangles[i].v[0],
+				this->triangles[i].v[1], this->triangles[i].v[2]);
+	}
+
+	stats->numTriangles = sim.numTriangles;
+	stats->numTransformed = sim.time;
+	if(sim.numTriangles)
+		stats->acmr = (float32)sim.time/sim.numTriangles;
+	if(sim.numUsed)
+		stats->atvr = (float32)sim.time/sim.numUsed;
+	rwFree(sim.stamps);
+	endFunctionArena(arena);
+}
+
+}
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <float.h>
 
 #include "rwbase.h"
 #include "rwerror.h"
@@ -10,17 +11,47 @@
 #include "rwobjects.h"
 #include "rwengine.h"
 
+#ifndef RW_PS2
+#define RW_THREADS
+#include <mutex>
+#endif
+
 #define PLUGIN_ID ID_WORLD
 
 namespace rw {
 
-int32 World::numAllocated = 0;
+AtomicInt32 World::numAllocated;
 
 PluginList World::s_plglist(sizeof(World));
 
+#ifdef RW_THREADS
+// Objects are moved between sectors during frame sync,
+// which may run on several threads
+static std::mutex sectorMutex;
+#define LOCK std::lock_guard<std::mutex> lock(sectorMutex)
+#else
+#define LOCK
+#endif
+
+#define MAXSECTORDEPTH 16
+
+// Sectors are made twice as big as the space they cover so objects
+// that straddle a split can still go further down.
+static void
+loosen(BBox *box)
+{
+	V3d d = scale(sub(box->sup, box->inf), 0.5f);
+	box->inf = sub(box->inf, d);
+	box->sup = add(box->sup, d);
+}
+
 World*
-World::create(BBox *bbox)
+World::create(BBox *bbox, int32 depth)
 {
+	WorldSector *s, *c;
+	int32 i;
+	float32 d[3], mid;
+
 	World *world = (World*)rwMalloc(s_plglist.size, MEMDUR_EVENT | ID_WORLD);
 	if(world == nil){
 		RWERROR((ERR_ALLOC, s_plglist.size));
@@ -31,6 +62,46 @@ World::create(BBox *bbox)
 	world->localLights.init();
 	world->globalLights.init();
 	world->clumps.init();
+	world->numAtomics = 0;
+	memset(&world->renderStats, 0, sizeof(world->renderStats));
+	world->occlusion = nil;
+
+	if(bbox == nil || depth < 1)
+		depth = 1;
+	if(depth > MAXSECTORDEPTH)
+		depth = MAXSECTORDEPTH;
+	world->numSectors = (1<<depth) - 1;
+	world->sectors = rwNewT(WorldSector, world->numSectors, MEMDUR_EVENT | ID_WORLD);
+	for(i = 0; i < world->numSectors; i++){
+		world->sectors[i].atomics.init();
+		world->sectors[i].lights.init();
+		world->sectors[i].numLights = 0;
+		world->sectors[i].axis = 0;
+		world->sectors[i].split = 0.0f;
+	}
+	if(bbox)
+		world->sectors[0].box = *bbox;
+	// split every sector in half along its longest axis
+	for(i = 0; 2*i+2 < world->numSectors; i++){
+		s = &world->sectors[i];
+		c = &world->sectors[2*i+1];
+		d[0] = s->box.sup.x - s->box.inf.x;
+		d[1] = s->box.sup.y - s->box.inf.y;
+		d[2] = s->box.sup.z - s->box.inf.z;
+		s->axis = d[0] >= d[1] && d[0] >= d[2] ? 0 :
+		          d[1] >= d[2] ? 1 : 2;
+		mid = ((float32*)&s->box.inf)[s->axis] + d[s->axis]/2.0f;
+		s->split = mid;
+		c[0].box = s->box;
+		c[1].box = s->box;
+		((float32*)&c[0].box.sup)[s->axis] = mid;
+		((float32*)&c[1].box.inf)[s->axis] = mid;
+	}
+	for(i = 1; i < world->numSectors; i++)
+		loosen(&world->sectors[i].box);
+	// the root takes everything else, so it's always visible
+	world->sectors[0].box.inf.set(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	world->sectors[0].box.sup.set(FLT_MAX, FLT_MAX, FLT_MAX);
 	s_plglist.construct(world);
 	return world;
 }
@@ -38,11 +109,111 @@ World::create(BBox *bbox)
 void
 World::destroy(void)
 {
+	int32 i;
 	s_plglist.destruct(this);
+	// don't leave anything pointing at the sectors
+	for(i = 0; i < this->numSectors; i++){
+		FORLIST(lnk, this->sectors[i].atomics)
+			LLLinkGetData(lnk, Atomic, inSector)->sector = nil;
+		FORLIST(lnk, this->sectors[i].lights)
+			LLLinkGetData(lnk, Light, inSector)->sector = nil;
+	}
+	rwFree(this->sectors);
 	rwFree(this);
 	numAllocated--;
 }
 
+static bool32
+sphereInBox(const Sphere *sph, const BBox *box)
+{
+	return sph->center.x - sph->radius >= box->inf.x &&
+	       sph->center.x + sph->radius <= box->sup.x &&
+	       sph->center.y - sph->radius >= box->inf.y &&
+	       sph->center.y + sph->radius <= box->sup.y &&
+	       sph->center.z - sph->radius >= box->inf.z &&
+	       sph->center.z + sph->radius <= box->sup.z;
+}
+
+// Deepest sector that contains the sphere,
+// the root if it's not completely inside the world
+WorldSector*
+World::findSector(const Sphere *sphere)
+{
+	int32 i, c;
+	WorldSector *s;
+	i = 0;
+	for(;;){
+		s = &this->sectors[i];
+		c = 2*i+1;
+		if(c >= this->numSectors)
+			break;
+		// the child that has the center
+		if(((float32*)&sphere->center)[s->axis] >= s->split)
+			c++;
+		if(!sphereInBox(sphere, &this->sectors[c].box))
+			break;
+		i = c;
+	}
+	return s;
+}
+
+// Called when the atomic's frame is synched.
+// The tree doesn't change, so only moving between sectors needs the lock.
+void
+World::updateSector(Atomic *atomic)
+{
+	WorldSector *sector;
+	if(atomic->getFrame())
+		sector = this->findSector(atomic->getWorldBoundingSphere());
+	else
+		sector = this->sectors;
+	if(sector == atomic->sector)
+		return;
+	LOCK;
+	if(atomic->sector)
+		atomic->inSector.remove();
+	sector->atomics.add(&atomic->inSector);
+	atomic->sector = sector;
+}
+
+// Keep count of the lights below each sector, called with the lock held
+static void
+countLight(World *world, WorldSector *sector, int32 n)
+{
+	int32 i = sector - world->sectors;
+	for(;;){
+		world->sectors[i].numLights += n;
+		if(i == 0)
+			break;
+		i = (i-1)/2;
+	}
+}
+
+void
+World::updateSector(Light *light)
+{
+	WorldSector *sector;
+	Sphere sphere;
+	if(light->getType() < Light::POINT)
+		return;
+	if(light->getFrame()){
+		sphere.center = light->getFrame()->getLTM()->pos;
+		sphere.radius = light->radius;
+		sector = this->findSector(&sphere);
+	}else
+		sector = this->sectors;
+	if(sector == light->sector)
+		return;
+	LOCK;
+	if(light->sector){
+		light->inSector.remove();
+		countLight(this, light->sector, -1);
+	}
+	sector->lights.add(&light->inSector);
+	countLight(this, sector, 1);
+	light->sector = sector;
+}
+
 void
 World::addLight(Light *light)
 {
@@ -52,6 +223,7 @@ World::addLight(Light *light)
 		this->globalLights.append(&light->inWorld);
 	}else{
 		this->localLights.append(&light->inWorld);
+		this->updateSector(light);
 		if(light->getFrame())
 			light->getFrame()->updateObjects();
 	}
@@ -62,6 +234,12 @@ World::removeLight(Light *light)
 {
 	assert(light->world == this);
 	light->inWorld.remove();
+	if(light->sector){
+		LOCK;
+		light->inSector.remove();
+		countLight(this, light->sector, -1);
+		light->sector = nil;
+	}
 	light->world = nil;
 }
 
@@ -86,6 +264,8 @@ World::addAtomic(Atomic *atomic)
 {
 	assert(atomic->world == nil);
 	atomic->world = this;
+	this->numAtomics++;
+	this->updateSector(atomic);
 	if(atomic->getFrame())
 		atomic->getFrame()->updateObjects();
 }
@@ -94,6 +274,12 @@ void
 World::removeAtomic(Atomic *atomic)
 {
 	assert(atomic->world == this);
+	if(atomic->sector){
+		LOCK;
+		atomic->inSector.remove();
+		atomic->sector = nil;
+	}
+	this->numAtomics--;
 	atomic->world = nil;
 }
 
@@ -130,12 +316,187 @@ World::removeClump(Clump *clump)
 	clump->world = nil;
 }
 
+/*
+ * Rendering: atomics in sectors that are completely visible are taken
+ * as they are, the bounding spheres of those in sectors on the frustum
+ * boundary are collected in separate arrays and tested in one go.
+ */
+struct CullList
+{
+	Atomic **atomics;	// to render
+	int32 numAtomics;
+	Atomic **candidates;	// to test
+	float32 *x, *y, *z, *r;
+	int32 numCandidates;
+};
+
+static void
+gatherSector(World *world, int32 i, Camera *cam, CullList *list)
+{
+	WorldSector *s;
+	Atomic *a;
+	Sphere *sph;
+	int32 n, res;
+	WorldRenderStats *stats = &world->renderStats;
+	// left child recursively, right child by looping
+	for(; i < world->numSectors; i = 2*i+2){
+		s = &world->sectors[i];
+		stats->numSectors++;
+		if(cam){
+			res = cam->frustumTestBBox(&s->box);
+			if(res == Camera::BOXOUTSIDE){
+				stats->numSectorsCulled++;
+				return;
+			}
+			// once a sector is completely visible its children are too
+			if(res == Camera::BOXINSIDE)
+				cam = nil;
+		}
+		FORLIST(lnk, s->atomics){
+			a = LLLinkGetData(lnk, Atomic, inSector);
+			if((a->object.object.flags & Atomic::RENDER) == 0)
+				continue;
+			stats->numAtomics++;
+			if(cam == nil || a->getFrame() == nil){
+				list->atomics[list->numAtomics++] = a;
+				continue;
+			}
+			sph = a->getWorldBoundingSphere();
+			n = list->numCandidates++;
+			list->candidates[n] = a;
+			list->x[n] = sph->center.x;
+			list->y[n] = sph->center.y;
+			list->z[n] = sph->center.z;
+			list->r[n] = sph->radius;
+		}
+		gatherSector(world, 2*i+1, cam, list);
+	}
+}
+
+// Rasterize the visible occluders and drop everything they hide
+static void
+occlusionCull(World *world, Camera *cam, CullList *list)
+{
+	OcclusionBuffer *ob = world->occlusion;
+	Atomic *a;
+	int32 i, n;
+
+	ob->begin(cam);
+	for(i = 0; i < list->numAtomics; i++){
+		a = list->atomics[i];
+		if(a->object.object.flags & Atomic::OCCLUDER)
+			ob->addOccluder(a);
+	}
+	ob->end();
+	n = 0;
+	for(i = 0; i < list->numAtomics; i++){
+		a = list->atomics[i];
+		if(a->object.object.flags & Atomic::OCCLUDER ||
+		   ob->isVisible(a->getWorldBoundingSphere()))
+			list->atomics[n++] = a;
+	}
+	world->renderStats.numOccluders = ob->stats.numOccluders;
+	world->renderStats.numOccluded = list->numAtomics - n;
+	list->numAtomics = n;
+}
+
 void
 World::render(void)
 {
-	// this is very wrong, we really want world sectors
-	FORLIST(lnk, this->clumps)
-		Clump::fromWorld(lnk)->render();
+	Camera *cam;
+	CullList list;
+	int32 *visible;
+	int32 i, n, numVisible;
+	uint8 *data;
+	uint32 arena;
+	bool32 queued;
+
+	cam = engine->currentCamera;
+	if(cam && cam->world != this)
+		cam = nil;
+	memset(&this->renderStats, 0, sizeof(this->renderStats));
+	n = this->numAtomics;
+	if(n == 0)
+		return;
+
+	arena = beginFunctionArena();
+	data = (uint8*)rwMalloc(n*(2*sizeof(Atomic*) + 4*sizeof(float32) + sizeof(int32)),
+		MEMDUR_FUNCTION | ID_WORLD);
+	list.atomics = (Atomic**)data;
+	list.candidates = list.atomics + n;
+	list.x = (float32*)(list.candidates + n);
+	list.y = list.x + n;
+	list.z = list.y + n;
+	list.r = list.z + n;
+	visible = (int32*)(list.r + n);
+	list.numAtomics = 0;
+	list.numCandidates = 0;
+
+	gatherSector(this, 0, cam, &list);
+	if(list.numCandidates > 0){
+		numVisible = cam->frustumTestSpheres(list.x, list.y, list.z, list.r,
+			list.numCandidates, visible);
+		this->renderStats.numTested = list.numCandidates;
+		this->renderStats.numCulled = list.numCandidates - numVisible;
+		for(i = 0; i < numVisible; i++)
+			list.atomics[list.numAtomics++] = list.candidates[visible[i]];
+	}
+	if(this->occlusion && cam && list.numAtomics > 0)
+		occlusionCull(this, cam, &list);
+	queued = RenderQueue::enabled && RenderQueue::begin();
+	for(i = 0; i < list.numAtomics; i++)
+		list.atomics[i]->render();
+	if(queued)
+		RenderQueue::flush();
+
+	rwFree(data);
+	endFunctionArena(arena);
+}
+
+static bool32
+sphereTouchesBox(const Sphere *sph, const BBox *box)
+{
+	float32 d, dist = 0.0f;
+	const float32 *c = (const float32*)&sph->center;
+	const float32 *inf = (const float32*)&box->inf;
+	const float32 *sup = (const float32*)&box->sup;
+	for(int32 i = 0; i < 3; i++){
+		if(c[i] < inf[i]){
+			d = inf[i] - c[i];
+			dist += d*d;
+		}else if(c[i] > sup[i]){
+			d = c[i] - sup[i];
+			dist += d*d;
+		}
+	}
+	return dist <= sph->radius*sph->radius;
+}
+
+// A light can only touch the sphere if its sector does,
+// so we only look at a few branches of the tree
+static void
+findLights(World *world, int32 i, Sphere *sphere, WorldLights *lightData, int32 maxLocals)
+{
+	WorldSector *s;
+	Light *l;
+	V3d dist;
+	for(; i < world->numSectors; i = 2*i+2){
+		s = &world->sectors[i];
+		if(s->numLights == 0 || !sphereTouchesBox(sphere, &s->box))
+			return;
+		FORLIST(lnk, s->lights){
+			if(lightData->numLocals >= maxLocals)
+				return;
+			l = LLLinkGetData(lnk, Light, inSector);
+			if((l->getFlags() & Light::LIGHTATOMICS) == 0)
+				continue;
+			// check if spheres are intersecting
+			dist = sub(l->getFrame()->getLTM()->pos, sphere->center);
+			if(length(dist) < sphere->radius + l->radius)
+				lightData->locals[lightData->numLocals++] = l;
+		}
+		findLights(world, 2*i+1, sphere, lightData, maxLocals);
+	}
 }
 
 // Find lights that illuminate an atomic
@@ -178,21 +539,7 @@ World::enumerateLights(Atomic *atomic, WorldLights *lightData)
 	if(!normals)
 		return;
 
-	// TODO: for this we would use an atomic's world sectors, but we don't have those yet
-	FORLIST(lnk, this->localLights){
-		if(lightData->numLocals >= maxLocals)
-			return;
-
-		Light *l = Light::fromWorld(lnk);
-		if((l->getFlags() & Light::LIGHTATOMICS) == 0)
-			continue;
-
-		// check if spheres are intersecting
-		Sphere *atomsphere = atomic->getWorldBoundingSphere();
-		V3d dist = sub(l->getFrame()->getLTM()->pos, atomsphere->center);
-		if(length(dist) < atomsphere->radius + l->radius)
-			lightData->locals[lightData->numLocals++] = l;
-	}
+	findLights(this, 0, atomic->getWorldBoundingSphere(), lightData, maxLocals);
 }
 
 // Find all lights, for im3d lighting extension
@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <chrono>
+
+#include <rw.h>
+
+using namespace rw;
+
+// Compares the scalar reference math against the vectorized versions
+
+#define NUM 10000
+#define RUNS 200
+#define TRIALS 5
+
+typedef std::chrono::steady_clock Clock;
+
+static float32
+frand(void)
+{
+	return rand()/(float32)RAND_MAX*2.0f - 1.0f;
+}
+
+static void
+randomMatrix(Matrix *m)
+{
+	V3d axis = { frand(), frand(), frand() };
+	m->setIdentity();
+	m->rotate(&axis, frand()*180.0f);
+	V3d trans = { frand()*100.0f, frand()*100.0f, frand()*100.0f };
+	m->translate(&trans);
+	m->update();
+}
+
+static double
+elapsed(Clock::time_point start)
+{
+	return std::chrono::duration<double, std::micro>(Clock::now() - start).count()/RUNS;
+}
+
+// Best of several trials, so cold caches and clock ramp-up
+// on the first one don't decide the result
+#define BENCH(result, code) do{ \
+	result = 1.0e30; \
+	for(int32 trial = 0; trial < TRIALS; trial++){ \
+		Clock::time_point t = Clock::now(); \
+		for(int32 r = 0; r < RUNS; r++) \
+			code; \
+		double dt = elapsed(t); \
+		if(dt < result) result = dt; \
+	} \
+}while(0)
+
+static void
+report(const char *name, double ref, double vec, bool same)
+{
+	printf("%-18s %9.1f us %9.1f us  %5.2fx  %s\n", name, ref, vec, ref/vec,
+		same ? "identical" : "DIFFERENT");
+}
+
+// padding is left alone by the math, so only look at the rest
+static bool
+sameMatrices(const Matrix *a, const Matrix *b, int32 n)
+{
+	for(int32 i = 0; i < n; i++)
+		if(memcmp(&a[i].right, &b[i].right, sizeof(V3d)) != 0 ||
+		   memcmp(&a[i].up, &b[i].up, sizeof(V3d)) != 0 ||
+		   memcmp(&a[i].at, &b[i].at, sizeof(V3d)) != 0 ||
+		   memcmp(&a[i].pos, &b[i].pos, sizeof(V3d)) != 0 ||
+		   a[i].flags != b[i].flags)
+			return false;
+	return true;
+}
+
+// a box shaped frustum around the origin
+static void
+setupFrustum(Camera *cam)
+{
+	static V3d normals[6] = {
+		{ 1.0f, 0.0f, 0.0f }, { -1.0f, 0.0f, 0.0f },
+		{ 0.0f, 1.0f, 0.0f }, { 0.0f, -1.0f, 0.0f },
+		{ 0.0f, 0.0f, 1.0f }, { 0.0f, 0.0f, -1.0f }
+	};
+	for(int32 i = 0; i < 6; i++){
+		cam->frustumPlanes[i].plane.normal = normals[i];
+		cam->frustumPlanes[i].plane.distance = 50.0f;
+	}
+}
+
+int
+main(void)
+{
+	Matrix *a, *b, *ref, *vec;
+	V3d *pts, *refPts, *vecPts;
+	float32 *sx, *sy, *sz, *sr;
+	int32 *refVis, *vecVis;
+	int32 numRef, numVec;
+	Camera cam;
+	double tref, tvec;
+	int32 i;
+
+	a = (Matrix*)malloc(NUM*sizeof(Matrix));
+	b = (Matrix*)malloc(NUM*sizeof(Matrix));
+	ref = (Matrix*)malloc(NUM*sizeof(Matrix));
+	vec = (Matrix*)malloc(NUM*sizeof(Matrix));
+	pts = (V3d*)malloc(NUM*sizeof(V3d));
+	refPts = (V3d*)malloc(NUM*sizeof(V3d));
+	vecPts = (V3d*)malloc(NUM*sizeof(V3d));
+	for(i = 0; i < NUM; i++){
+		randomMatrix(&a[i]);
+		randomMatrix(&b[i]);
+		pts[i].set(frand()*100.0f, frand()*100.0f, frand()*100.0f);
+	}
+	memset(ref, 0, NUM*sizeof(Matrix));
+	memset(vec, 0, NUM*sizeof(Matrix));
+
+	printf("%d matrices/points, best of %d x %d runs\n", NUM, TRIALS, RUNS);
+	printf("%-18s %12s %12s\n", "", "scalar", "vector");
+
+	BENCH(tref,
+		for(i = 0; i < NUM; i++)
+			Matrix::multRef_(&ref[i], &a[i], &b[i]));
+	BENCH(tvec,
+		for(i = 0; i < NUM; i++)
+			Matrix::mult_(&vec[i], &a[i], &b[i]));
+	report("mult_", tref, tvec, memcmp(ref, vec, NUM*sizeof(Matrix)) == 0);
+
+	BENCH(tvec,
+		Matrix::multBatch(vec, a, b, NUM));
+	for(i = 0; i < NUM; i++)
+		ref[i].flags = a[i].flags & b[i].flags;
+	report("multBatch", tref, tvec, memcmp(ref, vec, NUM*sizeof(Matrix)) == 0);
+	// in place, the way skinning uses it
+	memcpy(vec, b, NUM*sizeof(Matrix));
+	Matrix::multBatch(vec, a, vec, NUM);
+	printf("%-18s %37s\n", "multBatch in place",
+		sameMatrices(ref, vec, NUM) ? "identical" : "DIFFERENT");
+	memset(vec, 0, NUM*sizeof(Matrix));
+
+	BENCH(tref,
+		for(i = 0; i < NUM; i++)
+			Matrix::multRef_(&ref[i], &a[i], &b[0]));
+	BENCH(tvec,
+		Matrix::transformBatch(vec, a, &b[0], NUM));
+	for(i = 0; i < NUM; i++)
+		ref[i].flags = a[i].flags & b[0].flags;
+	report("transformBatch", tref, tvec, memcmp(ref, vec, NUM*sizeof(Matrix)) == 0);
+
+	BENCH(tref,
+		V3d::transformPointsRef(refPts, pts, NUM, &a[0]));
+	BENCH(tvec,
+		V3d::transformPoints(vecPts, pts, NUM, &a[0]));
+	report("transformPoints", tref, tvec, memcmp(refPts, vecPts, NUM*sizeof(V3d)) == 0);
+
+	BENCH(tref,
+		V3d::transformVectorsRef(refPts, pts, NUM, &a[0]));
+	BENCH(tvec,
+		V3d::transformVectors(vecPts, pts, NUM, &a[0]));
+	report("transformVectors", tref, tvec, memcmp(refPts, vecPts, NUM*sizeof(V3d)) == 0);
+
+	sx = (float32*)malloc(NUM*sizeof(float32));
+	sy = (float32*)malloc(NUM*sizeof(float32));
+	sz = (float32*)malloc(NUM*sizeof(float32));
+	sr = (float32*)malloc(NUM*sizeof(float32));
+	refVis = (int32*)malloc(NUM*sizeof(int32));
+	vecVis = (int32*)malloc(NUM*sizeof(int32));
+	for(i = 0; i < NUM; i++){
+		sx[i] = pts[i].x;
+		sy[i] = pts[i].y;
+		sz[i] = pts[i].z;
+		sr[i] = (frand()+1.0f)*10.0f;
+	}
+	setupFrustum(&cam);
+	numRef = numVec = 0;
+	BENCH(tref,
+		numRef = cam.frustumTestSpheresRef(sx, sy, sz, sr, NUM, refVis));
+	BENCH(tvec,
+		numVec = cam.frustumTestSpheres(sx, sy, sz, sr, NUM, vecVis));
+	report("frustumTestSpheres", tref, tvec, numRef == numVec &&
+		memcmp(refVis, vecVis, numRef*sizeof(int32)) == 0);
+
+	// rows of 64 pixels with a triangle edge cutting through
+	float32 *refRows = (float32*)malloc(NUM*64*sizeof(float32));
+	float32 *vecRows = (float32*)malloc(NUM*64*sizeof(float32));
+	float32 *edges = (float32*)malloc(NUM*8*sizeof(float32));
+	for(i = 0; i < NUM; i++){
+		float32 *e = &edges[i*8];
+		e[0] = frand()*32.0f;
+		e[1] = frand()*32.0f + 32.0f;
+		e[2] = 1.0f;
+		e[3] = frand();
+		e[4] = -1.0f;
+		e[5] = 0.0f;
+		e[6] = frand() + 1.0f;	// w
+		e[7] = frand()*0.01f;	// dw
+	}
+	memset(refRows, 0, NUM*64*sizeof(float32));
+	memset(vecRows, 0, NUM*64*sizeof(float32));
+	BENCH(tref,
+		for(i = 0; i < NUM; i++)
+			OcclusionBuffer::rasterizeRowRef(&refRows[i*64], 64, &edges[i*8],
+				&edges[i*8+3], edges[i*8+6], edges[i*8+7]));
+	BENCH(tvec,
+		for(i = 0; i < NUM; i++)
+			OcclusionBuffer::rasterizeRow(&vecRows[i*64], 64, &edges[i*8],
+				&edges[i*8+3], edges[i*8+6], edges[i*8+7]));
+	report("rasterizeRow", tref, tvec, memcmp(refRows, vecRows, NUM*64*sizeof(float32)) == 0);
+
+	free(a);
+	free(b);
+	free(ref);
+	free(vec);
+	free(pts);
+	free(refPts);
+	free(vecPts);
+	free(sx);
+	free(sy);
+	free(sz);
+	free(sr);
+	free(refVis);
+	free(vecVis);
+	free(refRows);
+	free(vecRows);
+	free(edges);
+	return 0;
+}